@@ -1,285 +1,2422 @@
 #include <assert.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <pthread.h>
 #include "btree.h"
 
-KeyValuePair::KeyValuePair()
-{}
-
-
-KeyValuePair::KeyValuePair(const KEY_T &k, const VALUE_T &v) :
-  key(k), value(v)
-{}
-
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <nmmintrin.h>
+#define BTREE_CRC32C_SSE42 1
+#endif
 
-KeyValuePair::KeyValuePair(const KeyValuePair &rhs) :
-  key(rhs.key), value(rhs.value)
-{}
+//
+// CRC32C (Castagnoli) of a buffer, continuing from crc.
+// Uses the SSE4.2 crc32 instruction when the CPU has it, which
+// keeps the per-block cost to a few nanoseconds, and a table
+// otherwise.
+//
+struct Crc32cLookup {
+  uint32_t table[256];
+
+  Crc32cLookup() {
+    for (uint32_t i=0;i<256;i++) {
+      uint32_t c=i;
+      for (int j=0;j<8;j++) {
+	c = (c&1) ? (c>>1)^0x82F63B78 : (c>>1);
+      }
+      table[i]=c;
+    }
+  }
+};
 
+static uint32_t Crc32cTable(uint32_t crc, const unsigned char *buf, size_t len)
+{
+  // built once, safely even if the first calls come from several
+  // threads
+  static const Crc32cLookup lookup;
 
-KeyValuePair::~KeyValuePair()
-{}
+  while (len--) {
+    crc = lookup.table[(crc^*buf++)&0xff]^(crc>>8);
+  }
+  return crc;
+}
 
+#ifdef BTREE_CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t Crc32cSSE42(uint32_t crc, const unsigned char *buf, size_t len)
+{
+#if defined(__x86_64__)
+  uint64_t c=crc;
+  while (len>=8) {
+    uint64_t w;
+    memcpy(&w,buf,8);
+    c=_mm_crc32_u64(c,w);
+    buf+=8;
+    len-=8;
+  }
+  crc=(uint32_t)c;
+#endif
+  while (len--) {
+    crc=_mm_crc32_u8(crc,*buf++);
+  }
+  return crc;
+}
+#endif
 
-KeyValuePair & KeyValuePair::operator=(const KeyValuePair &rhs)
+static uint32_t Crc32c(uint32_t crc, const void *data, size_t len)
 {
-  return *( new (this) KeyValuePair(rhs));
+  const unsigned char *buf = (const unsigned char *)data;
+#ifdef BTREE_CRC32C_SSE42
+  static const bool hw = __builtin_cpu_supports("sse4.2");
+  if (hw) {
+    return Crc32cSSE42(crc,buf,len);
+  }
+#endif
+  return Crc32cTable(crc,buf,len);
 }
 
-BTreeIndex::BTreeIndex(SIZE_T keysize,
-		       SIZE_T valuesize,
-		       BufferCache *cache,
-		       bool unique)
+// The checksum sits in the last bytes of the node's data area.
+// Header fields are folded in one at a time rather than as raw
+// NodeMetadata bytes, so struct padding never enters the sum.
+static SIZE_T NodeDataBytes(const BTreeNode &b)
 {
-  superblock.info.keysize=keysize;
-  superblock.info.valuesize=valuesize;
-  buffercache=cache;
-  // note: ignoring unique now
+  return b.info.blocksize-sizeof(NodeMetadata);
+}
 
-  //Calculate max number of keys per block
-  SIZE_T blockSize = buffercache->GetBlockSize();
-  maxNumKeys = (blockSize - sizeof(NodeMetadata))/(16);
+static uint32_t NodeChecksum(const BTreeNode &b)
+{
+  uint32_t crc = 0xffffffff;
+
+  crc=Crc32c(crc,&b.info.nodetype,sizeof(b.info.nodetype));
+  crc=Crc32c(crc,&b.info.keysize,sizeof(b.info.keysize));
+  crc=Crc32c(crc,&b.info.valuesize,sizeof(b.info.valuesize));
+  crc=Crc32c(crc,&b.info.blocksize,sizeof(b.info.blocksize));
+  crc=Crc32c(crc,&b.info.rootnode,sizeof(b.info.rootnode));
+  crc=Crc32c(crc,&b.info.freelist,sizeof(b.info.freelist));
+  crc=Crc32c(crc,&b.info.numkeys,sizeof(b.info.numkeys));
+  crc=Crc32c(crc,b.data,NodeDataBytes(b)-BTREE_CHECKSUM_BYTES);
+  return ~crc;
 }
 
-BTreeIndex::BTreeIndex()
+// Free blocks only have their header written, so they carry no sum
+static void StampChecksum(BTreeNode &b)
 {
-  // shouldn't have to do anything
+  if (b.info.nodetype==BTREE_UNALLOCATED_BLOCK || !b.data) {
+    return;
+  }
+  uint32_t crc = NodeChecksum(b);
+  memcpy(b.data+NodeDataBytes(b)-BTREE_CHECKSUM_BYTES,&crc,BTREE_CHECKSUM_BYTES);
 }
 
+static bool ChecksumOK(const BTreeNode &b)
+{
+  uint32_t crc;
+
+  if (b.info.nodetype==BTREE_UNALLOCATED_BLOCK || !b.data) {
+    return true;
+  }
+  if (b.info.blocksize<=sizeof(NodeMetadata)+BTREE_CHECKSUM_BYTES) {
+    // header itself is garbage
+    return false;
+  }
+  memcpy(&crc,b.data+NodeDataBytes(b)-BTREE_CHECKSUM_BYTES,BTREE_CHECKSUM_BYTES);
+  return crc==NodeChecksum(b);
+}
 
 //
-// Note, will not attach!
+// Compressed leaves.  In memory a compressed leaf is an ordinary
+// leaf whose blocksize is BTREE_COMPRESSED_LEAF_FACTOR times the
+// physical one, so it has room for many more slots.  On disk it is
+// a BTREE_COMPRESSED_LEAF_NODE block: the leaf pointer followed by
+// each entry delta-encoded against the previous one as
 //
-BTreeIndex::BTreeIndex(const BTreeIndex &rhs)
+//   [shared key prefix length][key suffix][shared value prefix length][value suffix]
+//
+// Sorted integer-like keys share most of their leading bytes with
+// their neighbours, so they shrink to a byte or two each.
+//
+static SIZE_T SharedPrefix(const char *a, const char *b, const SIZE_T n)
 {
-  buffercache=rhs.buffercache;
-  superblock_index=rhs.superblock_index;
-  superblock=rhs.superblock;
+  SIZE_T i;
+
+  for (i=0;i<n && i<255 && a[i]==b[i];i++) {
+  }
+  return i;
 }
 
-BTreeIndex::~BTreeIndex()
+static SIZE_T CompressedEntryBytes(const BTreeNode &b, const SIZE_T offset)
 {
-  // shouldn't have to do anything
-}
+  SIZE_T kp=0;
+  SIZE_T vp=0;
 
+  if (offset>0) {
+    kp=SharedPrefix(b.ResolveKey(offset-1),b.ResolveKey(offset),b.info.keysize);
+    vp=SharedPrefix(b.ResolveVal(offset-1),b.ResolveVal(offset),b.info.valuesize);
+  }
+  return 2+(b.info.keysize-kp)+(b.info.valuesize-vp);
+}
 
-BTreeIndex & BTreeIndex::operator=(const BTreeIndex &rhs)
+static SIZE_T CompressedLeafBytes(const BTreeNode &b)
 {
-  return *(new(this)BTreeIndex(rhs));
+  SIZE_T bytes = sizeof(SIZE_T);
+
+  for (SIZE_T offset=0;offset<b.info.numkeys;offset++) {
+    bytes+=CompressedEntryBytes(b,offset);
+  }
+  return bytes;
 }
 
+// Room for compressed entries in one physical block
+static SIZE_T CompressedLeafCapacity(const SIZE_T blocksize)
+{
+  return blocksize-sizeof(NodeMetadata)-BTREE_CHECKSUM_BYTES;
+}
 
-ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
+// Where to cut a compressed leaf so both halves get about the
+// same number of encoded bytes
+static SIZE_T CompressedLeafSplitPoint(const BTreeNode &b)
 {
-  n=superblock.info.freelist;
+  SIZE_T half = CompressedLeafBytes(b)/2;
+  SIZE_T bytes = sizeof(SIZE_T);
+  SIZE_T offset;
 
-  if (n==0) {
-    return ERROR_NOSPACE;
+  for (offset=0;offset+1<b.info.numkeys;offset++) {
+    bytes+=CompressedEntryBytes(b,offset);
+    if (bytes>=half) {
+      break;
+    }
   }
+  return offset+1;
+}
 
-  BTreeNode node;
+static ERROR_T CompressLeaf(const BTreeNode &leaf, BTreeNode &packed, const SIZE_T blocksize)
+{
+  SIZE_T capacity = CompressedLeafCapacity(blocksize);
+  SIZE_T kp;
+  SIZE_T vp;
+  char *out;
 
-  node.Unserialize(buffercache,n);
+  if (CompressedLeafBytes(leaf)>capacity) {
+    return ERROR_SIZE;
+  }
 
-  assert(node.info.nodetype==BTREE_UNALLOCATED_BLOCK);
+  packed = BTreeNode(BTREE_LEAF_NODE,leaf.info.keysize,leaf.info.valuesize,blocksize);
+  packed.info.nodetype=BTREE_COMPRESSED_LEAF_NODE;
+  packed.info.rootnode=leaf.info.rootnode;
+  packed.info.freelist=leaf.info.freelist;
+  packed.info.numkeys=leaf.info.numkeys;
+
+  out=packed.data;
+  memcpy(out,leaf.ResolvePtr(0),sizeof(SIZE_T));
+  out+=sizeof(SIZE_T);
+  for (SIZE_T offset=0;offset<leaf.info.numkeys;offset++) {
+    kp=vp=0;
+    if (offset>0) {
+      kp=SharedPrefix(leaf.ResolveKey(offset-1),leaf.ResolveKey(offset),leaf.info.keysize);
+      vp=SharedPrefix(leaf.ResolveVal(offset-1),leaf.ResolveVal(offset),leaf.info.valuesize);
+    }
+    *out++=(char)kp;
+    memcpy(out,leaf.ResolveKey(offset)+kp,leaf.info.keysize-kp);
+    out+=leaf.info.keysize-kp;
+    *out++=(char)vp;
+    memcpy(out,leaf.ResolveVal(offset)+vp,leaf.info.valuesize-vp);
+    out+=leaf.info.valuesize-vp;
+  }
+  return ERROR_NOERROR;
+}
 
-  superblock.info.freelist=node.info.freelist;
+static ERROR_T DecompressLeaf(const BTreeNode &packed, BTreeNode &leaf)
+{
+  const char *in = packed.data;
+  const char *end = packed.data+CompressedLeafCapacity(packed.info.blocksize);
+  SIZE_T keysize = packed.info.keysize;
+  SIZE_T valuesize = packed.info.valuesize;
+  SIZE_T kp;
+  SIZE_T vp;
+
+  leaf = BTreeNode(BTREE_LEAF_NODE,keysize,valuesize,
+		   BTREE_COMPRESSED_LEAF_FACTOR*packed.info.blocksize);
+  leaf.info.rootnode=packed.info.rootnode;
+  leaf.info.freelist=packed.info.freelist;
+  leaf.info.numkeys=packed.info.numkeys;
+
+  if (leaf.info.numkeys>(NodeDataBytes(leaf)-sizeof(SIZE_T))/(keysize+valuesize)) {
+    return ERROR_INSANE;
+  }
 
-  superblock.Serialize(buffercache,superblock_index);
+  memcpy(leaf.ResolvePtr(0),in,sizeof(SIZE_T));
+  in+=sizeof(SIZE_T);
+  for (SIZE_T offset=0;offset<leaf.info.numkeys;offset++) {
+    if (in>=end) { return ERROR_INSANE; }
+    kp=(unsigned char)*in++;
+    if (kp>keysize || (offset==0 && kp>0) || in+(keysize-kp)+1>end) { return ERROR_INSANE; }
+    if (kp) {
+      memcpy(leaf.ResolveKey(offset),leaf.ResolveKey(offset-1),kp);
+    }
+    memcpy(leaf.ResolveKey(offset)+kp,in,keysize-kp);
+    in+=keysize-kp;
+    vp=(unsigned char)*in++;
+    if (vp>valuesize || (offset==0 && vp>0) || in+(valuesize-vp)>end) { return ERROR_INSANE; }
+    if (vp) {
+      memcpy(leaf.ResolveVal(offset),leaf.ResolveVal(offset-1),vp);
+    }
+    memcpy(leaf.ResolveVal(offset)+vp,in,valuesize-vp);
+    in+=valuesize-vp;
+  }
+  return ERROR_NOERROR;
+}
 
-  buffercache->NotifyAllocateBlock(n);
+// Index-wide options live in the first word of the superblock's data
+static uint32_t GetSuperblockFlags(const BTreeNode &sb)
+{
+  uint32_t flags;
 
-  return ERROR_NOERROR;
+  memcpy(&flags,sb.data,sizeof(flags));
+  return flags;
 }
 
+static void SetSuperblockFlags(BTreeNode &sb, const uint32_t flags)
+{
+  memcpy(sb.data,&flags,sizeof(flags));
+}
 
-ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
+// Where the key filter is stored, following the flags word.
+// head is 0 if there is no filter.
+struct FilterHeader {
+  uint64_t head;
+  uint64_t bits;
+  uint64_t keys;
+  uint32_t hashes;
+  uint32_t clean;  // 0 if it may be missing keys in the tree
+};
+
+static FilterHeader GetSuperblockFilter(const BTreeNode &sb)
 {
-  BTreeNode node;
+  FilterHeader fh;
 
-  node.Unserialize(buffercache,n);
+  memcpy(&fh,sb.data+sizeof(uint32_t),sizeof(fh));
+  return fh;
+}
 
-  assert(node.info.nodetype!=BTREE_UNALLOCATED_BLOCK);
+static void SetSuperblockFilter(BTreeNode &sb, const FilterHeader &fh)
+{
+  memcpy(sb.data+sizeof(uint32_t),&fh,sizeof(fh));
+}
 
-  node.info.nodetype=BTREE_UNALLOCATED_BLOCK;
+// Where the hot set is stored, following the filter header.
+// head is 0 if there is none.
+struct HotSetHeader {
+  uint64_t head;
+  uint64_t count;
+};
 
-  node.info.freelist=superblock.info.freelist;
+static HotSetHeader GetSuperblockHotSet(const BTreeNode &sb)
+{
+  HotSetHeader hh;
 
-  node.Serialize(buffercache,n);
+  memcpy(&hh,sb.data+sizeof(uint32_t)+sizeof(FilterHeader),sizeof(hh));
+  return hh;
+}
 
-  superblock.info.freelist=n;
+static void SetSuperblockHotSet(BTreeNode &sb, const HotSetHeader &hh)
+{
+  memcpy(sb.data+sizeof(uint32_t)+sizeof(FilterHeader),&hh,sizeof(hh));
+}
 
-  superblock.Serialize(buffercache,superblock_index);
+// A hot set block's data is the next block's number and then
+// numkeys block numbers
+static SIZE_T HotSetBlockCapacity(const SIZE_T blocksize)
+{
+  return (blocksize-sizeof(NodeMetadata)-sizeof(SIZE_T)-BTREE_CHECKSUM_BYTES)/sizeof(SIZE_T);
+}
 
-  buffercache->NotifyDeallocateBlock(n);
+// A filter block's data is the next block's number, the bits, and
+// the checksum trailer
+static SIZE_T FilterBlockBytes(const SIZE_T blocksize)
+{
+  return blocksize-sizeof(NodeMetadata)-sizeof(SIZE_T)-BTREE_CHECKSUM_BYTES;
+}
 
-  return ERROR_NOERROR;
+enum MessageOp {MESSAGE_INSERT=1, MESSAGE_UPDATE=2};
 
+//
+// With message buffers an interior node keeps half its usual keys,
+// and the rest of its data, up to the checksum trailer, holds a
+// count and then fixed-size [op][key][value] messages in arrival
+// order.  There is at most one message per key in a buffer.
+//
+static void MessageLayout(const SIZE_T blocksize,
+			  const SIZE_T keysize,
+			  const SIZE_T valuesize,
+			  const SIZE_T maxkeys,
+			  SIZE_T &interiorkeys,
+			  SIZE_T &offset,
+			  SIZE_T &capacity)
+{
+  SIZE_T end = blocksize-sizeof(NodeMetadata)-BTREE_CHECKSUM_BYTES;
+
+  interiorkeys=maxkeys/2;
+  // with room for the extra key a node holds just before it splits
+  offset=(interiorkeys+2)*(sizeof(SIZE_T)+keysize);
+  capacity=0;
+  if (end>offset+sizeof(uint32_t)) {
+    capacity=(end-offset-sizeof(uint32_t))/(1+keysize+valuesize);
+  }
 }
 
-ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
+//
+// How many keys leaves and interior nodes may hold before they
+// split, given what their entries take: no more than maxkeys (the
+// estimate the constructor makes before the sizes are known), and no
+// more than fit.  A non-unique index's valuesize already includes
+// the posting list head, and a compressed leaf is a bigger block in
+// memory.
+//
+static void NodeCapacities(const SIZE_T blocksize,
+			   const SIZE_T keysize,
+			   const SIZE_T valuesize,
+			   const SIZE_T maxkeys,
+			   const uint32_t flags,
+			   SIZE_T &leafkeys,
+			   SIZE_T &interiorkeys)
 {
-  ERROR_T rc;
+  SIZE_T overhead = sizeof(NodeMetadata)+sizeof(SIZE_T)+BTREE_CHECKSUM_BYTES;
+  SIZE_T leafblock = blocksize;
+  SIZE_T limit = maxkeys;
+  SIZE_T fit;
+
+  if (flags & BTREE_FLAG_COMPRESSED_LEAVES) {
+    leafblock=BTREE_COMPRESSED_LEAF_FACTOR*blocksize;
+    limit=BTREE_COMPRESSED_LEAF_FACTOR*maxkeys;
+  }
+  fit = leafblock>overhead ? (leafblock-overhead)/(keysize+valuesize) : 0;
+  leafkeys = fit<limit ? fit : limit;
 
-  superblock_index=initblock;
-  assert(superblock_index==0);
+  fit = blocksize>overhead ? (blocksize-overhead)/(keysize+sizeof(SIZE_T)) : 0;
+  interiorkeys = fit<maxkeys ? fit : maxkeys;
+}
 
-  if (create) {
-    // build a super block, root node, and a free space list
-    //
-    // Superblock at superblock_index
-    // root node at superblock_index+1
-    // free space list for rest
-    BTreeNode newsuperblock(BTREE_SUPERBLOCK,
-			    superblock.info.keysize,
-			    superblock.info.valuesize,
-			    buffercache->GetBlockSize());
-    newsuperblock.info.rootnode=superblock_index+1;
-    newsuperblock.info.freelist=superblock_index+2;
-    newsuperblock.info.numkeys=0;
+class MessageBuffer {
+ private:
+  char  *base;
+  SIZE_T keysize;
+  SIZE_T valuesize;
+  SIZE_T capacity;
 
-    buffercache->NotifyAllocateBlock(superblock_index);
+  SIZE_T Size() const { return 1+keysize+valuesize; }
 
-    rc=newsuperblock.Serialize(buffercache,superblock_index);
+ public:
+  MessageBuffer(const BTreeNode &b, const SIZE_T offset, const SIZE_T capacity) :
+    base(b.data+offset), keysize(b.info.keysize), valuesize(b.info.valuesize),
+    capacity(capacity) {}
 
-    if (rc) {
-      return rc;
+  SIZE_T Count() const {
+    uint32_t n;
+    memcpy(&n,base,sizeof(n));
+    return n;
+  }
+  void SetCount(const SIZE_T count) {
+    uint32_t n = count;
+    memcpy(base,&n,sizeof(n));
+  }
+  void Reset() { SetCount(0); }
+  SIZE_T Free() const { return capacity-Count(); }
+
+  char *Message(const SIZE_T i) const { return base+sizeof(uint32_t)+i*Size(); }
+  int Op(const SIZE_T i) const { return (unsigned char)Message(i)[0]; }
+  char *Key(const SIZE_T i) const { return Message(i)+1; }
+  char *Val(const SIZE_T i) const { return Message(i)+1+keysize; }
+
+  // index of key's message, or Count() if there is none
+  SIZE_T Find(const KEY_VIEW_T &key) const {
+    SIZE_T i;
+    SIZE_T n = Count();
+    for (i=0;i<n;i++) {
+      if (CompareKeys(key,KEY_VIEW_T(Key(i),keysize))==0) {
+	break;
+      }
     }
+    return i;
+  }
 
-    BTreeNode newrootnode(BTREE_ROOT_NODE,
-			  superblock.info.keysize,
-			  superblock.info.valuesize,
-			  buffercache->GetBlockSize());
-    newrootnode.info.rootnode=superblock_index+1;
-    newrootnode.info.freelist=superblock_index+2;
-    newrootnode.info.numkeys=0;
+  // Add a message, or fold it into the one already there for its
+  // key.  An update to a pending insert is still an insert.  Returns
+  // false if the buffer is full.
+  bool Put(const int op, const char *key, const char *val) {
+    SIZE_T i = Find(KEY_VIEW_T(key,keysize));
+    if (i<Count()) {
+      if (Op(i)!=MESSAGE_INSERT) {
+	Message(i)[0]=(char)op;
+      }
+      memcpy(Val(i),val,valuesize);
+      return true;
+    }
+    if (!Free()) {
+      return false;
+    }
+    Message(i)[0]=(char)op;
+    memcpy(Key(i),key,keysize);
+    memcpy(Val(i),val,valuesize);
+    SetCount(i+1);
+    return true;
+  }
 
-    buffercache->NotifyAllocateBlock(superblock_index+1);
+  void Remove(const SIZE_T i) {
+    SIZE_T n = Count();
+    memmove(Message(i),Message(i+1),(n-i-1)*Size());
+    SetCount(n-1);
+  }
+};
 
-    rc=newrootnode.Serialize(buffercache,superblock_index+1);
+KeyValuePair::KeyValuePair()
+{}
 
-    if (rc) {
-      return rc;
-    }
 
-    for (SIZE_T i=superblock_index+2; i<buffercache->GetNumBlocks();i++) {
-      BTreeNode newfreenode(BTREE_UNALLOCATED_BLOCK,
-			    superblock.info.keysize,
-			    superblock.info.valuesize,
-			    buffercache->GetBlockSize());
-      newfreenode.info.rootnode=superblock_index+1;
-      newfreenode.info.freelist= ((i+1)==buffercache->GetNumBlocks()) ? 0: i+1;
+KeyValuePair::KeyValuePair(const KEY_T &k, const VALUE_T &v) :
+  key(k), value(v)
+{}
 
-      rc = newfreenode.Serialize(buffercache,i);
 
-      if (rc) {
-	return rc;
-      }
+KeyValuePair::KeyValuePair(const KeyValuePair &rhs) :
+  key(rhs.key), value(rhs.value)
+{}
 
-    }
-  }
 
-  // OK, now, mounting the btree is simply a matter of reading the superblock
+KeyValuePair::~KeyValuePair()
+{}
+
 
-  return superblock.Unserialize(buffercache,initblock);
+KeyValuePair & KeyValuePair::operator=(const KeyValuePair &rhs)
+{
+  if (this!=&rhs) {
+    key=rhs.key;
+    value=rhs.value;
+  }
+  return *this;
 }
 
+#if __cplusplus >= 201103L
+KeyValuePair::KeyValuePair(KeyValuePair &&rhs) :
+  key(std::move(rhs.key)), value(std::move(rhs.value))
+{}
+
 
-ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
+KeyValuePair & KeyValuePair::operator=(KeyValuePair &&rhs)
 {
-  return superblock.Serialize(buffercache,superblock_index);
+  if (this!=&rhs) {
+    key=std::move(rhs.key);
+    value=std::move(rhs.value);
+  }
+  return *this;
 }
+#endif
 
 
-ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
-					   const BTreeOp op,
-					   const KEY_T &key,
-					   VALUE_T &value)
+BTreeNodeCache::BTreeNodeCache(BTreeNodeWriter *b, const BTreeCachePolicy p, const SIZE_T c,
+			       const SIZE_T l) :
+  backing(b), writeerror(ERROR_NOERROR), policy(p), capacity(c), pinlimit(l),
+  epoch(0), top(0)
 {
-  BTreeNode b;
-  ERROR_T rc; // error checker
-  SIZE_T offset;
-  KEY_T testkey;
-  SIZE_T ptr;
+  ResetStats();
+}
 
-  rc= b.Unserialize(buffercache,node);
+//
+// Note, copies the configuration only, not the cached nodes
+//
+BTreeNodeCache::BTreeNodeCache(const BTreeNodeCache &rhs) :
+  backing(rhs.backing), writeerror(ERROR_NOERROR),
+  policy(rhs.policy), capacity(rhs.capacity), pinlimit(rhs.pinlimit),
+  epoch(0), top(0)
+{
+  ResetStats();
+}
 
-  if (rc!=ERROR_NOERROR) {
-    return rc;
+BTreeNodeCache & BTreeNodeCache::operator=(const BTreeNodeCache &rhs)
+{
+  if (this!=&rhs) {
+    Configure(rhs.policy,rhs.capacity,rhs.pinlimit);
+    backing=rhs.backing;
   }
+  return *this;
+}
 
-  switch (b.info.nodetype) {
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-    // Scan through key/ptr pairs
-    //and recurse if possible
-    for (offset=0;offset<b.info.numkeys;offset++) {
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (key<testkey || key==testkey) {
-	// OK, so we now have the first key that's larger
-	// so we ned to recurse on the ptr immediately previous to
-	// this one, if it exists
-	rc=b.GetPtr(offset,ptr);
-	if (rc) { return rc; }
-	return LookupOrUpdateInternal(ptr,op,key,value);
-      }
-    }
-    // if we got here, we need to go to the next pointer, if it exists
-    if (b.info.numkeys>0) {
-      rc=b.GetPtr(b.info.numkeys,ptr);
-      if (rc) { return rc; }
-      return LookupOrUpdateInternal(ptr,op,key,value);
-    } else {
-      // There are no keys at all on this node, so nowhere to go
-      return ERROR_NONEXISTENT;
-    }
-    break;
-  case BTREE_LEAF_NODE:
-    // Scan through keys looking for matching value
-    for (offset=0;offset<b.info.numkeys;offset++) {
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (testkey==key) {
-      	if (op==BTREE_OP_LOOKUP) {
-      	  return b.GetVal(offset,value);
-	  } else {
-	  // BTREE_OP_UPDATE
-      rc=b.SetVal(offset,value);
-      if (rc) {  return rc; }
-
-      rc=b.Serialize(buffercache,node);
-      if (rc) {  return rc; }
+void BTreeNodeCache::Configure(const BTreeCachePolicy p, const SIZE_T c, const SIZE_T l)
+{
+  Clear();
+  policy=p;
+  capacity=c;
+  pinlimit=l;
+}
 
-	    return ERROR_NOERROR;
-	}
-      }
-    }
-    break;
+std::list<SIZE_T> & BTreeNodeCache::QueueList(const Queue q)
+{
+  switch (q) {
+  case QUEUE_PINNED:
+    return pinned;
+  case QUEUE_A1IN:
+    return a1in;
   default:
-    // We can't be looking at anything other than a root, internal, or leaf
-    return ERROR_INSANE;
-    break;
+    return am;
   }
-
-  return ERROR_INSANE;
 }
 
+// A root or interior node is pinned while the budget has room, and
+// once pinned it stays so until it leaves the cache
+bool BTreeNodeCache::Pinnable(const BTreeNode &node, const bool waspinned) const
+{
+  if (node.info.nodetype!=BTREE_ROOT_NODE && node.info.nodetype!=BTREE_INTERIOR_NODE) {
+    return false;
+  }
+  return waspinned || stats.pinned<pinlimit;
+}
 
-static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplayType dt)
+BTreeNode * BTreeNodeCache::Find(const SIZE_T block)
 {
-  KEY_T key;
-  VALUE_T value;
-  SIZE_T ptr;
-  SIZE_T offset;
-  ERROR_T rc;
-  unsigned i;
+  std::map<SIZE_T, Entry>::iterator it = entries.find(block);
 
-  if (dt==BTREE_DEPTH_DOT) {
-    os << nodenum << " [ label=\""<<nodenum<<": ";
-  } else if (dt==BTREE_DEPTH) {
-    os << nodenum << ": ";
-  } else {
+  if (it==entries.end()) {
+    stats.misses++;
+    return 0;
   }
-
+  stats.hits++;
+  // Only the main queue is kept in recency order.  A hit in a1in
+  // leaves the node where it is, which is what keeps a scan that
+  // touches each leaf a few times in a row from looking hot.
+  if (it->second.queue==QUEUE_AM) {
+    am.splice(am.begin(),am,it->second.pos);
+  }
+  return &(it->second.node);
+}
+
+//
+// Swizzling: a pinned node stays put in entries until it leaves the
+// cache, so once a descent has found a pinned child through the map,
+// its parent keeps a direct pointer to it for the next descent.
+//
+BTreeNode * BTreeNodeCache::Find(const SIZE_T block, Entry *&parent, const SIZE_T slot)
+{
+  Entry *e = 0;
+  std::map<SIZE_T, Entry>::iterator it;
+
+  if (parent) {
+    if (parent->childepoch!=epoch) {
+      parent->children.assign(parent->children.size(),(Entry *)0);
+      parent->childepoch=epoch;
+    }
+    if (slot<parent->children.size()) {
+      e=parent->children[slot];
+    }
+  } else {
+    e=top;
+  }
+  if (e && e->block==block) {
+    stats.hits++;
+    stats.swizzled++;
+    parent=e;
+    return &(e->node);
+  }
+
+  it=entries.find(block);
+  if (it==entries.end()) {
+    stats.misses++;
+    parent=0;
+    return 0;
+  }
+  stats.hits++;
+  e=&(it->second);
+  if (e->queue!=QUEUE_PINNED) {
+    // may be evicted at any time, so never swizzled
+    if (e->queue==QUEUE_AM) {
+      am.splice(am.begin(),am,e->pos);
+    }
+    parent=0;
+    return &(e->node);
+  }
+  if (parent) {
+    // sized for every slot when the parent was pinned
+    if (slot<parent->children.size()) {
+      parent->children[slot]=e;
+    }
+  } else {
+    top=e;
+  }
+  parent=e;
+  return &(e->node);
+}
+
+bool BTreeNodeCache::Store(const SIZE_T block, const BTreeNode &node, const bool dirty)
+{
+  std::map<SIZE_T, Entry>::iterator it = entries.find(block);
+
+  if (it!=entries.end()) {
+    bool waspinned = it->second.queue==QUEUE_PINNED;
+    bool ispinned = Pinnable(node,waspinned);
+    if (waspinned==ispinned && node.info.nodetype!=BTREE_UNALLOCATED_BLOCK) {
+      // node may be the cached copy itself, changed in place
+      if (&it->second.node!=&node) {
+	it->second.node=node;
+      }
+      // its pointers may have changed
+      it->second.children.assign(it->second.children.size(),(Entry *)0);
+      if (it->second.dirty!=dirty) {
+	it->second.dirty=dirty;
+	if (dirty) { stats.dirty++; } else { stats.dirty--; }
+      }
+      return true;
+    }
+    // Whatever was cached is superseded by this node, dirty or not
+    Remove(block);
+  }
+  return Admit(block,node,dirty);
+}
+
+bool BTreeNodeCache::Admit(const SIZE_T block, const BTreeNode &node, const bool dirty)
+{
+  Queue q;
+  std::map<SIZE_T, std::list<SIZE_T>::iterator>::iterator ghost;
+
+  if (policy==BTREE_CACHE_OFF) {
+    return false;
+  }
+
+  switch (node.info.nodetype) {
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    if (Pinnable(node,false)) {
+      q=QUEUE_PINNED;
+      break;
+    }
+    // over the pinning budget, so cached as a leaf is
+    // fall through
+  case BTREE_LEAF_NODE:
+    if (capacity==0) {
+      return false;
+    }
+    q = (policy==BTREE_CACHE_LRU) ? QUEUE_AM : QUEUE_A1IN;
+    ghost = ghosts.find(block);
+    if (ghost!=ghosts.end()) {
+      // Referenced again after it aged out of a1in, so it is hot
+      a1out.erase(ghost->second);
+      ghosts.erase(ghost);
+      q=QUEUE_AM;
+    }
+    break;
+  default:
+    // free blocks and superblocks are not cached
+    return false;
+  }
+
+  Entry &e = entries[block];
+  e.node=node;
+  e.queue=q;
+  e.dirty=dirty;
+  e.block=block;
+  e.childepoch=epoch;
+  QueueList(q).push_front(block);
+  e.pos=QueueList(q).begin();
+
+  if (dirty) {
+    stats.dirty++;
+  }
+
+  if (q==QUEUE_PINNED) {
+    // A slot for every pointer the block has room for, so that
+    // swizzling never allocates during a descent
+    SIZE_T stride = node.info.keysize+sizeof(SIZE_T);
+    e.children.assign((node.info.blocksize-sizeof(NodeMetadata))/stride+1,(Entry *)0);
+    stats.pinned++;
+  } else {
+    stats.resident++;
+    while (stats.resident>capacity) {
+      EvictOne();
+    }
+  }
+  return true;
+}
+
+void BTreeNodeCache::EvictOne()
+{
+  // 2Q sizes a1in at a quarter of the capacity and remembers
+  // twice that many ghosts
+  SIZE_T kin = capacity/4 ? capacity/4 : 1;
+  SIZE_T kout = capacity/2 ? capacity/2 : 1;
+  SIZE_T victim;
+
+  if (a1in.size()>kin || am.empty()) {
+    victim=a1in.back();
+    a1out.push_front(victim);
+    ghosts[victim]=a1out.begin();
+    if (a1out.size()>kout) {
+      ghosts.erase(a1out.back());
+      a1out.pop_back();
+    }
+  } else {
+    victim=am.back();
+  }
+
+  Entry &e = entries[victim];
+  if (e.dirty) {
+    ERROR_T rc = backing->WriteBack(victim,e.node);
+    if (rc && !writeerror) {
+      writeerror=rc;
+    }
+    stats.writebacks++;
+  }
+  Remove(victim);
+  stats.evictions++;
+}
+
+void BTreeNodeCache::Remove(const SIZE_T block)
+{
+  std::map<SIZE_T, Entry>::iterator it = entries.find(block);
+
+  if (it==entries.end()) {
+    return;
+  }
+  QueueList(it->second.queue).erase(it->second.pos);
+  if (it->second.dirty) {
+    stats.dirty--;
+  }
+  if (it->second.queue==QUEUE_PINNED) {
+    stats.pinned--;
+    // something may point to it
+    epoch++;
+    top=0;
+  } else {
+    stats.resident--;
+  }
+  entries.erase(it);
+}
+
+void BTreeNodeCache::Invalidate(const SIZE_T block)
+{
+  Remove(block);
+}
+
+void BTreeNodeCache::Clear()
+{
+  entries.clear();
+  pinned.clear();
+  a1in.clear();
+  am.clear();
+  a1out.clear();
+  ghosts.clear();
+  epoch++;
+  top=0;
+  stats.pinned=0;
+  stats.resident=0;
+  stats.dirty=0;
+}
+
+ERROR_T BTreeNodeCache::Flush()
+{
+  ERROR_T rc = writeerror;
+
+  writeerror=ERROR_NOERROR;
+
+  // entries is ordered by block number, so this is one ascending sweep
+  for (std::map<SIZE_T, Entry>::iterator it=entries.begin(); it!=entries.end(); ++it) {
+    if (!it->second.dirty) {
+      continue;
+    }
+    ERROR_T wrc = backing->WriteBack(it->first,it->second.node);
+    if (wrc) {
+      if (!rc) { rc=wrc; }
+      continue;
+    }
+    it->second.dirty=false;
+    stats.dirty--;
+    stats.writebacks++;
+  }
+  return rc;
+}
+
+const BTreeCacheStats & BTreeNodeCache::GetStats() const
+{
+  return stats;
+}
+
+void BTreeNodeCache::ResetStats()
+{
+  stats.hits=0;
+  stats.misses=0;
+  stats.evictions=0;
+  stats.writebacks=0;
+  stats.swizzled=0;
+  stats.dirty=0;
+  for (std::map<SIZE_T, Entry>::const_iterator it=entries.begin(); it!=entries.end(); ++it) {
+    if (it->second.dirty) { stats.dirty++; }
+  }
+  stats.pinned=entries.size()-a1in.size()-am.size();
+  stats.resident=a1in.size()+am.size();
+}
+
+BTreeCachePolicy BTreeNodeCache::GetPolicy() const
+{
+  return policy;
+}
+
+void BTreeNodeCache::GetBlocks(std::vector<SIZE_T> &blocks) const
+{
+  blocks.clear();
+  for (std::map<SIZE_T, Entry>::const_iterator it=entries.begin(); it!=entries.end(); ++it) {
+    blocks.push_back(it->first);
+  }
+}
+
+
+BTreeKeyFilter::BTreeKeyFilter() :
+  numbits(0), hashes(0), keys(0)
+{
+  ResetStats();
+}
+
+void BTreeKeyFilter::Configure(const SIZE_T expectedkeys, const SIZE_T bitsperkey)
+{
+  SIZE_T k = (SIZE_T)(bitsperkey*0.693+0.5);
+
+  // k = ln 2 * bits per key minimizes the false positive rate
+  Configure((expectedkeys ? expectedkeys : 1)*(bitsperkey ? bitsperkey : 1),
+	    k<1 ? 1 : (k>16 ? 16 : k),
+	    0);
+}
+
+void BTreeKeyFilter::Configure(const SIZE_T b, const SIZE_T k, const SIZE_T n)
+{
+  numbits=(b+7)/8*8;
+  hashes=k;
+  bits.assign(numbits/8,0);
+  keys=n;
+  ResetStats();
+}
+
+void BTreeKeyFilter::Clear()
+{
+  bits.assign(bits.size(),0);
+  keys=0;
+}
+
+void BTreeKeyFilter::Disable()
+{
+  bits.clear();
+  numbits=0;
+  hashes=0;
+  keys=0;
+}
+
+//
+// Double hashing: the i-th probe is h1+i*h2, with h2 odd.
+// h1 is the key's CRC32C, and h2 a mix of it.
+//
+static void FilterHashes(const KEY_VIEW_T &key, uint32_t &h1, uint32_t &h2)
+{
+  h1=Crc32c(0,key.data,key.length);
+  h2=h1^0x9e3779b9;
+  h2^=h2>>16;
+  h2*=0x85ebca6b;
+  h2^=h2>>13;
+  h2*=0xc2b2ae35;
+  h2^=h2>>16;
+  h2|=1;
+}
+
+void BTreeKeyFilter::Add(const KEY_VIEW_T &key)
+{
+  uint32_t h1, h2;
+  SIZE_T i;
+  uint64_t bit;
+
+  if (!numbits) {
+    return;
+  }
+  FilterHashes(key,h1,h2);
+  for (i=0;i<hashes;i++) {
+    bit=((uint64_t)h1+(uint64_t)i*h2)%numbits;
+    bits[bit/8]|=(unsigned char)(1<<(bit%8));
+  }
+  keys++;
+}
+
+bool BTreeKeyFilter::MayContain(const KEY_VIEW_T &key) const
+{
+  uint32_t h1, h2;
+  SIZE_T i;
+  uint64_t bit;
+
+  if (!numbits) {
+    return true;
+  }
+  probes++;
+  FilterHashes(key,h1,h2);
+  for (i=0;i<hashes;i++) {
+    bit=((uint64_t)h1+(uint64_t)i*h2)%numbits;
+    if (!(bits[bit/8]&(1<<(bit%8)))) {
+      negatives++;
+      return false;
+    }
+  }
+  return true;
+}
+
+void BTreeKeyFilter::GetStats(BTreeFilterStats &s) const
+{
+  SIZE_T set=0;
+  SIZE_T i;
+  double fill;
+
+  for (i=0;i<bits.size();i++) {
+    set+=__builtin_popcount(bits[i]);
+  }
+  fill = numbits ? (double)set/(double)numbits : 0.0;
+
+  s.bits=numbits;
+  s.hashes=hashes;
+  s.keys=keys;
+  s.blocks=0;
+  s.probes=probes;
+  s.negatives=negatives;
+  s.falsepositives=falsepositives;
+  s.estimatedrate = numbits ? pow(fill,(double)hashes) : 1.0;
+  s.observedrate = (negatives+falsepositives) ?
+    (double)falsepositives/(double)(negatives+falsepositives) : 0.0;
+}
+
+void BTreeKeyFilter::ResetStats()
+{
+  probes=0;
+  negatives=0;
+  falsepositives=0;
+}
+
+
+BTreeIndex::BTreeIndex(SIZE_T keysize,
+		       SIZE_T valuesize,
+		       BufferCache *cache,
+		       bool unique)
+{
+  superblock.info.keysize=keysize;
+  superblock.info.valuesize=valuesize;
+  buffercache=cache;
+  nodecache=BTreeNodeCache(this);
+  writeback=false;
+  superblockdirty=false;
+  verifychecksums=true;
+  interpolate=false;
+  checksumfailures=0;
+  nodereads=0;
+  createflags=0;
+  indexflags=0;
+  compressedrawbytes=0;
+  compressedbytes=0;
+  filterdirty=false;
+  warmrestart=false;
+  freeafter=0;
+  if (!unique) {
+    // every leaf slot also holds the head of the key's posting list
+    superblock.info.valuesize=valuesize+sizeof(SIZE_T);
+    createflags|=BTREE_FLAG_NONUNIQUE;
+  }
+
+  //Calculate max number of keys per block
+  SIZE_T blockSize = buffercache->GetBlockSize();
+  maxNumKeys = (blockSize - sizeof(NodeMetadata) - BTREE_CHECKSUM_BYTES)/(16);
+  maxLeafKeys = maxNumKeys;
+  maxInteriorKeys = maxNumKeys;
+  messageoffset = 0;
+  messagecapacity = 0;
+}
+
+BTreeIndex::BTreeIndex() :
+  writeback(false), superblockdirty(false),
+  verifychecksums(true), interpolate(false), checksumfailures(0),
+  nodereads(0), createflags(0), indexflags(0),
+  compressedrawbytes(0), compressedbytes(0),
+  filterdirty(false), warmrestart(false), freeafter(0)
+{
+  // shouldn't have to do anything
+}
+
+
+//
+// Note, will not attach!
+//
+BTreeIndex::BTreeIndex(const BTreeIndex &rhs)
+{
+  buffercache=rhs.buffercache;
+  superblock_index=rhs.superblock_index;
+  superblock=rhs.superblock;
+  maxNumKeys=rhs.maxNumKeys;
+  maxLeafKeys=rhs.maxLeafKeys;
+  maxInteriorKeys=rhs.maxInteriorKeys;
+  messageoffset=rhs.messageoffset;
+  messagecapacity=rhs.messagecapacity;
+  nodecache=BTreeNodeCache(this);
+  writeback=rhs.writeback;
+  superblockdirty=false;
+  verifychecksums=rhs.verifychecksums;
+  interpolate=rhs.interpolate;
+  checksumfailures=0;
+  nodereads=0;
+  createflags=rhs.createflags;
+  indexflags=rhs.indexflags;
+  compressedrawbytes=0;
+  compressedbytes=0;
+  filterdirty=false;
+  warmrestart=rhs.warmrestart;
+  freeafter=0;
+}
+
+BTreeIndex::~BTreeIndex()
+{
+  // Don't lose deferred writes if nobody called Detach
+  if (writeback) {
+    Checkpoint();
+  }
+}
+
+
+//
+// Like the copy constructor, leaves this index unattached.  Its own
+// deferred writes go out first, as they would from its destructor,
+// and what it held is released by the assignments.
+//
+BTreeIndex & BTreeIndex::operator=(const BTreeIndex &rhs)
+{
+  if (this==&rhs) {
+    return *this;
+  }
+  if (writeback) {
+    Checkpoint();
+  }
+  buffercache=rhs.buffercache;
+  superblock_index=rhs.superblock_index;
+  superblock=rhs.superblock;
+  maxNumKeys=rhs.maxNumKeys;
+  maxLeafKeys=rhs.maxLeafKeys;
+  maxInteriorKeys=rhs.maxInteriorKeys;
+  messageoffset=rhs.messageoffset;
+  messagecapacity=rhs.messagecapacity;
+  nodecache=BTreeNodeCache(this);
+  writeback=rhs.writeback;
+  superblockdirty=false;
+  verifychecksums=rhs.verifychecksums;
+  interpolate=rhs.interpolate;
+  checksumfailures=0;
+  nodereads=0;
+  createflags=rhs.createflags;
+  indexflags=rhs.indexflags;
+  compressedrawbytes=0;
+  compressedbytes=0;
+  keyfilter=BTreeKeyFilter();
+  filterblocks.clear();
+  filterdirty=false;
+  warmrestart=rhs.warmrestart;
+  hotsetblocks.clear();
+  freeahead.clear();
+  freeafter=0;
+  return *this;
+}
+
+
+ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
+{
+  ERROR_T rc;
+
+  n=superblock.info.freelist;
+
+  if (n==0) {
+    return ERROR_NOSPACE;
+  }
+
+  if (!freeahead.empty()) {
+    // ReserveNodes has already read it
+    freeahead.pop_front();
+    superblock.info.freelist = freeahead.empty() ? freeafter : freeahead.front();
+  } else {
+    BTreeNode node;
+
+    // A free block that went bad must not be linked into the tree
+    rc=ReadNode(n,node);
+    if (rc) { return rc; }
+    if (node.info.nodetype!=BTREE_UNALLOCATED_BLOCK) {
+      return ERROR_INSANE;
+    }
+
+    superblock.info.freelist=node.info.freelist;
+  }
+
+  rc=WriteSuperblock();
+  if (rc) { return rc; }
+
+  buffercache->NotifyAllocateBlock(n);
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::ReserveNodes(const SIZE_T count)
+{
+  BTreeNode node;
+  ERROR_T rc;
+
+  if (freeahead.empty()) {
+    freeafter=superblock.info.freelist;
+  }
+  // Only the part of the free list not walked before is read
+  while (freeahead.size()<count) {
+    if (freeafter==0) {
+      return ERROR_NOSPACE;
+    }
+    rc=ReadNode(freeafter,node);
+    if (rc) { return rc; }
+    if (node.info.nodetype!=BTREE_UNALLOCATED_BLOCK) {
+      return ERROR_INSANE;
+    }
+    freeahead.push_back(freeafter);
+    freeafter=node.info.freelist;
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
+{
+  BTreeNode node;
+  ERROR_T rc;
+
+  rc=ReadNode(n,node);
+  if (rc) { return rc; }
+  if (node.info.nodetype==BTREE_UNALLOCATED_BLOCK) {
+    // already free: linking it in again would put it on the list twice
+    return ERROR_INSANE;
+  }
+
+  // Build the free block from scratch: a compressed leaf read back
+  // is larger in memory than the block it came from
+  BTreeNode freenode(BTREE_UNALLOCATED_BLOCK,
+		     superblock.info.keysize,
+		     superblock.info.valuesize,
+		     buffercache->GetBlockSize());
+
+  freenode.info.rootnode=node.info.rootnode;
+
+  freenode.info.freelist=superblock.info.freelist;
+
+  rc=WriteNode(n,freenode);
+  if (rc) { return rc; }
+
+  superblock.info.freelist=n;
+  if (!freeahead.empty()) {
+    freeahead.push_front(n);
+  }
+
+  rc=WriteSuperblock();
+  if (rc) { return rc; }
+
+  buffercache->NotifyDeallocateBlock(n);
+
+  return ERROR_NOERROR;
+
+}
+
+ERROR_T BTreeIndex::ReadNode(const SIZE_T &n, BTreeNode &b) const
+{
+  const BTreeNode *cached = nodecache.Find(n);
+
+  if (cached) {
+    b=*cached;
+    return ERROR_NOERROR;
+  }
+  return LoadNode(n,b);
+}
+
+
+ERROR_T BTreeIndex::BorrowNode(const SIZE_T &n, BTreeNode &scratch, BTreeNode *&b) const
+{
+  ERROR_T rc;
+
+  b=nodecache.Find(n);
+  if (b) {
+    return ERROR_NOERROR;
+  }
+  rc=LoadNode(n,scratch);
+  if (rc) { return rc; }
+  b=&scratch;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::BorrowNode(const SIZE_T &n, BTreeNode &scratch, BTreeNode *&b,
+			       BTreeNodeCache::Entry *&hint, const SIZE_T slot) const
+{
+  ERROR_T rc;
+
+  b=nodecache.Find(n,hint,slot);
+  if (b) {
+    return ERROR_NOERROR;
+  }
+  rc=LoadNode(n,scratch);
+  if (rc) { return rc; }
+  b=&scratch;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::LoadNode(const SIZE_T &n, BTreeNode &b) const
+{
+  ERROR_T rc;
+
+  rc=b.Unserialize(buffercache,n);
+  if (rc) { return rc; }
+  nodereads++;
+
+  if (verifychecksums && (indexflags & BTREE_FLAG_CHECKSUMS) && !ChecksumOK(b)) {
+    checksumfailures++;
+    return ERROR_CHECKSUM;
+  }
+
+  if (b.info.nodetype==BTREE_COMPRESSED_LEAF_NODE) {
+    BTreeNode packed(b);
+    rc=DecompressLeaf(packed,b);
+    if (rc) { return rc; }
+  }
+
+  nodecache.Store(n,b);
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::WriteNode(const SIZE_T &n, BTreeNode &b)
+{
+  ERROR_T rc;
+
+  // Compressed leaves get their checksum when they are encoded
+  if (b.info.blocksize==buffercache->GetBlockSize()) {
+    StampChecksum(b);
+  }
+
+  if (writeback) {
+    if (nodecache.Store(n,b,true)) {
+      return ERROR_NOERROR;
+    }
+    // The cache won't hold it (e.g., a freed block), so write it now
+    return WriteBack(n,b);
+  }
+
+  rc=WriteBack(n,b);
+  if (rc) {
+    nodecache.Invalidate(n);
+    return rc;
+  }
+
+  nodecache.Store(n,b);
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::WriteBack(const SIZE_T n, const BTreeNode &b)
+{
+  ERROR_T rc;
+
+  if (b.info.nodetype==BTREE_LEAF_NODE && b.info.blocksize!=buffercache->GetBlockSize()) {
+    BTreeNode packed;
+    rc=CompressLeaf(b,packed,buffercache->GetBlockSize());
+    if (rc) { return rc; }
+    compressedrawbytes+=b.info.numkeys*(b.info.keysize+b.info.valuesize);
+    compressedbytes+=CompressedLeafBytes(b)-sizeof(SIZE_T);
+    StampChecksum(packed);
+    return packed.Serialize(buffercache,n);
+  }
+  return b.Serialize(buffercache,n);
+}
+
+
+SIZE_T BTreeIndex::LeafBlockSize() const
+{
+  if (indexflags & BTREE_FLAG_COMPRESSED_LEAVES) {
+    return BTREE_COMPRESSED_LEAF_FACTOR*superblock.info.blocksize;
+  }
+  return superblock.info.blocksize;
+}
+
+
+bool BTreeIndex::LeafNeedsSplit(const BTreeNode &leaf) const
+{
+  if ((int)leaf.info.numkeys > (int)(2*maxLeafKeys/3)) {
+    return true;
+  }
+  return leaf.info.blocksize!=superblock.info.blocksize
+    && CompressedLeafBytes(leaf)>CompressedLeafCapacity(superblock.info.blocksize);
+}
+
+
+void BTreeIndex::SetMessageBuffers(const bool on)
+{
+  if (on) {
+    createflags|=BTREE_FLAG_MESSAGE_BUFFERS;
+  } else {
+    createflags&=~BTREE_FLAG_MESSAGE_BUFFERS;
+  }
+}
+
+
+bool BTreeIndex::Buffered() const
+{
+  return (indexflags & BTREE_FLAG_MESSAGE_BUFFERS)!=0;
+}
+
+
+void BTreeIndex::SetLeafCompression(const bool on)
+{
+  if (on) {
+    createflags|=BTREE_FLAG_COMPRESSED_LEAVES;
+  } else {
+    createflags&=~BTREE_FLAG_COMPRESSED_LEAVES;
+  }
+}
+
+
+double BTreeIndex::GetCompressionRatio() const
+{
+  if (compressedbytes==0) {
+    return 1.0;
+  }
+  return (double)compressedrawbytes/(double)compressedbytes;
+}
+
+
+ERROR_T BTreeIndex::WriteSuperblock()
+{
+  if (writeback) {
+    superblockdirty=true;
+    return ERROR_NOERROR;
+  }
+  return SerializeSuperblock();
+}
+
+
+ERROR_T BTreeIndex::SerializeSuperblock()
+{
+  ERROR_T rc;
+
+  StampChecksum(superblock);
+  rc=superblock.Serialize(buffercache,superblock_index);
+  if (rc) { return rc; }
+  superblockdirty=false;
+  return ERROR_NOERROR;
+}
+
+
+const BTreeNode & BTreeIndex::GetSuperblock() const
+{
+  return superblock;
+}
+
+
+ERROR_T BTreeIndex::ReadIndexSizes(const SIZE_T initblock, SIZE_T &keysize, SIZE_T &valuesize) const
+{
+  BTreeNode sb;
+  ERROR_T rc;
+
+  rc=sb.Unserialize(buffercache,initblock);
+  if (rc) { return rc; }
+  if (sb.info.nodetype!=BTREE_SUPERBLOCK) {
+    return ERROR_NOTANINDEX;
+  }
+  if (verifychecksums && (GetSuperblockFlags(sb) & BTREE_FLAG_CHECKSUMS) && !ChecksumOK(sb)) {
+    checksumfailures++;
+    return ERROR_CHECKSUM;
+  }
+  keysize=sb.info.keysize;
+  valuesize=sb.info.valuesize;
+  if (GetSuperblockFlags(sb) & BTREE_FLAG_NONUNIQUE) {
+    valuesize-=sizeof(SIZE_T);
+  }
+  return ERROR_NOERROR;
+}
+
+
+void BTreeIndex::SetVerifyChecksums(const bool on)
+{
+  verifychecksums=on;
+}
+
+
+void BTreeIndex::SetInterpolationSearch(const bool on)
+{
+  interpolate=on;
+}
+
+
+SIZE_T BTreeIndex::GetChecksumFailures() const
+{
+  return checksumfailures;
+}
+
+
+SIZE_T BTreeIndex::GetNodeReads() const
+{
+  return nodereads;
+}
+
+
+ERROR_T BTreeIndex::SetNodeCache(const BTreeCachePolicy policy, const SIZE_T capacity,
+				 const SIZE_T pinned)
+{
+  ERROR_T rc;
+
+  // Configure empties the cache, so nothing dirty may be left in it
+  rc=Checkpoint();
+  if (rc) { return rc; }
+  nodecache.Configure(policy,capacity,pinned);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::SetWriteBack(const bool on)
+{
+  ERROR_T rc = ERROR_NOERROR;
+
+  if (writeback && !on) {
+    rc=Checkpoint();
+  }
+  writeback=on;
+  return rc;
+}
+
+
+ERROR_T BTreeIndex::Checkpoint()
+{
+  ERROR_T rc;
+
+  rc=KeyFilterStore();
+  if (rc) { return rc; }
+
+  rc=nodecache.Flush();
+  if (rc) { return rc; }
+
+  if (superblockdirty) {
+    return SerializeSuperblock();
+  }
+  return ERROR_NOERROR;
+}
+
+
+const BTreeCacheStats & BTreeIndex::GetCacheStats() const
+{
+  return nodecache.GetStats();
+}
+
+
+bool BTreeIndex::KeyFilterExcludes(const KEY_VIEW_T &key) const
+{
+  return keyfilter.Enabled() && !keyfilter.MayContain(key);
+}
+
+
+void BTreeIndex::KeyFilterMissed() const
+{
+  if (keyfilter.Enabled()) {
+    keyfilter.NoteFalsePositive();
+  }
+}
+
+
+ERROR_T BTreeIndex::KeyFilterAdd(const KEY_VIEW_T &key)
+{
+  FilterHeader fh;
+
+  if (!keyfilter.Enabled()) {
+    return ERROR_NOERROR;
+  }
+  keyfilter.Add(key);
+  if (filterdirty) {
+    return ERROR_NOERROR;
+  }
+  // First change since it was stored: until it is stored again,
+  // the copy on disk may be missing keys
+  filterdirty=true;
+  fh=GetSuperblockFilter(superblock);
+  fh.clean=0;
+  SetSuperblockFilter(superblock,fh);
+  if (!superblockdirty) {
+    return SerializeSuperblock();
+  }
+
+  // The mark has to reach the disk before the key does, even in
+  // write-back mode, but without the superblock's other deferred
+  // changes, whose nodes may not be written yet.  So it goes into
+  // the superblock as it is on disk.
+  BTreeNode ondisk;
+  ERROR_T rc;
+
+  rc=ondisk.Unserialize(buffercache,superblock_index);
+  if (rc) { return rc; }
+  fh=GetSuperblockFilter(ondisk);
+  fh.clean=0;
+  SetSuperblockFilter(ondisk,fh);
+  StampChecksum(ondisk);
+  return ondisk.Serialize(buffercache,superblock_index);
+}
+
+
+// Add the keys of every leaf under node to the filter
+ERROR_T BTreeIndex::KeyFilterScan(const SIZE_T &node)
+{
+  BTreeNode b;
+  ERROR_T rc;
+  SIZE_T offset;
+  SIZE_T ptr;
+
+  rc=ReadNode(node,b);
+  if (rc) { return rc; }
+
+  switch (b.info.nodetype) {
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    if (Buffered()) {
+      // keys whose inserts have not reached a leaf yet
+      MessageBuffer messages(b,messageoffset,messagecapacity);
+      for (offset=0;offset<messages.Count();offset++) {
+	if (messages.Op(offset)==MESSAGE_INSERT) {
+	  keyfilter.Add(KEY_VIEW_T(messages.Key(offset),b.info.keysize));
+	}
+      }
+    }
+    if (b.info.numkeys>0) {
+      for (offset=0;offset<=b.info.numkeys;offset++) {
+	rc=b.GetPtr(offset,ptr);
+	if (rc) { return rc; }
+	rc=KeyFilterScan(ptr);
+	if (rc) { return rc; }
+      }
+    }
+    return ERROR_NOERROR;
+  case BTREE_LEAF_NODE:
+    for (offset=0;offset<b.info.numkeys;offset++) {
+      keyfilter.Add(KEY_VIEW_T(b.ResolveKey(offset),b.info.keysize));
+    }
+    return ERROR_NOERROR;
+  default:
+    return ERROR_INSANE;
+  }
+}
+
+
+ERROR_T BTreeIndex::KeyFilterLoad()
+{
+  FilterHeader fh = GetSuperblockFilter(superblock);
+  BTreeNode b;
+  ERROR_T rc;
+  SIZE_T block;
+  SIZE_T next;
+  SIZE_T chunk;
+  SIZE_T done;
+
+  keyfilter.Disable();
+  filterblocks.clear();
+  filterdirty=false;
+  if (fh.head==0) {
+    return ERROR_NOERROR;
+  }
+
+  keyfilter.Configure(fh.bits,fh.hashes,fh.keys);
+  chunk=FilterBlockBytes(buffercache->GetBlockSize());
+  done=0;
+  for (block=fh.head; block!=0; block=next) {
+    rc=ReadNode(block,b);
+    if (rc) { return rc; }
+    if (b.info.nodetype!=BTREE_FILTER_BLOCK) {
+      return ERROR_INSANE;
+    }
+    memcpy(&next,b.data,sizeof(SIZE_T));
+    if (done<keyfilter.NumBytes()) {
+      SIZE_T n = keyfilter.NumBytes()-done<chunk ? keyfilter.NumBytes()-done : chunk;
+      memcpy(keyfilter.Bits()+done,b.data+sizeof(SIZE_T),n);
+      done+=n;
+    }
+    filterblocks.push_back(block);
+  }
+
+  if (!fh.clean) {
+    // Not stored since keys were last added: start over from the tree
+    keyfilter.Clear();
+    rc=KeyFilterScan(superblock.info.rootnode);
+    if (rc) { return rc; }
+    filterdirty=true;
+  }
+  return ERROR_NOERROR;
+}
+
+
+//
+// Write the filter's bits to its blocks, chained through the first
+// word of each, growing or shrinking the chain to fit, and record it
+// as clean in the superblock.
+//
+ERROR_T BTreeIndex::KeyFilterStore()
+{
+  FilterHeader fh;
+  BTreeNode b;
+  ERROR_T rc;
+  SIZE_T chunk;
+  SIZE_T need;
+  SIZE_T block;
+  SIZE_T next;
+  SIZE_T i;
+  SIZE_T done;
+
+  if (!keyfilter.Enabled() || !filterdirty) {
+    return ERROR_NOERROR;
+  }
+
+  chunk=FilterBlockBytes(buffercache->GetBlockSize());
+  need=(keyfilter.NumBytes()+chunk-1)/chunk;
+  while (filterblocks.size()>need) {
+    rc=DeallocateNode(filterblocks.back());
+    if (rc) { return rc; }
+    filterblocks.pop_back();
+  }
+  while (filterblocks.size()<need) {
+    rc=AllocateNode(block);
+    if (rc) { return rc; }
+    filterblocks.push_back(block);
+  }
+
+  done=0;
+  for (i=0;i<need;i++) {
+    SIZE_T n = keyfilter.NumBytes()-done<chunk ? keyfilter.NumBytes()-done : chunk;
+    b=BTreeNode(BTREE_FILTER_BLOCK,
+		superblock.info.keysize,
+		superblock.info.valuesize,
+		buffercache->GetBlockSize());
+    next = i+1<need ? filterblocks[i+1] : 0;
+    memcpy(b.data,&next,sizeof(SIZE_T));
+    memcpy(b.data+sizeof(SIZE_T),keyfilter.Bits()+done,n);
+    done+=n;
+    rc=WriteNode(filterblocks[i],b);
+    if (rc) { return rc; }
+  }
+
+  fh.head=filterblocks[0];
+  fh.bits=keyfilter.NumBits();
+  fh.keys=keyfilter.NumKeys();
+  fh.hashes=keyfilter.NumHashes();
+  fh.clean=1;
+  SetSuperblockFilter(superblock,fh);
+  filterdirty=false;
+  return WriteSuperblock();
+}
+
+
+ERROR_T BTreeIndex::KeyFilterFree()
+{
+  ERROR_T rc;
+
+  while (!filterblocks.empty()) {
+    rc=DeallocateNode(filterblocks.back());
+    if (rc) { return rc; }
+    filterblocks.pop_back();
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::BuildKeyFilter(const SIZE_T expectedkeys, const SIZE_T bitsperkey)
+{
+  ERROR_T rc;
+
+  keyfilter.Configure(expectedkeys,bitsperkey);
+  rc=KeyFilterScan(superblock.info.rootnode);
+  if (rc) { return rc; }
+  if (keyfilter.NumKeys()>expectedkeys) {
+    // more keys than it was sized for, so size it for those
+    keyfilter.Configure(keyfilter.NumKeys(),bitsperkey);
+    rc=KeyFilterScan(superblock.info.rootnode);
+    if (rc) { return rc; }
+  }
+  filterdirty=true;
+  return KeyFilterStore();
+}
+
+
+ERROR_T BTreeIndex::RebuildKeyFilter()
+{
+  ERROR_T rc;
+
+  if (!keyfilter.Enabled()) {
+    return ERROR_NONEXISTENT;
+  }
+  keyfilter.Clear();
+  rc=KeyFilterScan(superblock.info.rootnode);
+  if (rc) { return rc; }
+  filterdirty=true;
+  return KeyFilterStore();
+}
+
+
+ERROR_T BTreeIndex::DropKeyFilter()
+{
+  FilterHeader fh;
+  ERROR_T rc;
+
+  rc=KeyFilterFree();
+  if (rc) { return rc; }
+  keyfilter.Disable();
+  filterdirty=false;
+  memset(&fh,0,sizeof(fh));
+  SetSuperblockFilter(superblock,fh);
+  return WriteSuperblock();
+}
+
+
+void BTreeIndex::GetKeyFilterStats(BTreeFilterStats &stats) const
+{
+  keyfilter.GetStats(stats);
+  stats.blocks=filterblocks.size();
+}
+
+
+void BTreeIndex::SetWarmRestart(const bool on)
+{
+  warmrestart=on;
+}
+
+
+//
+// Read the recorded hot set and then the blocks in it into the node
+// cache through ReadNode, a level at a time from the root down, so
+// that the pin budget goes to the levels nearest the root.  Within a
+// level blocks are read in block order.  Recorded blocks no descent
+// through the set reaches are read last.
+//
+// The set is only a hint: the tree may have changed since it was
+// recorded, so a block that is no longer a tree node is simply not
+// cached, and a block that fails to read is skipped.  If the chain
+// holding the set is itself bad, nothing is preloaded, and its
+// blocks are left alone, since the tree may own them by now; the
+// next Detach records or clears the set afresh.
+//
+ERROR_T BTreeIndex::HotSetLoad()
+{
+  HotSetHeader hh = GetSuperblockHotSet(superblock);
+  std::vector<SIZE_T> hot;
+  std::vector<SIZE_T> level;
+  std::vector<SIZE_T> below;
+  std::vector<bool> read;
+  BTreeNode b;
+  SIZE_T block;
+  SIZE_T next;
+  SIZE_T ptr;
+  SIZE_T i;
+  SIZE_T j;
+
+  hotsetblocks.clear();
+  if (hh.head==0) {
+    return ERROR_NOERROR;
+  }
+
+  hot.reserve(hh.count);
+  for (block=hh.head; block!=0; block=next) {
+    if (block==superblock_index || block>=buffercache->GetNumBlocks()
+	|| hotsetblocks.size()>=buffercache->GetNumBlocks()
+	|| ReadNode(block,b)!=ERROR_NOERROR
+	|| b.info.nodetype!=BTREE_HOTSET_BLOCK
+	|| b.info.numkeys>HotSetBlockCapacity(buffercache->GetBlockSize())) {
+      hotsetblocks.clear();
+      return ERROR_NOERROR;
+    }
+    memcpy(&next,b.data,sizeof(SIZE_T));
+    for (i=0;i<b.info.numkeys;i++) {
+      SIZE_T n;
+      memcpy(&n,b.data+(i+1)*sizeof(SIZE_T),sizeof(SIZE_T));
+      if (n!=superblock_index && n<buffercache->GetNumBlocks()) {
+	hot.push_back(n);
+      }
+    }
+    hotsetblocks.push_back(block);
+  }
+
+  if (nodecache.GetPolicy()==BTREE_CACHE_OFF) {
+    return ERROR_NOERROR;
+  }
+  std::sort(hot.begin(),hot.end());
+  hot.erase(std::unique(hot.begin(),hot.end()),hot.end());
+  read.assign(hot.size(),false);
+
+  if (std::binary_search(hot.begin(),hot.end(),superblock.info.rootnode)) {
+    level.push_back(superblock.info.rootnode);
+  }
+  while (!level.empty()) {
+    below.clear();
+    for (i=0;i<level.size();i++) {
+      read[std::lower_bound(hot.begin(),hot.end(),level[i])-hot.begin()]=true;
+      if (ReadNode(level[i],b)!=ERROR_NOERROR
+	  || (b.info.nodetype!=BTREE_ROOT_NODE && b.info.nodetype!=BTREE_INTERIOR_NODE)
+	  || b.info.numkeys==0) {
+	continue;
+      }
+      for (j=0;j<=b.info.numkeys;j++) {
+	if (b.GetPtr(j,ptr)) { break; }
+	std::vector<SIZE_T>::iterator it = std::lower_bound(hot.begin(),hot.end(),ptr);
+	if (it!=hot.end() && *it==ptr && !read[it-hot.begin()]) {
+	  read[it-hot.begin()]=true;
+	  below.push_back(ptr);
+	}
+      }
+    }
+    std::sort(below.begin(),below.end());
+    level.swap(below);
+  }
+
+  for (i=0;i<hot.size();i++) {
+    if (!read[i]) {
+      ReadNode(hot[i],b);
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+//
+// Record the blocks in the node cache, reusing the blocks of the last
+// recorded set and growing or shrinking the chain to fit.
+//
+ERROR_T BTreeIndex::HotSetStore()
+{
+  std::vector<SIZE_T> hot;
+  HotSetHeader hh;
+  BTreeNode b;
+  ERROR_T rc;
+  SIZE_T chunk;
+  SIZE_T need;
+  SIZE_T block;
+  SIZE_T next;
+  SIZE_T i;
+  SIZE_T done;
+
+  nodecache.GetBlocks(hot);
+  if (hot.empty()) {
+    return HotSetFree();
+  }
+
+  chunk=HotSetBlockCapacity(buffercache->GetBlockSize());
+  need=(hot.size()+chunk-1)/chunk;
+  while (hotsetblocks.size()>need) {
+    rc=DeallocateNode(hotsetblocks.back());
+    if (rc) { return rc; }
+    hotsetblocks.pop_back();
+  }
+  while (hotsetblocks.size()<need) {
+    rc=AllocateNode(block);
+    if (rc) { return rc; }
+    hotsetblocks.push_back(block);
+  }
+
+  done=0;
+  for (i=0;i<need;i++) {
+    SIZE_T n = hot.size()-done<chunk ? hot.size()-done : chunk;
+    b=BTreeNode(BTREE_HOTSET_BLOCK,
+		superblock.info.keysize,
+		superblock.info.valuesize,
+		buffercache->GetBlockSize());
+    next = i+1<need ? hotsetblocks[i+1] : 0;
+    memcpy(b.data,&next,sizeof(SIZE_T));
+    memcpy(b.data+sizeof(SIZE_T),&hot[done],n*sizeof(SIZE_T));
+    b.info.numkeys=n;
+    done+=n;
+    rc=WriteNode(hotsetblocks[i],b);
+    if (rc) { return rc; }
+  }
+
+  hh.head=hotsetblocks[0];
+  hh.count=hot.size();
+  SetSuperblockHotSet(superblock,hh);
+  return WriteSuperblock();
+}
+
+
+//
+// The superblock stops pointing at the set before its blocks are
+// freed, so it never names a block the tree may reuse
+//
+ERROR_T BTreeIndex::HotSetFree()
+{
+  HotSetHeader hh;
+  ERROR_T rc;
+
+  if (hotsetblocks.empty() && GetSuperblockHotSet(superblock).head==0) {
+    return ERROR_NOERROR;
+  }
+  memset(&hh,0,sizeof(hh));
+  SetSuperblockHotSet(superblock,hh);
+  rc=WriteSuperblock();
+  if (rc) { return rc; }
+  while (!hotsetblocks.empty()) {
+    rc=DeallocateNode(hotsetblocks.back());
+    if (rc) { return rc; }
+    hotsetblocks.pop_back();
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
+{
+  ERROR_T rc;
+
+  // Free list and tree pointers use block 0 as their null, so that
+  // is where the superblock has to be
+  if (!create && initblock!=0) {
+    return ERROR_NOTANINDEX;
+  }
+
+  // Anything still cached or deferred belongs to whatever was
+  // attached before, and has to reach the disk before it is dropped
+  rc=Checkpoint();
+  if (rc) { return rc; }
+  nodecache.Clear();
+  superblockdirty=false;
+  freeahead.clear();
+
+  superblock_index=0;
+
+  if (create) {
+    // build a super block, root node, and a free space list
+    //
+    // Superblock at superblock_index
+    // root node at superblock_index+1
+    // free space list for rest
+    BTreeNode newsuperblock(BTREE_SUPERBLOCK,
+			    superblock.info.keysize,
+			    superblock.info.valuesize,
+			    buffercache->GetBlockSize());
+    newsuperblock.info.rootnode=superblock_index+1;
+    newsuperblock.info.freelist=superblock_index+2;
+    newsuperblock.info.numkeys=0;
+    SIZE_T leafkeys, interiorkeys;
+    NodeCapacities(buffercache->GetBlockSize(),superblock.info.keysize,
+		   superblock.info.valuesize,maxNumKeys,createflags,
+		   leafkeys,interiorkeys);
+    if (leafkeys<3 || interiorkeys<3) {
+      // a node has to hold at least the key it splits on and one
+      // on either side
+      return ERROR_SIZE;
+    }
+    if ((createflags & BTREE_FLAG_NONUNIQUE)
+	&& (superblock.info.valuesize<=sizeof(SIZE_T)
+	    || (buffercache->GetBlockSize()-sizeof(NodeMetadata)-2*sizeof(SIZE_T)
+		-BTREE_CHECKSUM_BYTES)/(superblock.info.valuesize-sizeof(SIZE_T))<2)) {
+      // no room for a posting list
+      return ERROR_SIZE;
+    }
+    SIZE_T messagekeys=0, messagestart=0, messageroom=0;
+    if (createflags & BTREE_FLAG_MESSAGE_BUFFERS) {
+      MessageLayout(buffercache->GetBlockSize(),superblock.info.keysize,
+		    superblock.info.valuesize,interiorkeys,
+		    messagekeys,messagestart,messageroom);
+      if (messagekeys<3 || messageroom<2) {
+	// keys or values too big to leave room for messages
+	return ERROR_SIZE;
+      }
+    }
+    SetSuperblockFlags(newsuperblock,createflags|BTREE_FLAG_CHECKSUMS);
+    FilterHeader nofilter;
+    memset(&nofilter,0,sizeof(nofilter));
+    SetSuperblockFilter(newsuperblock,nofilter);
+    HotSetHeader nohotset;
+    memset(&nohotset,0,sizeof(nohotset));
+    SetSuperblockHotSet(newsuperblock,nohotset);
+
+    buffercache->NotifyAllocateBlock(superblock_index);
+
+    StampChecksum(newsuperblock);
+    rc=newsuperblock.Serialize(buffercache,superblock_index);
+
+    if (rc) {
+      return rc;
+    }
+
+    BTreeNode newrootnode(BTREE_ROOT_NODE,
+			  superblock.info.keysize,
+			  superblock.info.valuesize,
+			  buffercache->GetBlockSize());
+    newrootnode.info.rootnode=superblock_index+1;
+    newrootnode.info.freelist=superblock_index+2;
+    newrootnode.info.numkeys=0;
+    if (createflags & BTREE_FLAG_MESSAGE_BUFFERS) {
+      MessageBuffer(newrootnode,messagestart,messageroom).Reset();
+    }
+
+    buffercache->NotifyAllocateBlock(superblock_index+1);
+
+    StampChecksum(newrootnode);
+    rc=newrootnode.Serialize(buffercache,superblock_index+1);
+
+    if (rc) {
+      return rc;
+    }
+
+    for (SIZE_T i=superblock_index+2; i<buffercache->GetNumBlocks();i++) {
+      BTreeNode newfreenode(BTREE_UNALLOCATED_BLOCK,
+			    superblock.info.keysize,
+			    superblock.info.valuesize,
+			    buffercache->GetBlockSize());
+      newfreenode.info.rootnode=superblock_index+1;
+      newfreenode.info.freelist= ((i+1)==buffercache->GetNumBlocks()) ? 0: i+1;
+
+      rc = newfreenode.Serialize(buffercache,i);
+
+      if (rc) {
+	return rc;
+      }
+
+    }
+  }
+
+  // OK, now, mounting the btree is simply a matter of reading the superblock
+
+  BTreeNode sb;
+  rc=sb.Unserialize(buffercache,superblock_index);
+  if (rc) { return rc; }
+  if (sb.info.nodetype!=BTREE_SUPERBLOCK) {
+    return ERROR_NOTANINDEX;
+  }
+  if (verifychecksums && (GetSuperblockFlags(sb) & BTREE_FLAG_CHECKSUMS) && !ChecksumOK(sb)) {
+    checksumfailures++;
+    return ERROR_CHECKSUM;
+  }
+  superblock=sb;
+
+  // The options the index was created with, not the current ones
+  indexflags=GetSuperblockFlags(superblock);
+  SIZE_T leafkeys, interiorkeys;
+  NodeCapacities(superblock.info.blocksize,superblock.info.keysize,
+		 superblock.info.valuesize,maxNumKeys,indexflags,
+		 leafkeys,interiorkeys);
+  maxLeafKeys=leafkeys;
+  maxInteriorKeys=interiorkeys;
+  messageoffset=0;
+  messagecapacity=0;
+  if (indexflags & BTREE_FLAG_MESSAGE_BUFFERS) {
+    SIZE_T keys;
+    MessageLayout(superblock.info.blocksize,superblock.info.keysize,
+		  superblock.info.valuesize,interiorkeys,
+		  keys,messageoffset,messagecapacity);
+    maxInteriorKeys=keys;
+  }
+  compressedrawbytes=0;
+  compressedbytes=0;
+
+  // Per-operation scratch, sized once here so steady-state
+  // operations don't allocate
+  scratchval=VALUE_T(superblock.info.valuesize);
+  scratchslot=VALUE_T(superblock.info.valuesize);
+  scratchmod=VALUE_T(PostingValueSize());
+  scratchkey=KEY_T(superblock.info.keysize);
+  scratchtrail.reserve(16);
+
+  rc=KeyFilterLoad();
+  if (rc) { return rc; }
+
+  return HotSetLoad();
+}
+
+
+ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
+{
+  ERROR_T rc;
+
+  rc=KeyFilterStore();
+  if (rc) { return rc; }
+
+  rc=warmrestart ? HotSetStore() : HotSetFree();
+  if (rc) { return rc; }
+
+  rc=nodecache.Flush();
+  if (rc) { return rc; }
+
+  initblock=superblock_index;
+
+  return SerializeSuperblock();
+}
+
+
+// True if key belongs at or before the node's key at offset
+static bool KeyAtOrBefore(const BTreeNode &b, const KEY_VIEW_T &key, const SIZE_T offset)
+{
+  return CompareKeys(key,KEY_VIEW_T(b.ResolveKey(offset),b.info.keysize))<=0;
+}
+
+// First offset in [lo,hi) whose key is >= key, or hi if none
+static SIZE_T BinaryLowerBound(const BTreeNode &b, const KEY_VIEW_T &key, SIZE_T lo, SIZE_T hi)
+{
+  while (lo<hi) {
+    SIZE_T mid=lo+(hi-lo)/2;
+    if (KeyAtOrBefore(b,key,mid)) {
+      hi=mid;
+    } else {
+      lo=mid+1;
+    }
+  }
+  return lo;
+}
+
+// The first (up to) 8 bytes of a key as a big-endian number.  Keys
+// compare the same way, apart from ties within the prefix.
+static uint64_t KeyPrefix(const char *k, const SIZE_T len)
+{
+  uint64_t v=0;
+  SIZE_T i;
+
+  for (i=0;i<8;i++) {
+    v=(v<<8)|(i<len ? (unsigned char)k[i] : 0);
+  }
+  return v;
+}
+
+// Nodes with fewer keys than this are searched by bisection anyway
+#define BTREE_INTERPOLATION_MIN_KEYS 16
+
+//
+// Interpolation search.  The node's first and last keys, read as
+// numbers, make a linear model of where a key sits, and the search
+// gallops outwards from the model's guess in doubling steps until it
+// brackets the key, then bisects the bracket.  A guess off by e slots
+// costs about 2*log2(e) comparisons, so on near-uniform keys a level
+// takes a handful of probes, and on skewed keys it is never more than
+// about twice a plain binary search.
+//
+static SIZE_T InterpolationLowerBound(const BTreeNode &b, const KEY_VIEW_T &key)
+{
+  SIZE_T n = b.info.numkeys;
+  SIZE_T keysize = b.info.keysize;
+  SIZE_T lo;
+  SIZE_T hi;
+  SIZE_T guess;
+  SIZE_T step;
+  uint64_t first;
+  uint64_t last;
+  uint64_t k;
+
+  if (n<BTREE_INTERPOLATION_MIN_KEYS) {
+    return BinaryLowerBound(b,key,0,n);
+  }
+  first=KeyPrefix(b.ResolveKey(0),keysize);
+  last=KeyPrefix(b.ResolveKey(n-1),keysize);
+  k=KeyPrefix(key.data,key.length);
+  if (last<=first) {
+    // the keys differ only past the prefix
+    return BinaryLowerBound(b,key,0,n);
+  }
+  if (k<=first) {
+    guess=0;
+  } else if (k>=last) {
+    guess=n-1;
+  } else {
+    guess=(SIZE_T)((double)(k-first)/(double)(last-first)*(double)(n-1));
+    if (guess>n-1) {
+      guess=n-1;
+    }
+  }
+
+  if (KeyAtOrBefore(b,key,guess)) {
+    // the answer is at or left of the guess
+    lo=0;
+    hi=guess;
+    for (step=1; step<=hi; step*=2) {
+      if (!KeyAtOrBefore(b,key,hi-step)) {
+	lo=hi-step+1;
+	break;
+      }
+      hi-=step;
+    }
+  } else {
+    // right of it
+    lo=guess+1;
+    hi=n;
+    for (step=1; lo+step-1<n; step*=2) {
+      if (KeyAtOrBefore(b,key,lo+step-1)) {
+	hi=lo+step-1;
+	break;
+      }
+      lo+=step;
+    }
+  }
+  return BinaryLowerBound(b,key,lo,hi);
+}
+
+// Pick the child of an interior node that a key should descend into:
+// the pointer just before the first key that is >= the search key, or
+// the last pointer if the search key is larger than every key.
+// slot is left at the pointer's offset.
+static ERROR_T FindChildPtr(const BTreeNode &b, const KEY_VIEW_T &key, SIZE_T &ptr, SIZE_T &slot,
+			    const bool interpolate=false)
+{
+  if (b.info.numkeys==0) {
+    // There are no keys at all on this node, so nowhere to go
+    return ERROR_NONEXISTENT;
+  }
+  if (interpolate) {
+    slot=InterpolationLowerBound(b,key);
+  } else {
+    slot=BinaryLowerBound(b,key,0,b.info.numkeys);
+  }
+  return b.GetPtr(slot,ptr);
+}
+
+// Offset of key in a leaf, or numkeys if it isn't there
+static SIZE_T FindLeafKey(const BTreeNode &b, const KEY_VIEW_T &key)
+{
+  SIZE_T offset;
+
+  for (offset=0;offset<b.info.numkeys;offset++) {
+    if (CompareKeys(key,KEY_VIEW_T(b.ResolveKey(offset),b.info.keysize))==0) {
+      break;
+    }
+  }
+  return offset;
+}
+
+// Copy a value out of a leaf, straight into the caller's Block when
+// it already has the right size
+static ERROR_T CopyOutVal(const BTreeNode &b, const SIZE_T offset, VALUE_T &value)
+{
+  if (value.length==b.info.valuesize) {
+    memcpy(value.data,b.ResolveVal(offset),b.info.valuesize);
+    return ERROR_NOERROR;
+  }
+  return b.GetVal(offset,value);
+}
+
+
+ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
+					   const BTreeOp op,
+					   const KEY_T &key,
+					   VALUE_T &value,
+					   BTreeNodeCache::Entry *hint,
+					   const SIZE_T slot)
+{
+  BTreeNode scratch;
+  BTreeNode *b;
+  ERROR_T rc; // error checker
+  SIZE_T offset;
+  SIZE_T ptr;
+
+  // Borrowed, not copied, when the node is cached, and reached
+  // through the parent's swizzled pointer when it is pinned
+  rc= BorrowNode(node,scratch,b,hint,slot);
+
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+
+  switch (b->info.nodetype) {
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    if (op==BTREE_OP_LOOKUP && Buffered()) {
+      // a pending message is newer than anything further down
+      const char *val;
+      if (FindMessage(*b,key,val)) {
+	if (value.length!=superblock.info.valuesize) {
+	  value=VALUE_T(superblock.info.valuesize);
+	}
+	memcpy(value.data,val,superblock.info.valuesize);
+	return ERROR_NOERROR;
+      }
+    }
+    // Find the first key that's larger and recurse on the
+    // ptr immediately previous to it
+    rc=FindChildPtr(*b,key,ptr,offset,interpolate);
+    if (rc) { return rc; }
+    return LookupOrUpdateInternal(ptr,op,key,value,hint,offset);
+    break;
+  case BTREE_LEAF_NODE:
+    // Scan through keys looking for matching value
+    offset=FindLeafKey(*b,key);
+    if (offset<b->info.numkeys) {
+      	if (op==BTREE_OP_LOOKUP) {
+      	  return CopyOutVal(*b,offset,value);
+	  } else {
+	  // BTREE_OP_UPDATE, changing the borrowed node in place.  A
+	  // compressed leaf may stop fitting its block, and must not be
+	  // left that way in the cache, so it is changed as a copy.
+      if (b!=&scratch && (indexflags & BTREE_FLAG_COMPRESSED_LEAVES)) {
+	scratch=*b;
+	b=&scratch;
+      }
+      rc=b->SetVal(offset,value);
+      if (rc) {  return rc; }
+
+      if (LeafNeedsSplit(*b)) {
+	// A compressed leaf can outgrow its block when a value
+	// changes, so split it instead of writing it
+	BTreeNode leaf(*b); // walking the trail may evict the borrowed copy
+	std::vector<SIZE_T> ptrTrail;
+	ptrTrail.push_back(superblock.info.rootnode);
+	rc=CreatePtrTrail(superblock.info.rootnode,key,ptrTrail);
+	if (rc) {  return rc; }
+	ptrTrail.pop_back(); // leaf
+	ptrTrail.pop_back(); // leaf again
+	return SplitNode(node,leaf,ptrTrail);
+      }
+
+      rc=WriteNode(node,*b);
+      if (rc) {  return rc; }
+
+	    return ERROR_NOERROR;
+	}
+    }
+    // Key is not in the leaf it would have to be in
+    return ERROR_NONEXISTENT;
+    break;
+  default:
+    // We can't be looking at anything other than a root, internal, or leaf
+    return ERROR_INSANE;
+    break;
+  }
+
+  return ERROR_INSANE;
+}
+
+
+static void PrintKeyVal(ostream &os, const char *key, const SIZE_T keysize,
+			const char *val, const SIZE_T valuesize)
+{
+  SIZE_T i;
+
+  os << "(";
+  for (i=0;i<keysize;i++) {
+    os << key[i];
+  }
+  os << ",";
+  for (i=0;i<valuesize;i++) {
+    os << val[i];
+  }
+  os << ")\n";
+}
+
+// messages, if given, are an interior node's pending ones
+static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplayType dt,
+			 const MessageBuffer *messages=0)
+{
+  KEY_T key;
+  VALUE_T value;
+  SIZE_T ptr;
+  SIZE_T offset;
+  ERROR_T rc;
+  unsigned i;
+
+  if (dt==BTREE_DEPTH_DOT) {
+    os << nodenum << " [ label=\""<<nodenum<<": ";
+  } else if (dt==BTREE_DEPTH) {
+    os << nodenum << ": ";
+  } else {
+  }
+
   switch (b.info.nodetype) {
   case BTREE_ROOT_NODE:
   case BTREE_INTERIOR_NODE:
@@ -302,459 +2439,1435 @@ static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplay
 	}
 	os << " ";
       }
+      if (messages && messages->Count()) {
+	// + for an insert, = for an update
+	os << "Messages: ";
+	for (offset=0;offset<messages->Count();offset++) {
+	  os << (messages->Op(offset)==MESSAGE_INSERT ? "+" : "=");
+	  for (i=0;i<b.info.keysize;i++) {
+	    os << messages->Key(offset)[i];
+	  }
+	  os << " ";
+	  for (i=0;i<b.info.valuesize;i++) {
+	    os << messages->Val(offset)[i];
+	  }
+	  os << " ";
+	}
+      }
+    }
+    break;
+  case BTREE_LEAF_NODE:
+    if (dt==BTREE_DEPTH_DOT || dt==BTREE_SORTED_KEYVAL) {
+    } else {
+      os << "Leaf: ";
+    }
+    for (offset=0;offset<b.info.numkeys;offset++) {
+      if (offset==0) {
+	// special case for first pointer
+	rc=b.GetPtr(offset,ptr);
+	if (rc) { return rc; }
+	if (dt!=BTREE_SORTED_KEYVAL) {
+	  os << "*" << ptr << " ";
+	}
+      }
+      if (dt==BTREE_SORTED_KEYVAL) {
+	os << "(";
+      }
+      rc=b.GetKey(offset,key);
+      if (rc) {  return rc; }
+      for (i=0;i<b.info.keysize;i++) {
+	os << key.data[i];
+      }
+      if (dt==BTREE_SORTED_KEYVAL) {
+	os << ",";
+      } else {
+	os << " ";
+      }
+      rc=b.GetVal(offset,value);
+      if (rc) {  return rc; }
+      for (i=0;i<b.info.valuesize;i++) {
+	os << value.data[i];
+      }
+      if (dt==BTREE_SORTED_KEYVAL) {
+	os << ")\n";
+      } else {
+	os << " ";
+      }
+    }
+    break;
+  default:
+    if (dt==BTREE_DEPTH_DOT) {
+      os << "Unknown("<<b.info.nodetype<<")";
+    } else {
+      os << "Unsupported Node Type " << b.info.nodetype ;
+    }
+  }
+  if (dt==BTREE_DEPTH_DOT) {
+    os << "\" ]";
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
+{
+  ERROR_T rc;
+
+  if (KeyFilterExcludes(key)) {
+    return ERROR_NONEXISTENT;
+  }
+  if (Unique()) {
+    rc=LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, value);
+  } else {
+    // the smallest value is kept in the slot, after the list head
+    rc=LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, scratchval);
+    if (rc==ERROR_NOERROR) {
+      if (value.length!=PostingValueSize()) {
+	value=VALUE_T(PostingValueSize());
+      }
+      memcpy(value.data,scratchval.data+sizeof(SIZE_T),PostingValueSize());
+    }
+  }
+  if (rc==ERROR_NONEXISTENT) {
+    KeyFilterMissed();
+  }
+  return rc;
+}
+
+
+ERROR_T BTreeIndex::LookupAll(const KEY_T &key, BTreePostingIterator &it)
+{
+  ERROR_T rc;
+  SIZE_T head = 0;
+
+  it.index=this;
+  it.next=0;
+  it.pos=0;
+  it.inlined=false;
+  it.block.info.numkeys=0;
+
+  if (KeyFilterExcludes(key)) {
+    return ERROR_NONEXISTENT;
+  }
+  rc=LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, scratchval);
+  if (rc==ERROR_NONEXISTENT) {
+    KeyFilterMissed();
+  }
+  if (rc) { return rc; }
+
+  if (!Unique()) {
+    memcpy(&head,scratchval.data,sizeof(SIZE_T));
+  }
+  if (head==0) {
+    it.single=VALUE_T(PostingValueSize());
+    memcpy(it.single.data,scratchval.data+(Unique() ? 0 : sizeof(SIZE_T)),PostingValueSize());
+    it.inlined=true;
+  } else {
+    it.next=head;
+  }
+  return ERROR_NOERROR;
+}
+
+//
+// Batched lookup.  Instead of one full descent per key, the batch
+// walks the tree one level at a time: all keys headed for the same
+// node share a single read of that node, and the nodes of each level
+// are visited in block order so the misses of a level are issued
+// back to back, sorted by position on disk.
+//
+ERROR_T BTreeIndex::LookupBatch(const std::vector<KEY_T> &keys,
+				std::vector<VALUE_T> &values,
+				std::vector<ERROR_T> &rcs)
+{
+  typedef std::map<SIZE_T, std::vector<SIZE_T> > Frontier;
+
+  Frontier level;
+  Frontier next;
+  BTreeNode scratch;
+  BTreeNode *b;
+  ERROR_T rc;
+  SIZE_T offset;
+  SIZE_T ptr;
+  SIZE_T i;
+  SIZE_T probed=0;
+
+  values.resize(keys.size());
+  rcs.assign(keys.size(),ERROR_NONEXISTENT);
+
+  // Keys the filter rules out never join the descent
+  for (i=0;i<keys.size();i++) {
+    if (!KeyFilterExcludes(keys[i])) {
+      level[superblock.info.rootnode].push_back(i);
+      probed++;
+    }
+  }
+
+  while (!level.empty()) {
+    next.clear();
+    for (Frontier::const_iterator it=level.begin(); it!=level.end(); ++it) {
+      const std::vector<SIZE_T> &which = it->second;
+
+      rc=BorrowNode(it->first,scratch,b);
+      if (rc) { return rc; }
+
+      switch (b->info.nodetype) {
+      case BTREE_ROOT_NODE:
+      case BTREE_INTERIOR_NODE:
+	for (i=0;i<which.size();i++) {
+	  const char *val;
+	  if (Buffered() && FindMessage(*b,keys[which[i]],val)) {
+	    values[which[i]]=VALUE_T(superblock.info.valuesize);
+	    memcpy(values[which[i]].data,val,superblock.info.valuesize);
+	    rcs[which[i]]=ERROR_NOERROR;
+	    continue;
+	  }
+	  rc=FindChildPtr(*b,keys[which[i]],ptr,offset,interpolate);
+	  if (rc==ERROR_NONEXISTENT) {
+	    continue;
+	  } else if (rc) {
+	    return rc;
+	  }
+	  next[ptr].push_back(which[i]);
+	}
+	break;
+      case BTREE_LEAF_NODE:
+	for (i=0;i<which.size();i++) {
+	  offset=FindLeafKey(*b,keys[which[i]]);
+	  if (offset<b->info.numkeys) {
+	    rcs[which[i]]=CopyOutVal(*b,offset,values[which[i]]);
+	  }
+	}
+	break;
+      default:
+	return ERROR_INSANE;
+	break;
+      }
+    }
+    level.swap(next);
+  }
+
+  for (i=0;i<keys.size();i++) {
+    if (rcs[i]==ERROR_NOERROR) {
+      probed--;
+      if (!Unique()) {
+	VALUE_T v(PostingValueSize());
+	memcpy(v.data,values[i].data+sizeof(SIZE_T),PostingValueSize());
+	values[i]=v;
+      }
+    }
+  }
+  while (probed-->0) {
+    KeyFilterMissed();
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+{
+  // ROHAN TAKE 1
+
+  // Creating B+ tree without linking leaf nodes.
+  // Will link leaf nodes for extra credit
+
+  ERROR_T rc;
+
+  // Sizes are checked before anything is looked up, since the leaf is
+  // opened up for the key before its bytes are copied in
+  if (key.length!=superblock.info.keysize || value.length!=PostingValueSize()) {
+    return ERROR_SIZE;
+  }
+
+  // Lookup to see if value exists.
+  // If it does, rc will return NOERROR -> return ERROR_CONFLICT due to duplicate key
+  // If lookup returns NONEXISTENT, then we can insert value into tree
+  // (the value found, if any, goes to scratch space, not a copy of value)
+  // A key the filter rules out needs no lookup at all
+  if (KeyFilterExcludes(key)) {
+    rc = ERROR_NONEXISTENT;
+  } else {
+    rc = LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, scratchval);
+    if (rc==ERROR_NONEXISTENT) {
+      KeyFilterMissed();
+    }
+  }
+  if (rc==ERROR_NOERROR) {
+    // A non-unique key just gets another value
+    return Unique() ? ERROR_CONFLICT : PostingAdd(key,value);
+  }
+  else if (rc!=ERROR_NONEXISTENT) {
+    return rc;
+  }
+
+  // Into the filter before the tree, so that no copy of the key
+  // reaches the disk while the stored filter still says it is clean
+  rc = KeyFilterAdd(key);
+  if (rc) { return rc; }
+
+  const VALUE_T &slot = Unique() ? value : PostingSlot(0,value.data);
+  if (Buffered()) {
+    return PutMessage(MESSAGE_INSERT,key,slot);
+  }
+  return InsertInternal(key,slot);
+}
+
+
+ERROR_T BTreeIndex::InsertInternal(const KEY_T &key, const VALUE_T &value)
+{
+  ERROR_T rc;
+  BTreeNode leafNode;
+  BTreeNode rootNode;
+  BTreeNode rightLeafNode;
+  BTreeNode *root;
+  SIZE_T leafPtr;
+  SIZE_T rightLeafPtr;
+  rc = BorrowNode(superblock.info.rootnode,rootNode,root); // Set root.
+  if (rc) { return rc; }
+
+  // If no keys exist in tree yet
+  if(root->info.numkeys == 0) {
+    rc = AllocateNode(leafPtr); // Allocate a new block
+    if (rc) { return rc; }
+    leafNode = BTreeNode(BTREE_LEAF_NODE,superblock.info.keysize,superblock.info.valuesize,LeafBlockSize());
+
+    // Insert value into node
+    leafNode.SetKey(0, key); // Assign key to offset 0 within LeafNode
+    leafNode.SetVal(0, value); // Assign value to offset 0 within leafNode
+    leafNode.info.numkeys++;
+    rc = WriteNode(leafPtr,leafNode); // Write the leaf once, with its first key
+    if (rc) { return rc; }
+
+    // Link leafNode to root of tree
+    rc = ReadNode(superblock.info.rootnode,rootNode);
+    if (rc) { return rc; }
+    rootNode.SetKey(0,key);
+    rootNode.SetPtr(0,leafPtr);
+    rootNode.info.numkeys++;
+
+    // Create a node to the right of new leafNode
+    rc = AllocateNode(rightLeafPtr);
+    if (rc) { return rc; }
+    rightLeafNode = BTreeNode(BTREE_LEAF_NODE,superblock.info.keysize,superblock.info.valuesize,LeafBlockSize());
+    rc = WriteNode(rightLeafPtr,rightLeafNode);
+    if (rc) { return rc; }
+
+    // Connect rightLeafNode to root
+    rootNode.SetPtr(1,rightLeafPtr);
+    rc = WriteNode(superblock.info.rootnode,rootNode);
+    if (rc) { return rc; }
+  }
+
+  // If tree already exists
+  else {
+    // Get leafNode from last pointer where we want to insert key
+    std::vector<SIZE_T> &ptrTrail = scratchtrail; // Follow pointers to spot for insertion
+    BTreeNode *leaf;
+    rc = DescendToLeaf(key,ptrTrail,leafNode,leaf);
+    if (rc) { return rc; }
+    return InsertIntoLeaf(ptrTrail,leafNode,leaf,key,value);
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::InsertIntoLeaf(const std::vector<SIZE_T> &ptrTrail,
+				   BTreeNode &leafNode,
+				   BTreeNode *leaf,
+				   const KEY_T &key,
+				   const VALUE_T &value)
+{
+  ERROR_T rc;
+  SIZE_T leafPtr = ptrTrail.back();
+
+  // The leaf is changed in place when it is cached,
+  if (leaf!=&leafNode
+      && ((indexflags & BTREE_FLAG_COMPRESSED_LEAVES)
+	  || (int)leaf->info.numkeys+1 > (int)(2*maxLeafKeys/3))) {
+    // unless it is compressed, and may come out too big to cache, or
+    // the key makes it split: a split that fails must leave the
+    // cached leaf as it was
+    leafNode = *leaf;
+    leaf = &leafNode;
+  }
+
+  // Walk across the leafNode & increment key count
+  leaf->info.numkeys++;
+
+  // If that was the only key in the leafNode
+  if (leaf->info.numkeys == 1) {
+    rc = leaf->SetKey(0,key);
+    if(rc) { return rc; }
+    rc = leaf->SetVal(0,value);
+    if(rc) { return rc; }
+  }
+  // If there were other keys in the leafNode
+  else {
+    SIZE_T keysize = leaf->info.keysize;
+    SIZE_T valuesize = leaf->info.valuesize;
+    SIZE_T offset;
+    // Loop through leafNode to find spot to insert
+    for (offset=0; offset<leaf->info.numkeys-1; offset++) {
+      if (CompareKeys(key,KEY_VIEW_T(leaf->ResolveKey(offset),keysize))<0) {
+        break;
+      }
+    }
+    // Shift over all following keys by 1 space, byte for byte
+    // (counting down from the end, stopping above offset so
+    // an insert at offset 0 does not wrap around)
+    for (SIZE_T offset2=leaf->info.numkeys-1; offset2>offset; offset2--){
+      memcpy(leaf->ResolveKey(offset2),leaf->ResolveKey(offset2-1),keysize);
+      memcpy(leaf->ResolveVal(offset2),leaf->ResolveVal(offset2-1),valuesize);
+    }
+
+    // Insert new key in spot found above
+    rc = leaf->SetKey(offset,key);
+    if (rc) { return rc; }
+    rc = leaf->SetVal(offset,value);
+    if (rc) { return rc; }
+  }
+
+  // Check if the node length is over 2/3 (or a compressed leaf no
+  // longer fits its block), and split it straight from memory if
+  // so, since its halves replace it anyway
+    if (LeafNeedsSplit(*leaf)) {
+        std::vector<SIZE_T> path(ptrTrail);
+        path.pop_back(); // the trail ends with the leaf itself
+        rc = SplitNode(leafPtr, *leaf, path);
+        if (rc) { return rc; }
+    } else {
+        rc = WriteNode(leafPtr,*leaf); // Write back (deferred in write-back mode)
+        if (rc) { return rc; }
+    }
+
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::DescendToLeaf(const KEY_T &key, std::vector<SIZE_T> &ptrTrail,
+				  BTreeNode &scratch, BTreeNode *&leaf) const
+{
+  BTreeNodeCache::Entry *hint = 0;
+  SIZE_T node = superblock.info.rootnode;
+  SIZE_T slot = 0;
+  ERROR_T rc;
+
+  ptrTrail.clear();
+  while (true) {
+    // scratch only ever holds the node being looked at
+    rc=BorrowNode(node,scratch,leaf,hint,slot);
+    if (rc) { return rc; }
+    ptrTrail.push_back(node);
+    switch (leaf->info.nodetype) {
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      rc=FindChildPtr(*leaf,key,node,slot,interpolate);
+      if (rc) { return rc; }
+      break;
+    case BTREE_LEAF_NODE:
+      return ERROR_NOERROR;
+    default:
+      return ERROR_INSANE;
     }
+  }
+}
+
+
+// Return trail of pointers to the node we will inset into
+ERROR_T BTreeIndex::CreatePtrTrail(const SIZE_T &node, const KEY_T &key, std::vector<SIZE_T> &ptrTrail,
+				   BTreeNodeCache::Entry *hint, const SIZE_T slot){
+  BTreeNode scratch;
+  BTreeNode *b;
+  ERROR_T rc;
+  SIZE_T ptr;
+  SIZE_T offset;
+
+  rc = BorrowNode(node,scratch,b,hint,slot);
+
+  if(rc!=ERROR_NOERROR){
+    return rc;
+  }
+
+  switch(b->info.nodetype){
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      // Follow the same pointer a lookup would, so the trail also
+      // leads to existing keys that equal a separator
+    rc=FindChildPtr(*b,key,ptr,offset,interpolate);
+    if (rc) { return rc; }
+      //put it on stack and recurse with the updated ptrTrail
+    ptrTrail.push_back(ptr);
+    return CreatePtrTrail(ptr, key, ptrTrail, hint, offset);
     break;
-  case BTREE_LEAF_NODE:
-    if (dt==BTREE_DEPTH_DOT || dt==BTREE_SORTED_KEYVAL) {
-    } else {
-      os << "Leaf: ";
+    case BTREE_LEAF_NODE:
+        //if at a leaf, put the node on the stack and return
+    ptrTrail.push_back(node);
+    return ERROR_NOERROR;
+    break;
+    default:
+        // if data object is not a rootnode, an internalnode, or a leaf, throw and error
+    return ERROR_INSANE;
+    break;
+  }
+
+  return ERROR_INSANE;
+
+}
+
+
+ERROR_T BTreeIndex::TreeBalance(const SIZE_T &node, std::vector<SIZE_T> ptrPath)
+{
+  BTreeNode b;
+  ERROR_T rc;
+
+  rc = ReadNode(node,b);
+  if (rc) { return rc;}
+
+  return SplitNode(node, b, ptrPath);
+}
+
+ERROR_T BTreeIndex::SplitNode(const SIZE_T &node, BTreeNode &b, std::vector<SIZE_T> ptrPath)
+{
+  BTreeNode leftNode;
+  BTreeNode rightNode;
+  ERROR_T rc;
+  SIZE_T offset;
+
+  int nodeType;
+  SIZE_T nodeBlockSize;
+
+  if (b.info.nodetype == BTREE_LEAF_NODE) {
+    // Two halves for the leaf and for each node above it, and a
+    // new root, in case the split goes all the way up
+    rc = ReserveNodes(2*(ptrPath.size()+1)+1);
+    if (rc) { return rc; }
+  }
+
+  //Allocate left and right pointers
+  SIZE_T leftPtr;
+  SIZE_T rightPtr;
+  rc = AllocateNode(leftPtr);
+  if (rc) { return rc;}
+  rc = AllocateNode(rightPtr);
+  if (rc) { return rc;}
+  if(b.info.nodetype == BTREE_LEAF_NODE){
+    nodeType = BTREE_LEAF_NODE;
+    nodeBlockSize = LeafBlockSize();
+  }else{
+    nodeType = BTREE_INTERIOR_NODE;
+    nodeBlockSize = superblock.info.blocksize;
+  }
+  // The new halves are only written once they are filled in below
+  leftNode = BTreeNode(nodeType, superblock.info.keysize, superblock.info.valuesize, nodeBlockSize);
+  rightNode = BTreeNode(nodeType, superblock.info.keysize, superblock.info.valuesize, nodeBlockSize);
+
+  //Tracker variables
+  SIZE_T keysize = superblock.info.keysize;
+  SIZE_T valuesize = superblock.info.valuesize;
+  SIZE_T ptrLoc;
+
+  int mid = (b.info.numkeys+0.5)/2;
+  if (b.info.nodetype==BTREE_LEAF_NODE && b.info.blocksize!=superblock.info.blocksize) {
+    // compressed entries vary in size, so split by bytes, not count
+    mid = CompressedLeafSplitPoint(b);
+  } else if (b.info.nodetype!=BTREE_LEAF_NODE) {
+    // key mid-1 moves up, and the left half keeps at least one key
+    mid = (b.info.numkeys+1)/2;
+  }
+//Check if its a leafnode
+  if(b.info.nodetype==BTREE_LEAF_NODE){
+    for(offset = 0; (int)offset < mid; offset++){
+      leftNode.info.numkeys++;
+
+    //Copy the old entries straight into the new nodes
+      memcpy(leftNode.ResolveKey(offset), b.ResolveKey(offset), keysize);
+      memcpy(leftNode.ResolveVal(offset), b.ResolveVal(offset), valuesize);
     }
-    for (offset=0;offset<b.info.numkeys;offset++) {
-      if (offset==0) {
-	// special case for first pointer
-	rc=b.GetPtr(offset,ptr);
-	if (rc) { return rc; }
-	if (dt!=BTREE_SORTED_KEYVAL) {
-	  os << "*" << ptr << " ";
-	}
-      }
-      if (dt==BTREE_SORTED_KEYVAL) {
-	os << "(";
-      }
-      rc=b.GetKey(offset,key);
-      if (rc) {  return rc; }
-      for (i=0;i<b.info.keysize;i++) {
-	os << key.data[i];
-      }
-      if (dt==BTREE_SORTED_KEYVAL) {
-	os << ",";
-      } else {
-	os << " ";
+    int place=0;
+    for(offset = mid; offset<b.info.numkeys; offset++){
+
+    //same process but now with right node
+      rightNode.info.numkeys++;
+      memcpy(rightNode.ResolveKey(place), b.ResolveKey(offset), keysize);
+      memcpy(rightNode.ResolveVal(place), b.ResolveVal(offset), valuesize);
+      place++;
+    }
+  } else {
+    //interior node: the separator goes up to the parent, so the
+    //left half ends with the pointer before it
+  for(offset = 0; (int)offset < mid; offset++){
+    if ((int)offset < mid-1) {
+      leftNode.info.numkeys++;
+      memcpy(leftNode.ResolveKey(offset), b.ResolveKey(offset), keysize);
+    }
+    rc = b.GetPtr(offset, ptrLoc);
+    if (rc) { return rc;}
+    rc = leftNode.SetPtr(offset, ptrLoc);
+    if (rc) { return rc;}
+  }
+    int place=0;
+    for(offset = mid; offset<b.info.numkeys; offset++){
+    rightNode.info.numkeys++;
+    memcpy(rightNode.ResolveKey(place), b.ResolveKey(offset), keysize);
+    rc = b.GetPtr(offset, ptrLoc);
+    if (rc) { return rc;}
+    rc = rightNode.SetPtr(place, ptrLoc);
+    if (rc) { return rc;}
+    place++;
+  }
+  rc = b.GetPtr(offset, ptrLoc);
+  if (rc) { return rc;}
+  rc = rightNode.SetPtr(place, ptrLoc);
+  if (rc) { return rc;}
+  if (Buffered()) {
+    // Each pending message goes with the half its key routes to
+    KEY_VIEW_T sep(b.ResolveKey(mid-1), keysize);
+    MessageBuffer messages(b,messageoffset,messagecapacity);
+    MessageBuffer left(leftNode,messageoffset,messagecapacity);
+    MessageBuffer right(rightNode,messageoffset,messagecapacity);
+    left.Reset();
+    right.Reset();
+    for (offset=0; offset<messages.Count(); offset++) {
+      MessageBuffer &half = CompareKeys(KEY_VIEW_T(messages.Key(offset),keysize),sep)<=0 ? left : right;
+      half.Put(messages.Op(offset),messages.Key(offset),messages.Val(offset));
+    }
+  }
+}
+  //Serialize the new nodes
+rc = WriteNode(leftPtr,leftNode);
+if (rc) { return rc;}
+rc = WriteNode(rightPtr,rightNode);
+if (rc) { return rc;}
+// b is deallocated below, so it is not written back
+
+KEY_T splitKey;
+rc = b.GetKey(mid-1, splitKey);
+if (rc) { return rc;}
+
+//check if root
+if (b.info.nodetype == BTREE_ROOT_NODE) {
+  SIZE_T newRootPtr;
+  BTreeNode newRootNode;
+  rc = AllocateNode(newRootPtr);
+  if (rc) { return rc;}
+  newRootNode = BTreeNode(BTREE_ROOT_NODE, superblock.info.keysize, superblock.info.valuesize, superblock.info.blocksize);
+  superblock.info.rootnode = newRootPtr;
+    newRootNode.info.rootnode = newRootPtr;
+    newRootNode.info.numkeys = 1;
+    rc = newRootNode.SetKey(0, splitKey);
+    if (rc) { return rc;}
+    rc = newRootNode.SetPtr(0, leftPtr);
+    if (rc) { return rc;}
+    rc = newRootNode.SetPtr(1, rightPtr);
+    if (rc) { return rc;}
+    if (Buffered()) {
+      MessageBuffer(newRootNode,messageoffset,messagecapacity).Reset();
+    }
+  rc = WriteNode(newRootPtr,newRootNode);
+  if(rc) {return rc;}
+}
+else{
+//get parent node
+  SIZE_T parentPtr = ptrPath.back();
+  ptrPath.pop_back();
+  BTreeNode parentNode;
+  rc = ReadNode(parentPtr,parentNode);
+  if(rc) {return rc;}
+
+    if (parentNode.info.nodetype == BTREE_SUPERBLOCK) {
+        rc = AllocateNode(parentPtr);
+        if (rc) {return rc;}
+    }
+    BTreeNode pNode = BTreeNode(parentNode.info.nodetype, superblock.info.keysize, superblock.info.valuesize, superblock.info.blocksize);
+    pNode.info.numkeys = parentNode.info.numkeys + 1;
+    pNode.info.freelist = parentNode.info.freelist;
+    if (Buffered()) {
+      // the parent's pending messages stay where they are
+      memcpy(pNode.data+messageoffset, parentNode.data+messageoffset,
+	     sizeof(uint32_t)+messagecapacity*(1+keysize+valuesize));
+    }
+
+    bool newKeyInserted = false;
+    for (offset = 0; offset < pNode.info.numkeys - 1; offset++) {
+        KEY_VIEW_T testKey(parentNode.ResolveKey(offset), keysize);
+        if (newKeyInserted) {
+            memcpy(pNode.ResolveKey(offset + 1), testKey.data, keysize);
+
+            rc = parentNode.GetPtr(offset + 1, ptrLoc);
+            if (rc) {return rc;}
+            rc = pNode.SetPtr(offset + 2, ptrLoc);
+            if (rc) {return rc;}
+        } else {
+            if (CompareKeys(splitKey, testKey) < 0) {
+                newKeyInserted = true;
+                rc = pNode.SetPtr(offset, leftPtr);
+                if (rc) {return rc;}
+                rc = pNode.SetKey(offset, splitKey);
+                if (rc) {return rc;}
+                rc = pNode.SetPtr(offset+1, rightPtr);
+                if (rc) {return rc;}
+                offset = offset - 1;
+
+            } else {
+                memcpy(pNode.ResolveKey(offset), testKey.data, keysize);
+
+                rc = parentNode.GetPtr(offset, ptrLoc);
+                if (rc) {return rc;}
+                rc = pNode.SetPtr(offset, ptrLoc);
+                if (rc) {return rc;}
+            }
+        }
+    }
+    if (newKeyInserted == false) {
+        newKeyInserted = true;
+        rc = pNode.SetPtr(offset, leftPtr);
+        if (rc) {return rc;}
+        rc = pNode.SetKey(offset, splitKey);
+        if (rc) {return rc;}
+        rc = pNode.SetPtr(offset+1, rightPtr);
+        if (rc) {return rc;}
+    }
+
+    rc = WriteNode(parentPtr,pNode);
+    if (rc) {return rc;}
+
+  if((int)pNode.info.numkeys > (int)(2*maxInteriorKeys/3)){
+    rc = TreeBalance(parentPtr, ptrPath);
+    if(rc){ return rc;}
+  }
+}
+return DeallocateNode(node);
+}
+
+ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
+{
+  ERROR_T rc;
+
+  if (KeyFilterExcludes(key)) {
+    return ERROR_NONEXISTENT;
+  }
+  if (!Unique()) {
+    if (value.length!=PostingValueSize()) {
+      return ERROR_SIZE;
+    }
+    rc=LookupOrUpdateInternal(superblock.info.rootnode,BTREE_OP_LOOKUP,key,scratchval);
+    if (rc==ERROR_NOERROR) {
+      SIZE_T head;
+      memcpy(&head,scratchval.data,sizeof(SIZE_T));
+      if (head!=0) {
+	// no telling which of its values to replace
+	return ERROR_CONFLICT;
       }
-      rc=b.GetVal(offset,value);
-      if (rc) {  return rc; }
-      for (i=0;i<b.info.valuesize;i++) {
-	os << value.data[i];
+      VALUE_T &slot = PostingSlot(0,value.data);
+      if (Buffered()) {
+	return PutMessage(MESSAGE_UPDATE,key,slot);
       }
-      if (dt==BTREE_SORTED_KEYVAL) {
-	os << ")\n";
-      } else {
-	os << " ";
+      return LookupOrUpdateInternal(superblock.info.rootnode,BTREE_OP_UPDATE,key,slot);
+    }
+  } else if (Buffered()) {
+    // The key has to be there, but its leaf is only changed when
+    // the update reaches it
+    rc=LookupOrUpdateInternal(superblock.info.rootnode,BTREE_OP_LOOKUP,key,scratchval);
+    if (rc==ERROR_NOERROR) {
+      return PutMessage(MESSAGE_UPDATE,key,value);
+    }
+  } else {
+    // Through scratch space, since the descent takes a value it may
+    // write to; copying into it allocates nothing
+    if (value.length!=scratchval.length) {
+      return ERROR_SIZE;
+    }
+    memcpy(scratchval.data,value.data,value.length);
+    rc=LookupOrUpdateInternal(superblock.info.rootnode,BTREE_OP_UPDATE,key,scratchval);
+  }
+  if (rc==ERROR_NONEXISTENT) {
+    KeyFilterMissed();
+  }
+  return rc;
+}
+
+
+// Upsert is a Modify that stores the same value either way
+class ReplaceValue : public BTreeValueModifier {
+ public:
+  ReplaceValue(const VALUE_T &v) : newvalue(v) {}
+  bool Modify(const KEY_T &, VALUE_T &value, const bool) {
+    memcpy(value.data,newvalue.data,value.length);
+    return true;
+  }
+ private:
+  const VALUE_T &newvalue;
+};
+
+
+ERROR_T BTreeIndex::Upsert(const KEY_T &key, const VALUE_T &value)
+{
+  if (key.length!=superblock.info.keysize || value.length!=PostingValueSize()) {
+    return ERROR_SIZE;
+  }
+  ReplaceValue replace(value);
+  return Modify(key,replace);
+}
+
+
+//
+// One descent records the trail to the key's leaf and borrows the
+// leaf, which is then either changed in place or has the key
+// inserted into it, with the trail at hand for a split.  With message buffers the value may
+// still be in a buffer on the way down, so the descent is a lookup
+// and the result is queued like any other write.
+//
+ERROR_T BTreeIndex::Modify(const KEY_T &key, BTreeValueModifier &fn)
+{
+  ERROR_T rc;
+  BTreeNode leafNode;
+  BTreeNode *leaf;
+  SIZE_T leafPtr;
+  SIZE_T offset;
+  SIZE_T head;
+  SIZE_T vs = PostingValueSize();
+  SIZE_T skip = Unique() ? 0 : sizeof(SIZE_T); // the posting list head
+  VALUE_T &value = scratchmod;
+  std::vector<SIZE_T> &ptrTrail = scratchtrail;
+  bool exists;
+
+  if (key.length!=superblock.info.keysize) {
+    return ERROR_SIZE;
+  }
+
+  if (Buffered()) {
+    if (KeyFilterExcludes(key)) {
+      rc=ERROR_NONEXISTENT;
+    } else {
+      rc=LookupOrUpdateInternal(superblock.info.rootnode,BTREE_OP_LOOKUP,key,scratchval);
+      if (rc==ERROR_NONEXISTENT) {
+	KeyFilterMissed();
       }
     }
-    break;
-  default:
-    if (dt==BTREE_DEPTH_DOT) {
-      os << "Unknown("<<b.info.nodetype<<")";
+    if (rc && rc!=ERROR_NONEXISTENT) {
+      return rc;
+    }
+    exists = rc==ERROR_NOERROR;
+    if (exists) {
+      if (skip) {
+	memcpy(&head,scratchval.data,sizeof(SIZE_T));
+	if (head!=0) {
+	  return ERROR_CONFLICT;
+	}
+      }
+      memcpy(value.data,scratchval.data+skip,vs);
     } else {
-      os << "Unsupported Node Type " << b.info.nodetype ;
+      memset(value.data,0,vs);
+    }
+    if (!fn.Modify(key,value,exists)) {
+      return ERROR_NOERROR;
+    }
+    if (value.length!=vs) {
+      value=VALUE_T(vs);
+      return ERROR_SIZE;
     }
+    if (!exists) {
+      rc=KeyFilterAdd(key);
+      if (rc) { return rc; }
+    }
+    return PutMessage(exists ? MESSAGE_UPDATE : MESSAGE_INSERT,key,
+		      Unique() ? value : PostingSlot(0,value.data));
   }
-  if (dt==BTREE_DEPTH_DOT) {
-    os << "\" ]";
+
+  rc=DescendToLeaf(key,ptrTrail,leafNode,leaf);
+  if (rc==ERROR_NONEXISTENT) {
+    // The tree has no leaves yet
+    memset(value.data,0,vs);
+    if (!fn.Modify(key,value,false)) {
+      return ERROR_NOERROR;
+    }
+    if (value.length!=vs) {
+      value=VALUE_T(vs);
+      return ERROR_SIZE;
+    }
+    rc=KeyFilterAdd(key);
+    if (rc) { return rc; }
+    return InsertInternal(key,Unique() ? value : PostingSlot(0,value.data));
   }
-  return ERROR_NOERROR;
+  if (rc) { return rc; }
+  leafPtr=ptrTrail.back();
+  offset=FindLeafKey(*leaf,key);
+
+  if (offset==leaf->info.numkeys) {
+    memset(value.data,0,vs);
+    if (!fn.Modify(key,value,false)) {
+      return ERROR_NOERROR;
+    }
+    if (value.length!=vs) {
+      value=VALUE_T(vs);
+      return ERROR_SIZE;
+    }
+    rc=KeyFilterAdd(key);
+    if (rc) { return rc; }
+    return InsertIntoLeaf(ptrTrail,leafNode,leaf,key,Unique() ? value : PostingSlot(0,value.data));
+  }
+
+  if (skip) {
+    memcpy(&head,leaf->ResolveVal(offset),sizeof(SIZE_T));
+    if (head!=0) {
+      return ERROR_CONFLICT;
+    }
+  }
+  memcpy(value.data,leaf->ResolveVal(offset)+skip,vs);
+  if (!fn.Modify(key,value,true)) {
+    return ERROR_NOERROR;
+  }
+  if (value.length!=vs) {
+    value=VALUE_T(vs);
+    return ERROR_SIZE;
+  }
+
+  // Changed in place, unless it is a cached compressed leaf, which
+  // must not be left too big for its block in the cache
+  if (leaf!=&leafNode && (indexflags & BTREE_FLAG_COMPRESSED_LEAVES)) {
+    leafNode=*leaf;
+    leaf=&leafNode;
+  }
+  memcpy(leaf->ResolveVal(offset)+skip,value.data,vs);
+
+  if (LeafNeedsSplit(*leaf)) {
+    std::vector<SIZE_T> path(ptrTrail);
+    path.pop_back(); // the trail ends with the leaf itself
+    if (leaf!=&leafNode) {
+      leafNode=*leaf; // the split may evict the borrowed node
+    }
+    return SplitNode(leafPtr,leafNode,path);
+  }
+  return WriteNode(leafPtr,*leaf);
 }
 
-ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
+
+//
+// Posting lists.  A posting block's data is the next block's number,
+// then, in the first block of a list only, the last block's number,
+// and then numkeys values in ascending byte order.  The values of
+// the blocks in a chain ascend as well.
+//
+static SIZE_T PostingNext(const BTreeNode &b)
 {
-  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, value);
+  SIZE_T next;
+
+  memcpy(&next,b.data,sizeof(SIZE_T));
+  return next;
 }
 
-ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+static void SetPostingNext(BTreeNode &b, const SIZE_T next)
 {
-  // ROHAN TAKE 1
+  memcpy(b.data,&next,sizeof(SIZE_T));
+}
 
-  // Creating B+ tree without linking leaf nodes.
-  // Will link leaf nodes for extra credit
+static SIZE_T PostingTail(const BTreeNode &b)
+{
+  SIZE_T tail;
 
-  ERROR_T rc;
-  VALUE_T val = value;
+  memcpy(&tail,b.data+sizeof(SIZE_T),sizeof(SIZE_T));
+  return tail;
+}
 
-  // Lookup to see if value exists.
-  // If it does, rc will return NOERROR -> return ERROR_CONFLICT due to duplicate key
-  // If lookup returns NONEXISTENT, then we can insert value into tree
-  rc = LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, val);
-  if (rc==ERROR_NOERROR) {
-    return ERROR_CONFLICT;
-  }
-  else if (rc!=ERROR_NONEXISTENT) {
-    return rc;
+static void SetPostingTail(BTreeNode &b, const SIZE_T tail)
+{
+  memcpy(b.data+sizeof(SIZE_T),&tail,sizeof(SIZE_T));
+}
+
+static char *PostingVal(const BTreeNode &b, const SIZE_T valuesize, const SIZE_T i)
+{
+  return b.data+2*sizeof(SIZE_T)+i*valuesize;
+}
+
+// First position in b whose value is >= value (numkeys if none)
+static SIZE_T PostingLowerBound(const BTreeNode &b, const SIZE_T valuesize, const char *value)
+{
+  SIZE_T lo=0;
+  SIZE_T hi=b.info.numkeys;
+
+  while (lo<hi) {
+    SIZE_T mid=lo+(hi-lo)/2;
+    if (memcmp(PostingVal(b,valuesize,mid),value,valuesize)<0) {
+      lo=mid+1;
+    } else {
+      hi=mid;
+    }
   }
+  return lo;
+}
 
-  BTreeNode leafNode;
-  BTreeNode rootNode;
-  BTreeNode rightLeafNode;
-  SIZE_T leafPtr;
-  SIZE_T rightLeafPtr;
-  rootNode.Unserialize(buffercache,superblock.info.rootnode); // Set root.
 
-  // If no keys exist in tree yet
-  if(rootNode.info.numkeys == 0) {
-    AllocateNode(leafPtr); // Allocate a new block
-    leafNode = BTreeNode(BTREE_LEAF_NODE,superblock.info.keysize,superblock.info.valuesize,superblock.info.blocksize);
-    leafNode.Serialize(buffercache,leafPtr);
-    rc = leafNode.Unserialize(buffercache,leafPtr);
-    if (rc) { return rc; }
+bool BTreeIndex::Unique() const
+{
+  return (indexflags & BTREE_FLAG_NONUNIQUE)==0;
+}
 
-    // Insert value into node
-    leafNode.SetKey(0, key); // Assign key to offset 0 within LeafNode
-    leafNode.SetVal(0, value); // Assign value to offset 0 within leafNode
-    leafNode.info.numkeys++;
-    leafNode.Serialize(buffercache,leafPtr); // Serialize again and write updated valuesize
 
-    // Link leafNode to root of tree
-    rc = rootNode.Unserialize(buffercache, superblock.info.rootnode);
-    if (rc) { return rc; }
-    rootNode.SetKey(0,key);
-    rootNode.SetPtr(0,leafPtr);
-    rootNode.info.numkeys++;
+SIZE_T BTreeIndex::PostingValueSize() const
+{
+  return Unique() ? superblock.info.valuesize : superblock.info.valuesize-sizeof(SIZE_T);
+}
 
-    // Create a node to the right of new leafNode
-    AllocateNode(rightLeafPtr);
-    rightLeafNode = BTreeNode(BTREE_LEAF_NODE,superblock.info.keysize,superblock.info.valuesize,superblock.info.blocksize);
-    rc = rightLeafNode.Serialize(buffercache,rightLeafPtr);
-    if (rc) { return rc; }
 
-    // Connect rightLeafNode to root
-    rootNode.SetPtr(1,rightLeafPtr);
-    rc = rootNode.Serialize(buffercache,superblock.info.rootnode);
-    if (rc) { return rc; }
-  }
+SIZE_T BTreeIndex::PostingBlockCapacity() const
+{
+  return (buffercache->GetBlockSize()-sizeof(NodeMetadata)-2*sizeof(SIZE_T)
+	  -BTREE_CHECKSUM_BYTES)/PostingValueSize();
+}
 
-  // If tree already exists
-  else {
-    // Get leafNode from last pointer where we want to insert key
-    std::vector<SIZE_T> ptrTrail; // Follow pointers to spot for insertion
-    ptrTrail.push_back(superblock.info.rootnode); // Dynamically resize and add root to end
-    CreatePtrTrail(superblock.info.rootnode,key,ptrTrail);
-    leafPtr = ptrTrail.back();
-    ptrTrail.pop_back();
 
-    rc = leafNode.Unserialize(buffercache, leafPtr);
-    if(rc) { return rc; }
+VALUE_T & BTreeIndex::PostingSlot(const SIZE_T head, const char *value)
+{
+  memcpy(scratchslot.data,&head,sizeof(SIZE_T));
+  memcpy(scratchslot.data+sizeof(SIZE_T),value,PostingValueSize());
+  return scratchslot;
+}
 
-    // Walk across the leafNode & increment key count
-    leafNode.info.numkeys++;
 
-    // If that was the only key in the leafNode
-    if (leafNode.info.numkeys == 1) {
-      rc = leafNode.SetKey(0,key);
-      if(rc) { return rc; }
-      rc = leafNode.SetVal(0,value);
-      if(rc) { return rc; }
-    }
-    // If there were other keys in the leafNode
-    else {
-      KEY_T testkey;
-      KEY_T keyInsPos;
-      VALUE_T valueInsPos;
-      bool inserted = false;
-      // Loop through leafNode to find spot to insert
-      for (SIZE_T offset=0; offset<leafNode.info.numkeys-1; offset++) {
-        rc=leafNode.GetKey(offset,testkey);
-        if(rc) { return rc; }
-        if(key<testkey) {
-          // Shift over all following keys by 1 space
-          for (unsigned int offset2=leafNode.info.numkeys-2; offset2>=offset; offset2--){
-              rc = leafNode.GetKey((SIZE_T)offset2, keyInsPos);
-              if (rc) { return rc; }
-              rc = leafNode.GetVal((SIZE_T)offset2, valueInsPos);
-              if (rc) { return rc; }
-              rc = leafNode.SetKey((SIZE_T)offset2+1, keyInsPos);
-              if (rc) { return rc; }
-              rc = leafNode.SetVal((SIZE_T)offset2+1, valueInsPos);
-              if (rc) { return rc; }
-          }
-
-          // Insert new key in spot found above
-          rc = leafNode.SetKey(offset,key);
-          if (rc) { return rc; }
-          rc = leafNode.SetVal(offset,value);
-          if (rc) { return rc; }
-          inserted = true;
-          rc = leafNode.SetKey(offset,key);
-          if (rc) { return rc; }
-          rc = leafNode.SetVal(offset, value);
-          if (rc) { return rc;}
-          break; // Remove?
-        }
-      }
-      if (!inserted) {
-        rc=leafNode.SetKey(leafNode.info.numkeys-1,key);
-        if (rc) { return rc; }
-        rc=leafNode.SetVal(leafNode.info.numkeys-1,value);
-        if (rc) { return rc; }
-      }
-    }
+//
+// A key's second value moves both to a posting block of their own,
+// later ones go into the list.  Only the slot's head or smallest
+// value changing needs the leaf (or a message) to be written.
+//
+ERROR_T BTreeIndex::PostingAdd(const KEY_T &key, const VALUE_T &value)
+{
+  ERROR_T rc;
+  SIZE_T head;
+  SIZE_T vs = PostingValueSize();
+  const char *first = scratchval.data+sizeof(SIZE_T);
+  int cmp = memcmp(value.data,first,vs);
 
-    leafNode.Serialize(buffercache, leafPtr); // Write back to disk
-    // Check if the node length is over 2/3, and call TreeBalance if necessary
-      if((int)leafNode.info.numkeys > (int)(2*maxNumKeys/3)) {
-          SIZE_T parentPtr = ptrTrail.back();
-          ptrTrail.pop_back();
-          rc = TreeBalance(parentPtr, ptrTrail);
-          if (rc) { return rc; }
-      }
+  if (cmp==0) {
+    return ERROR_CONFLICT;
+  }
+
+  memcpy(&head,scratchval.data,sizeof(SIZE_T));
+  if (head==0) {
+    rc=AllocateNode(head);
+    if (rc) { return rc; }
+    BTreeNode b(BTREE_POSTING_BLOCK,
+		superblock.info.keysize,
+		superblock.info.valuesize,
+		buffercache->GetBlockSize());
+    SetPostingNext(b,0);
+    SetPostingTail(b,head);
+    memcpy(PostingVal(b,vs,cmp<0 ? 1 : 0),first,vs);
+    memcpy(PostingVal(b,vs,cmp<0 ? 0 : 1),value.data,vs);
+    b.info.numkeys=2;
+    rc=WriteNode(head,b);
+    if (rc) { return rc; }
+  } else {
+    rc=PostingInsert(head,value);
+    if (rc) { return rc; }
+    if (cmp>0) {
+      return ERROR_NOERROR;
     }
+  }
 
-  return ERROR_NOERROR;
+  VALUE_T &slot = PostingSlot(head,cmp<0 ? value.data : first);
+  if (Buffered()) {
+    return PutMessage(MESSAGE_UPDATE,key,slot);
+  }
+  return LookupOrUpdateInternal(superblock.info.rootnode,BTREE_OP_UPDATE,key,slot);
 }
 
-// Return trail of pointers to the node we will inset into
-ERROR_T BTreeIndex::CreatePtrTrail(const SIZE_T &node, const KEY_T &key, std::vector<SIZE_T> &ptrTrail){
+
+//
+// Put value in its place in the list starting at head.  Values past
+// the head block are checked against the tail first, so appending to
+// a long list costs two reads instead of a walk of the chain.  A full
+// block is split in half, except at the end of the list, where a new
+// block is started so that ascending inserts leave full blocks behind.
+//
+ERROR_T BTreeIndex::PostingInsert(const SIZE_T head, const VALUE_T &value)
+{
   BTreeNode b;
+  BTreeNode t;
   ERROR_T rc;
-  SIZE_T offset;
-  KEY_T testkey;
-  SIZE_T ptr;
-
-  rc = b.Unserialize(buffercache, node);
+  SIZE_T vs = PostingValueSize();
+  SIZE_T cap = PostingBlockCapacity();
+  SIZE_T block = head;
+  SIZE_T tail;
+  SIZE_T next;
+  SIZE_T i;
+
+  rc=ReadNode(head,b);
+  if (rc) { return rc; }
+  if (b.info.nodetype!=BTREE_POSTING_BLOCK) {
+    return ERROR_INSANE;
+  }
+  tail=PostingTail(b);
 
-  if(rc!=ERROR_NOERROR){
-    return rc;
+  if (tail!=head
+      && memcmp(value.data,PostingVal(b,vs,b.info.numkeys-1),vs)>0) {
+    rc=ReadNode(tail,t);
+    if (rc) { return rc; }
+    if (t.info.nodetype!=BTREE_POSTING_BLOCK) {
+      return ERROR_INSANE;
+    }
+    if (memcmp(value.data,PostingVal(t,vs,0),vs)>=0) {
+      block=tail;
+      b=t;
+    }
   }
 
-  switch(b.info.nodetype){
-    case BTREE_ROOT_NODE:
-    case BTREE_INTERIOR_NODE:
-      // Loop through the node to find which pointer we want to move towards
-    for(offset=0;offset<b.info.numkeys; offset++){
-      rc=b.GetKey(offset,testkey);
-      if(rc) { return rc; }
-          //find the first key that is larger than the new key
-      if(key < testkey){
-          // Get pointer immediately to the left, which will point us towards the next node
-        rc=b.GetPtr(offset,ptr);
-        if (rc) { return rc; }
-            //if pointer exists and doesn't have an error, put it on stack and recurse with the updated ptrTrail
-        ptrTrail.push_back(ptr);
-        return CreatePtrTrail(ptr, key, ptrTrail);
-      }
+  // The first block whose last value is not below value, or the last one
+  while ((next=PostingNext(b))!=0
+	 && memcmp(value.data,PostingVal(b,vs,b.info.numkeys-1),vs)>0) {
+    block=next;
+    rc=ReadNode(block,b);
+    if (rc) { return rc; }
+    if (b.info.nodetype!=BTREE_POSTING_BLOCK) {
+      return ERROR_INSANE;
     }
+  }
 
-      //move to the next pointer, to continue the ptrTrail
-    if(b.info.numkeys>0){
-      rc=b.GetPtr(b.info.numkeys,ptr);
-      if (rc) { return rc; }
-        //if pointer does not generate an error, put it on stack and recurse with updated ptrTrail
-      ptrTrail.push_back(ptr);
-      return CreatePtrTrail(ptr, key, ptrTrail);
+  i=PostingLowerBound(b,vs,value.data);
+  if (i<b.info.numkeys && memcmp(PostingVal(b,vs,i),value.data,vs)==0) {
+    return ERROR_CONFLICT;
+  }
+
+  if (b.info.numkeys==cap) {
+    SIZE_T split = (next==0 && i==cap) ? cap : cap/2;
+    SIZE_T right;
+
+    rc=AllocateNode(right);
+    if (rc) { return rc; }
+    BTreeNode r(BTREE_POSTING_BLOCK,
+		superblock.info.keysize,
+		superblock.info.valuesize,
+		buffercache->GetBlockSize());
+    SetPostingNext(r,next);
+    SetPostingTail(r,0);
+    memcpy(PostingVal(r,vs,0),PostingVal(b,vs,split),(cap-split)*vs);
+    r.info.numkeys=cap-split;
+    b.info.numkeys=split;
+    SetPostingNext(b,right);
+    if (i>=split) {
+      memmove(PostingVal(r,vs,i-split+1),PostingVal(r,vs,i-split),(r.info.numkeys-(i-split))*vs);
+      memcpy(PostingVal(r,vs,i-split),value.data,vs);
+      r.info.numkeys++;
     } else {
-        // No keys in this node.  Throw error
-      return ERROR_NONEXISTENT;
+      memmove(PostingVal(b,vs,i+1),PostingVal(b,vs,i),(b.info.numkeys-i)*vs);
+      memcpy(PostingVal(b,vs,i),value.data,vs);
+      b.info.numkeys++;
     }
-    break;
-    case BTREE_LEAF_NODE:
-        //if at a leaf, put the node on the stack and return
-    ptrTrail.push_back(node);
-    return ERROR_NOERROR;
-    break;
-    default:
-        // if data object is not a rootnode, an internalnode, or a leaf, throw and error
-    return ERROR_INSANE;
-    break;
+    if (next==0) {
+      // r is the new tail
+      if (block==head) {
+	SetPostingTail(b,right);
+      } else {
+	rc=ReadNode(head,t);
+	if (rc) { return rc; }
+	SetPostingTail(t,right);
+	rc=WriteNode(head,t);
+	if (rc) { return rc; }
+      }
+    }
+    rc=WriteNode(right,r);
+    if (rc) { return rc; }
+    return WriteNode(block,b);
   }
 
-  return ERROR_INSANE;
+  memmove(PostingVal(b,vs,i+1),PostingVal(b,vs,i),(b.info.numkeys-i)*vs);
+  memcpy(PostingVal(b,vs,i),value.data,vs);
+  b.info.numkeys++;
+  return WriteNode(block,b);
+}
 
+
+BTreePostingIterator::BTreePostingIterator() :
+  index(0), next(0), pos(0), inlined(false)
+{
 }
 
 
-ERROR_T BTreeIndex::TreeBalance(const SIZE_T &node, std::vector<SIZE_T> ptrPath)
+ERROR_T BTreePostingIterator::Next(VALUE_T &value)
 {
-  BTreeNode b;
-  BTreeNode leftNode;
-  BTreeNode rightNode;
   ERROR_T rc;
-  SIZE_T offset;
+  SIZE_T vs;
 
-  int nodeType;
-  rc = b.Unserialize(buffercache, node);
-  if (rc) { return rc;}
+  if (!index) {
+    return ERROR_NONEXISTENT;
+  }
+  vs=index->PostingValueSize();
+  if (inlined) {
+    inlined=false;
+    value=single;
+    return ERROR_NOERROR;
+  }
+  while (pos>=block.info.numkeys) {
+    if (next==0) {
+      return ERROR_NONEXISTENT;
+    }
+    rc=index->ReadNode(next,block);
+    if (rc) { return rc; }
+    if (block.info.nodetype!=BTREE_POSTING_BLOCK) {
+      return ERROR_INSANE;
+    }
+    next=PostingNext(block);
+    pos=0;
+  }
+  if (value.length!=vs) {
+    value=VALUE_T(vs);
+  }
+  memcpy(value.data,PostingVal(block,vs,pos),vs);
+  pos++;
+  return ERROR_NOERROR;
+}
 
-  //Allocate left and right pointers
-  SIZE_T leftPtr;
-  SIZE_T rightPtr;
-  AllocateNode(leftPtr);
-  if(b.info.nodetype == BTREE_LEAF_NODE){
-    nodeType = BTREE_LEAF_NODE;
-  }else{
-    nodeType = BTREE_INTERIOR_NODE;
+
+bool BTreeIndex::FindMessage(const BTreeNode &b, const KEY_VIEW_T &key, const char *&value) const
+{
+  MessageBuffer messages(b,messageoffset,messagecapacity);
+  SIZE_T i = messages.Find(key);
+
+  if (i<messages.Count()) {
+    value=messages.Val(i);
+    return true;
   }
-  leftNode = BTreeNode(nodeType, superblock.info.keysize, superblock.info.valuesize, superblock.info.blocksize);
-  rc = leftNode.Serialize(buffercache, leftPtr);
-  AllocateNode(rightPtr);
-  rightNode = BTreeNode(nodeType, superblock.info.keysize, superblock.info.valuesize, superblock.info.blocksize);
-  rc = rightNode.Serialize(buffercache, rightPtr);
+  return false;
+}
 
-  rc = rightNode.Unserialize(buffercache, rightPtr);
-  if (rc) { return rc;}
-  rc = leftNode.Unserialize(buffercache, leftPtr);
-  if (rc) { return rc;}
 
-  //Tracker variables
-  KEY_T keyLoc;
-  KEY_T testKey;
-  VALUE_T valLoc;
-  SIZE_T ptrLoc;
+// Queue a message at the root, making room first if it is full
+ERROR_T BTreeIndex::PutMessage(const int op, const KEY_T &key, const VALUE_T &value)
+{
+  BTreeNode root;
+  ERROR_T rc;
 
-  int mid = (b.info.numkeys+0.5)/2;
-//Check if its a leafnode
-  if(b.info.nodetype==BTREE_LEAF_NODE){
-    for(offset = 0; (int)offset < mid; offset++){
-      leftNode.info.numkeys++;
+  // A message is copied in at the index's sizes, and nothing further
+  // down sees it before it is acknowledged
+  if (key.length!=superblock.info.keysize || value.length!=superblock.info.valuesize) {
+    return ERROR_SIZE;
+  }
 
-    //First get old values
-    //Then set the values in the new nodes
-      rc = b.GetKey(offset, keyLoc);
-      if (rc) { return rc;}
-      rc = b.GetVal(offset, valLoc);
-      if (rc) { return rc;}
-      rc = leftNode.SetKey(offset, keyLoc);
-      if (rc) { return rc;}
-      rc = leftNode.SetVal(offset, valLoc);
-      if (rc) { return rc;}
+  while (true) {
+    rc=ReadNode(superblock.info.rootnode,root);
+    if (rc) { return rc; }
+    if (root.info.numkeys==0) {
+      // nowhere to send messages until the first leaves exist
+      return InsertInternal(key,value);
     }
-    int place=0;
-    for(offset = mid; offset<b.info.numkeys; offset++){
-
-    //same process but now with right node
-      rightNode.info.numkeys++;
-      rc = b.GetKey(offset, keyLoc);
-      if (rc) { return rc;}
-      rc = b.GetVal(offset, valLoc);
-      if (rc) { return rc;}
-      rc = rightNode.SetKey(place, keyLoc);
-      if (rc) { return rc;}
-      rc = rightNode.SetVal(place, valLoc);
-      if (rc) { return rc;}
-      place++;
+    if (MessageBuffer(root,messageoffset,messagecapacity).Put(op,key.data,value.data)) {
+      return WriteNode(superblock.info.rootnode,root);
     }
-  } else {
-    //interior node
-  for(offset = 0; (int)offset < mid; offset++){
-    leftNode.info.numkeys++;
-    rc = b.GetKey(offset, keyLoc);
-    if (rc) { return rc;}
-    rc = b.GetPtr(offset, ptrLoc);
-    if (rc) { return rc;}
-    rc = leftNode.SetKey(offset, keyLoc);
-    if (rc) { return rc;}
-    rc = leftNode.SetPtr(offset, ptrLoc);
-  }
-    int place=0;
-    for(offset = mid; offset<b.info.numkeys; offset++){
-    rightNode.info.numkeys++;
-    rc = b.GetKey(offset, keyLoc);
-    if (rc) { return rc;}
-    rc = b.GetPtr(offset, ptrLoc);
-    if (rc) { return rc;}
-    rc = rightNode.SetKey(place, keyLoc);
-    if (rc) { return rc;}
-    rc = rightNode.SetPtr(place, ptrLoc);
-    if (rc) { return rc;}
-    place++;
+    rc=FlushBuffer(superblock.info.rootnode);
+    if (rc) { return rc; }
   }
-  rc = b.GetPtr(offset, ptrLoc);
-  if (rc) { return rc;}
-  rc = rightNode.SetPtr(place, ptrLoc);
-  if (rc) { return rc;}
 }
-  //Serialize the new nodes
-rc = leftNode.Serialize(buffercache, leftPtr);
-if (rc) { return rc;}
-rc = rightNode.Serialize(buffercache, rightPtr);
-if (rc) { return rc;}
-rc = b.Serialize(buffercache, node);
 
-KEY_T splitKey;
-rc = b.GetKey(mid-1, splitKey);
-if (rc) { return rc;}
 
-//check if root
-if (b.info.nodetype == BTREE_ROOT_NODE) {
-  SIZE_T newRootPtr;
-  BTreeNode newRootNode;
-  AllocateNode(newRootPtr);
-  newRootNode = BTreeNode(BTREE_ROOT_NODE, superblock.info.keysize, superblock.info.valuesize, superblock.info.blocksize);
-  superblock.info.rootnode = newRootPtr;
-    newRootNode.info.rootnode = newRootPtr;
-    newRootNode.info.numkeys = 1;
-    newRootNode.SetKey(0, splitKey);
-    newRootNode.SetPtr(0, leftPtr);
-    newRootNode.SetPtr(1, rightPtr);
-  rc = newRootNode.Serialize(buffercache, newRootPtr);
-  if(rc) {return rc;}
-}
-else{
-//get parent node
-  SIZE_T parentPtr = ptrPath.back();
-  ptrPath.pop_back();
-  BTreeNode parentNode;
-  rc = parentNode.Unserialize(buffercache, parentPtr);
-  if(rc) {return rc;}
+// Orders the messages of a batch by key
+class BatchKeyLess {
+ private:
+  const char *base;
+  SIZE_T      keysize;
+  SIZE_T      size;
+
+ public:
+  BatchKeyLess(const std::vector<char> &batch, const SIZE_T keysize, const SIZE_T size) :
+    base(&batch[0]), keysize(keysize), size(size) {}
+  bool operator()(const SIZE_T a, const SIZE_T b) const {
+    return CompareKeys(KEY_VIEW_T(base+a*size+1,keysize),
+		       KEY_VIEW_T(base+b*size+1,keysize))<0;
+  }
+};
+
+//
+// Move the messages bound for node's busiest child down into that
+// child.  If the child is a leaf they are applied to it, in key order;
+// if it is an interior node without room for them, the child's own
+// buffer is flushed instead, and the caller tries again.  Splits on
+// the way may replace node, so callers start over from the root.
+//
+ERROR_T BTreeIndex::FlushBuffer(const SIZE_T &node)
+{
+  BTreeNode b;
+  BTreeNode child;
+  ERROR_T rc;
+  SIZE_T i;
+  SIZE_T ptr;
+  SIZE_T slot;
+  SIZE_T busiest;
+  SIZE_T keysize = superblock.info.keysize;
+  SIZE_T valuesize = superblock.info.valuesize;
+
+  rc=ReadNode(node,b);
+  if (rc) { return rc; }
+
+  MessageBuffer messages(b,messageoffset,messagecapacity);
+  if (messages.Count()==0) {
+    return ERROR_NOERROR;
+  }
 
-    if (parentNode.info.nodetype == BTREE_SUPERBLOCK) {
-        AllocateNode(parentPtr);
+  // Route every message, and count them per child
+  std::vector<SIZE_T> slots(messages.Count());
+  std::vector<SIZE_T> counts(b.info.numkeys+1,0);
+  for (i=0;i<messages.Count();i++) {
+    rc=FindChildPtr(b,KEY_VIEW_T(messages.Key(i),keysize),ptr,slots[i],interpolate);
+    if (rc) { return rc; }
+    counts[slots[i]]++;
+  }
+  busiest=0;
+  for (slot=1;slot<counts.size();slot++) {
+    if (counts[slot]>counts[busiest]) {
+      busiest=slot;
+    }
+  }
+  rc=b.GetPtr(busiest,ptr);
+  if (rc) { return rc; }
+  rc=ReadNode(ptr,child);
+  if (rc) { return rc; }
 
+  if (child.info.nodetype==BTREE_INTERIOR_NODE) {
+    MessageBuffer below(child,messageoffset,messagecapacity);
+    if (below.Free()<counts[busiest]) {
+      return FlushBuffer(ptr);
     }
-    BTreeNode pNode = BTreeNode(parentNode.info.nodetype, superblock.info.keysize, superblock.info.valuesize, superblock.info.blocksize);
-    pNode.info.numkeys = parentNode.info.numkeys + 1;
-    pNode.info.freelist = parentNode.info.freelist;
+    // Newer than anything the child holds for the same keys
+    for (i=messages.Count();i-->0;) {
+      if (slots[i]==busiest) {
+	below.Put(messages.Op(i),messages.Key(i),messages.Val(i));
+      }
+    }
+    for (i=messages.Count();i-->0;) {
+      if (slots[i]==busiest) {
+	messages.Remove(i);
+      }
+    }
+    rc=WriteNode(ptr,child);
+    if (rc) { return rc; }
+    return WriteNode(node,b);
+  }
 
-    bool newKeyInserted = false;
-    for (offset = 0; offset < pNode.info.numkeys - 1; offset++) {
-        rc = parentNode.GetKey(offset, testKey);
-        if (newKeyInserted) {
-            rc = parentNode.GetKey(offset, keyLoc);
-            pNode.SetKey(offset + 1, keyLoc);
+  if (child.info.nodetype!=BTREE_LEAF_NODE) {
+    return ERROR_INSANE;
+  }
 
-            rc = parentNode.GetPtr(offset + 1, ptrLoc);
-            pNode.SetPtr(offset + 2, ptrLoc);
-        } else {
-            if (splitKey < testKey) {
-                newKeyInserted = true;
-                pNode.SetPtr(offset, leftPtr);
-                pNode.SetKey(offset, splitKey);
-                pNode.SetPtr(offset+1, rightPtr);
-                offset = offset - 1;
+  // A leaf: take the batch out of node first, since applying it may
+  // split node.  Whatever of it is not applied goes back.
+  std::vector<char> batch;
+  std::vector<SIZE_T> order;
+  SIZE_T size = 1+keysize+valuesize;
+  for (i=0;i<messages.Count();i++) {
+    if (slots[i]==busiest) {
+      batch.insert(batch.end(),messages.Message(i),messages.Message(i)+size);
+    }
+  }
+  for (i=messages.Count();i-->0;) {
+    if (slots[i]==busiest) {
+      messages.Remove(i);
+    }
+  }
 
-            } else {
-                rc = parentNode.GetKey(offset, keyLoc);
-                if (rc) {return rc;}
-                rc = pNode.SetKey(offset, keyLoc);
-                if (rc) {return rc;}
+  for (i=0;i<counts[busiest];i++) {
+    order.push_back(i);
+  }
+  // a buffer holds at most one message per key
+  std::sort(order.begin(),order.end(),BatchKeyLess(batch,keysize,size));
 
-                rc = parentNode.GetPtr(offset, ptrLoc);
-                if (rc) {return rc;}
-                rc = pNode.SetPtr(offset, ptrLoc);
-                if (rc) {return rc;}
-            }
-        }
+  // node goes out without the batch before the leaf has it, so a
+  // crash in between loses the batch.  Writing the leaf first would
+  // leave node's copy of the batch to be split along with node.
+  rc=WriteNode(node,b);
+  if (rc) { return rc; }
+  for (i=0;i<order.size();i++) {
+    const char *m = &batch[order[i]*size];
+    memcpy(scratchkey.data,m+1,keysize);
+    memcpy(scratchval.data,m+1+keysize,valuesize);
+    if (m[0]==MESSAGE_INSERT) {
+      rc=InsertInternal(scratchkey,scratchval);
+    } else {
+      rc=LookupOrUpdateInternal(superblock.info.rootnode,BTREE_OP_UPDATE,scratchkey,scratchval);
     }
-    if (newKeyInserted == false) {
-        newKeyInserted = true;
-        pNode.SetPtr(offset, leftPtr);
-        pNode.SetKey(offset, splitKey);
-        pNode.SetPtr(offset+1, rightPtr);
+    if (rc) {
+      ERROR_T prc = RequeueMessages(batch,order,i);
+      return prc ? prc : rc;
     }
+  }
+  return ERROR_NOERROR;
+}
 
-    pNode.Serialize(buffercache, parentPtr);
 
-  if((int)pNode.info.numkeys > (int)(2*maxNumKeys/3)){
-    rc = TreeBalance(parentPtr, ptrPath);
-    if(rc){ return rc;}
+//
+// Put the messages of a batch that FlushBuffer could not apply, from
+// order[first] on, back in the buffer of the node above their leaf.
+// That is where they came from, or one of its halves if it split
+// since, and it has room for them: nothing else was added to it.
+//
+ERROR_T BTreeIndex::RequeueMessages(const std::vector<char> &batch,
+				    const std::vector<SIZE_T> &order,
+				    const SIZE_T first)
+{
+  std::vector<SIZE_T> trail;
+  BTreeNode b;
+  ERROR_T rc;
+  SIZE_T i;
+  SIZE_T parent;
+  SIZE_T size = 1+superblock.info.keysize+superblock.info.valuesize;
+
+  for (i=first;i<order.size();i++) {
+    const char *m = &batch[order[i]*size];
+    memcpy(scratchkey.data,m+1,superblock.info.keysize);
+    trail.clear();
+    trail.push_back(superblock.info.rootnode);
+    rc=CreatePtrTrail(superblock.info.rootnode,scratchkey,trail);
+    if (rc) { return rc; }
+    // the trail ends with the leaf twice
+    parent=trail[trail.size()-3];
+    rc=ReadNode(parent,b);
+    if (rc) { return rc; }
+    if (!MessageBuffer(b,messageoffset,messagecapacity).Put(m[0],m+1,m+1+superblock.info.keysize)) {
+      return ERROR_INSANE;
+    }
+    rc=WriteNode(parent,b);
+    if (rc) { return rc; }
   }
+  return ERROR_NOERROR;
 }
-DeallocateNode(node);
-return ERROR_NOERROR;
+
+
+// Find an interior node under node that still holds messages
+ERROR_T BTreeIndex::FindBufferedNode(const SIZE_T &node, SIZE_T &found) const
+{
+  BTreeNode b;
+  ERROR_T rc;
+  SIZE_T offset;
+  SIZE_T ptr;
+
+  rc=ReadNode(node,b);
+  if (rc) { return rc; }
+  if (b.info.nodetype!=BTREE_ROOT_NODE && b.info.nodetype!=BTREE_INTERIOR_NODE) {
+    return ERROR_NONEXISTENT;
+  }
+  if (MessageBuffer(b,messageoffset,messagecapacity).Count()) {
+    found=node;
+    return ERROR_NOERROR;
+  }
+  for (offset=0;b.info.numkeys>0 && offset<=b.info.numkeys;offset++) {
+    rc=b.GetPtr(offset,ptr);
+    if (rc) { return rc; }
+    rc=FindBufferedNode(ptr,found);
+    if (rc!=ERROR_NONEXISTENT) {
+      return rc;
+    }
+  }
+  return ERROR_NONEXISTENT;
 }
 
-ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
+
+ERROR_T BTreeIndex::FlushMessageBuffers()
 {
-  VALUE_T val = value;
-  return LookupOrUpdateInternal(superblock.info.rootnode,BTREE_OP_UPDATE,key,val);
+  ERROR_T rc;
+  SIZE_T node;
+
+  if (!Buffered()) {
+    return ERROR_NOERROR;
+  }
+  // Flushing can split the nodes above, so look again each time
+  while ((rc=FindBufferedNode(superblock.info.rootnode,node))==ERROR_NOERROR) {
+    rc=FlushBuffer(node);
+    if (rc) { return rc; }
+  }
+  return rc==ERROR_NONEXISTENT ? ERROR_NOERROR : rc;
 }
 
 
@@ -773,23 +3886,69 @@ ERROR_T BTreeIndex::Delete(const KEY_T &key)
 // DOT is Depth + DOT format
 //
 
+//
+// With message buffers, pending maps each key under node that has a
+// message queued above it to the newest such value.  The sorted
+// listing shows each leaf with them applied, which is what lookups
+// see; the other two print each interior node's own messages.
+//
 ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
 				    ostream &o,
-				    BTreeDisplayType display_type) const
+				    BTreeDisplayType display_type,
+				    const std::map<std::string, std::string> &pending) const
 {
   KEY_T testkey;
   SIZE_T ptr;
   BTreeNode b;
   ERROR_T rc;
   SIZE_T offset;
+  SIZE_T keysize = superblock.info.keysize;
+  std::vector<std::map<std::string, std::string> > below;
 
-  rc= b.Unserialize(buffercache,node);
+  rc= ReadNode(node,b);
 
   if (rc!=ERROR_NOERROR) {
     return rc;
   }
 
-  rc = PrintNode(o,node,b,display_type);
+  if (b.info.nodetype==BTREE_LEAF_NODE && !pending.empty()) {
+    // Leaf entries and the messages for them, merged in key order
+    std::map<std::string, std::string> merged(pending);
+    for (offset=0;offset<b.info.numkeys;offset++) {
+      merged.insert(std::make_pair(std::string(b.ResolveKey(offset),keysize),
+				   std::string(b.ResolveVal(offset),b.info.valuesize)));
+    }
+    std::map<std::string, std::string>::const_iterator it;
+    for (it=merged.begin(); it!=merged.end(); ++it) {
+      PrintKeyVal(o,it->first.data(),keysize,it->second.data(),b.info.valuesize);
+    }
+    return ERROR_NOERROR;
+  }
+
+  if (Buffered() && (b.info.nodetype==BTREE_ROOT_NODE || b.info.nodetype==BTREE_INTERIOR_NODE)) {
+    MessageBuffer messages(b,messageoffset,messagecapacity);
+    rc = PrintNode(o,node,b,display_type,&messages);
+    if (rc) { return rc; }
+    if (display_type==BTREE_SORTED_KEYVAL && b.info.numkeys>0) {
+      // Hand each child what is pending for it; the messages from
+      // above are newer than this node's own
+      std::map<std::string, std::string>::const_iterator it;
+      below.resize(b.info.numkeys+1);
+      for (it=pending.begin(); it!=pending.end(); ++it) {
+	rc=FindChildPtr(b,KEY_VIEW_T(it->first.data(),keysize),ptr,offset);
+	if (rc) { return rc; }
+	below[offset].insert(*it);
+      }
+      for (SIZE_T m=0;m<messages.Count();m++) {
+	rc=FindChildPtr(b,KEY_VIEW_T(messages.Key(m),keysize),ptr,offset);
+	if (rc) { return rc; }
+	below[offset].insert(std::make_pair(std::string(messages.Key(m),keysize),
+					    std::string(messages.Val(m),b.info.valuesize)));
+      }
+    }
+  } else {
+    rc = PrintNode(o,node,b,display_type);
+  }
 
   if (rc) { return rc; }
 
@@ -811,7 +3970,8 @@ ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
 	if (display_type==BTREE_DEPTH_DOT) {
 	  o << node << " -> "<<ptr<<";\n";
 	}
-	rc=DisplayInternal(ptr,o,display_type);
+	rc=DisplayInternal(ptr,o,display_type,
+			   below.empty() ? std::map<std::string, std::string>() : below[offset]);
 	if (rc) { return rc; }
       }
     }
@@ -838,7 +3998,7 @@ ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
   if (display_type==BTREE_DEPTH_DOT) {
     o << "digraph tree { \n";
   }
-  rc=DisplayInternal(superblock.info.rootnode,o,display_type);
+  rc=DisplayInternal(superblock.info.rootnode,o,display_type,std::map<std::string, std::string>());
   if (display_type==BTREE_DEPTH_DOT) {
     o << "}\n";
   }
@@ -857,3 +4017,329 @@ ostream & BTreeIndex::Print(ostream &os) const
   Display(os, BTREE_DEPTH_DOT);
   return os;
 }
+
+
+BTreePartitionedIndex::BTreePartitionedIndex(SIZE_T keysize,
+					     SIZE_T valuesize,
+					     const std::vector<BufferCache *> &caches,
+					     const BTreePartitioning s) :
+  scheme(s), threads(caches.size())
+{
+  for (SIZE_T i=0;i<caches.size();i++) {
+    parts.push_back(new BTreeIndex(keysize,valuesize,caches[i]));
+  }
+}
+
+
+BTreePartitionedIndex::~BTreePartitionedIndex()
+{
+  for (SIZE_T i=0;i<parts.size();i++) {
+    delete parts[i];
+  }
+}
+
+
+ERROR_T BTreePartitionedIndex::SetRangeBounds(const std::vector<KEY_T> &b)
+{
+  if (b.size()+1!=parts.size()) {
+    return ERROR_SIZE;
+  }
+  for (SIZE_T i=1;i<b.size();i++) {
+    if (!(b[i-1]<b[i])) {
+      return ERROR_INSANE;
+    }
+  }
+  bounds=b;
+  return ERROR_NOERROR;
+}
+
+
+void BTreePartitionedIndex::SetThreads(const unsigned int n)
+{
+  threads = n ? n : 1;
+}
+
+
+SIZE_T BTreePartitionedIndex::NumPartitions() const
+{
+  return parts.size();
+}
+
+
+//
+// The hash is the key's CRC32C put through a finalizer.  The key
+// filter uses the raw CRC32C, and without the mixing every key in a
+// partition would share its low bits.
+//
+SIZE_T BTreePartitionedIndex::PartitionOf(const KEY_T &key) const
+{
+  if (scheme==BTREE_PARTITION_RANGE) {
+    // first partition whose bound is >= key
+    return std::lower_bound(bounds.begin(),bounds.end(),key)-bounds.begin();
+  }
+  uint32_t h = Crc32c(0,key.data,key.length);
+  h^=h>>16;
+  h*=0x85ebca6b;
+  h^=h>>13;
+  h*=0xc2b2ae35;
+  h^=h>>16;
+  return h%parts.size();
+}
+
+
+BTreeIndex & BTreePartitionedIndex::Partition(const SIZE_T i)
+{
+  return *parts[i];
+}
+
+
+ERROR_T BTreePartitionedIndex::Attach(const bool create)
+{
+  ERROR_T rc;
+
+  if (parts.empty()) {
+    return ERROR_SIZE;
+  }
+  if (scheme==BTREE_PARTITION_RANGE && bounds.size()+1!=parts.size()) {
+    return ERROR_SIZE;
+  }
+  for (SIZE_T i=0;i<parts.size();i++) {
+    rc=parts[i]->Attach(0,create);
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreePartitionedIndex::Detach()
+{
+  ERROR_T rc;
+  ERROR_T first = ERROR_NOERROR;
+  SIZE_T initblock;
+
+  // Detach all of them even if one fails
+  for (SIZE_T i=0;i<parts.size();i++) {
+    rc=parts[i]->Detach(initblock);
+    if (rc && !first) {
+      first=rc;
+    }
+  }
+  return first;
+}
+
+
+ERROR_T BTreePartitionedIndex::Checkpoint()
+{
+  ERROR_T rc;
+
+  for (SIZE_T i=0;i<parts.size();i++) {
+    rc=parts[i]->Checkpoint();
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreePartitionedIndex::Insert(const KEY_T &key, const VALUE_T &value)
+{
+  return parts[PartitionOf(key)]->Insert(key,value);
+}
+
+
+ERROR_T BTreePartitionedIndex::Update(const KEY_T &key, const VALUE_T &value)
+{
+  return parts[PartitionOf(key)]->Update(key,value);
+}
+
+
+ERROR_T BTreePartitionedIndex::Delete(const KEY_T &key)
+{
+  return parts[PartitionOf(key)]->Delete(key);
+}
+
+
+ERROR_T BTreePartitionedIndex::Lookup(const KEY_T &key, VALUE_T &value)
+{
+  return parts[PartitionOf(key)]->Lookup(key,value);
+}
+
+
+//
+// A batch split by partition.  Each thread takes whole partitions,
+// so no partition is touched by two threads, and each writes only
+// the rcs and values slots of its own keys.
+//
+struct BTreePartitionedIndex::Batch {
+  enum Op {INSERT, UPDATE, LOOKUP};
+
+  BTreePartitionedIndex *index;
+  Op op;
+  const std::vector<KEY_T> *keys;
+  const std::vector<VALUE_T> *in;
+  std::vector<VALUE_T> *out;
+  std::vector<ERROR_T> *rcs;
+  std::vector<std::vector<SIZE_T> > which; // key indexes, per partition
+
+  // What one thread does: partitions first, first+stride, ...
+  struct Share {
+    Batch *batch;
+    SIZE_T first;
+    SIZE_T stride;
+  };
+};
+
+
+void *BTreePartitionedIndex::RunBatch(void *arg)
+{
+  const Batch::Share &share = *(const Batch::Share *)arg;
+  const Batch &batch = *share.batch;
+  const std::vector<KEY_T> &keys = *batch.keys;
+  std::vector<ERROR_T> &rcs = *batch.rcs;
+  std::vector<KEY_T> partkeys;
+  std::vector<VALUE_T> partvalues;
+  std::vector<ERROR_T> partrcs;
+  SIZE_T p;
+  SIZE_T i;
+  ERROR_T rc;
+
+  for (p=share.first; p<batch.which.size(); p+=share.stride) {
+    const std::vector<SIZE_T> &which = batch.which[p];
+    BTreeIndex &part = *batch.index->parts[p];
+
+    switch (batch.op) {
+    case Batch::INSERT:
+      for (i=0;i<which.size();i++) {
+	rcs[which[i]]=part.Insert(keys[which[i]],(*batch.in)[which[i]]);
+      }
+      break;
+    case Batch::UPDATE:
+      for (i=0;i<which.size();i++) {
+	rcs[which[i]]=part.Update(keys[which[i]],(*batch.in)[which[i]]);
+      }
+      break;
+    case Batch::LOOKUP:
+      partkeys.clear();
+      for (i=0;i<which.size();i++) {
+	partkeys.push_back(keys[which[i]]);
+      }
+      // a failed descent fails every key of the partition with it
+      rc=part.LookupBatch(partkeys,partvalues,partrcs);
+      if (rc) {
+	partrcs.assign(which.size(),rc);
+      }
+      for (i=0;i<which.size();i++) {
+	rcs[which[i]]=partrcs[i];
+	if (partrcs[i]==ERROR_NOERROR) {
+	  (*batch.out)[which[i]]=partvalues[i];
+	}
+      }
+      break;
+    }
+  }
+  return 0;
+}
+
+
+ERROR_T BTreePartitionedIndex::RunParallel(Batch &batch)
+{
+  const std::vector<KEY_T> &keys = *batch.keys;
+  std::vector<pthread_t> workers;
+  std::vector<Batch::Share> shares;
+  std::vector<bool> started;
+  SIZE_T busy = 0;
+  SIZE_T n;
+  SIZE_T i;
+
+  batch.index=this;
+  batch.rcs->assign(keys.size(),ERROR_NONEXISTENT);
+  batch.which.assign(parts.size(),std::vector<SIZE_T>());
+  for (i=0;i<keys.size();i++) {
+    batch.which[PartitionOf(keys[i])].push_back(i);
+  }
+  for (i=0;i<parts.size();i++) {
+    if (!batch.which[i].empty()) {
+      busy++;
+    }
+  }
+
+  // Threads beyond the partitions that have work would sit idle
+  n = threads<busy ? threads : busy;
+  if (n<1) {
+    n=1;
+  }
+
+  shares.resize(n);
+  workers.resize(n);
+  started.assign(n,false);
+  for (i=0;i<n;i++) {
+    shares[i].batch=&batch;
+    shares[i].first=i;
+    shares[i].stride=n;
+  }
+  // This thread runs the first share, and any share that did not
+  // get a thread of its own
+  for (i=1;i<n;i++) {
+    started[i] = pthread_create(&workers[i],0,RunBatch,&shares[i])==0;
+  }
+  RunBatch(&shares[0]);
+  for (i=1;i<n;i++) {
+    if (started[i]) {
+      pthread_join(workers[i],0);
+    } else {
+      RunBatch(&shares[i]);
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreePartitionedIndex::InsertBatch(const std::vector<KEY_T> &keys,
+					   const std::vector<VALUE_T> &values,
+					   std::vector<ERROR_T> &rcs)
+{
+  Batch batch;
+
+  if (keys.size()!=values.size()) {
+    return ERROR_SIZE;
+  }
+  batch.op=Batch::INSERT;
+  batch.keys=&keys;
+  batch.in=&values;
+  batch.out=0;
+  batch.rcs=&rcs;
+  return RunParallel(batch);
+}
+
+
+ERROR_T BTreePartitionedIndex::UpdateBatch(const std::vector<KEY_T> &keys,
+					   const std::vector<VALUE_T> &values,
+					   std::vector<ERROR_T> &rcs)
+{
+  Batch batch;
+
+  if (keys.size()!=values.size()) {
+    return ERROR_SIZE;
+  }
+  batch.op=Batch::UPDATE;
+  batch.keys=&keys;
+  batch.in=&values;
+  batch.out=0;
+  batch.rcs=&rcs;
+  return RunParallel(batch);
+}
+
+
+ERROR_T BTreePartitionedIndex::LookupBatch(const std::vector<KEY_T> &keys,
+					   std::vector<VALUE_T> &values,
+					   std::vector<ERROR_T> &rcs)
+{
+  Batch batch;
+
+  values.resize(keys.size());
+  batch.op=Batch::LOOKUP;
+  batch.keys=&keys;
+  batch.in=0;
+  batch.out=&values;
+  batch.rcs=&rcs;
+  return RunParallel(batch);
+}
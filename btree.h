@@ -5,6 +5,14 @@
 #include <string>
 #include <vector> //added
 #include <set> //added
+#include <map>
+#include <list>
+#include <deque>
+#include <stdint.h>
+#include <string.h>
+#if __cplusplus >= 201103L
+#include <utility>
+#endif
 
 #include "global.h"
 #include "block.h"
@@ -15,6 +23,40 @@
 
 using namespace std;
 
+// Returned when a block read back does not match its checksum
+#ifndef ERROR_CHECKSUM
+#define ERROR_CHECKSUM -20
+#endif
+
+// Every allocated block ends with a CRC32C of its header and data
+#define BTREE_CHECKSUM_BYTES sizeof(uint32_t)
+
+// On-disk type of a delta-encoded leaf.  It is decoded into a
+// regular BTREE_LEAF_NODE on read, so only ReadNode/WriteBack see it.
+#define BTREE_COMPRESSED_LEAF_NODE 16
+
+// In memory a compressed leaf has this many blocks' worth of slots
+#define BTREE_COMPRESSED_LEAF_FACTOR 4
+
+// Options recorded in the superblock when the index is created
+#define BTREE_FLAG_COMPRESSED_LEAVES 0x1
+#define BTREE_FLAG_MESSAGE_BUFFERS   0x2
+#define BTREE_FLAG_NONUNIQUE         0x4
+// Blocks carry a checksum trailer.  Indexes created before there
+// were checksums lack it, and are not verified.
+#define BTREE_FLAG_CHECKSUMS         0x8
+
+// On-disk type of the blocks holding a key filter's bits
+#define BTREE_FILTER_BLOCK 17
+
+// On-disk type of the blocks holding the posting list of a key with
+// more than one value in a non-unique index
+#define BTREE_POSTING_BLOCK 18
+
+// On-disk type of the blocks listing the node cache's contents at
+// the last Detach, for the next Attach to read back
+#define BTREE_HOTSET_BLOCK 19
+
 // To simplify our lives, we will just treat a Key or Value as being
 // identical to a block
 
@@ -27,6 +69,27 @@ typedef Buffer KeyOrValue;
 typedef KeyOrValue KEY_T;
 typedef KeyOrValue VALUE_T;
 
+// A key or value borrowed from a node or from a caller's Block.
+// It never owns or copies the bytes, so making one costs nothing.
+struct KeyOrValueView {
+  const char *data;
+  SIZE_T      length;
+
+  KeyOrValueView(const char *d, const SIZE_T l) : data(d), length(l) {}
+  KeyOrValueView(const KeyOrValue &kv) : data(kv.data), length(kv.length) {}
+};
+
+typedef KeyOrValueView KEY_VIEW_T;
+typedef KeyOrValueView VALUE_VIEW_T;
+
+// Keys order as unsigned byte strings, as Blocks compare
+inline int CompareKeys(const KEY_VIEW_T &a, const KEY_VIEW_T &b)
+{
+  int c = memcmp(a.data,b.data,a.length<b.length ? a.length : b.length);
+  if (c) { return c; }
+  return a.length<b.length ? -1 : (a.length>b.length ? 1 : 0);
+}
+
 struct KeyValuePair {
   KEY_T key;
   VALUE_T value;
@@ -36,6 +99,10 @@ struct KeyValuePair {
   KeyValuePair(const KeyValuePair &rhs);
   virtual ~KeyValuePair();
   KeyValuePair & operator=(const KeyValuePair &rhs);
+#if __cplusplus >= 201103L
+  KeyValuePair(KeyValuePair &&rhs);
+  KeyValuePair & operator=(KeyValuePair &&rhs);
+#endif
 
 };
 
@@ -43,29 +110,366 @@ enum BTreeOp {BTREE_OP_INSERT, BTREE_OP_DELETE, BTREE_OP_UPDATE,BTREE_OP_LOOKUP}
 
 enum BTreeDisplayType {BTREE_DEPTH, BTREE_DEPTH_DOT, BTREE_SORTED_KEYVAL};
 
-class BTreeIndex {
+// Replacement policy for the index's in-memory node cache.
+// BTREE_CACHE_OFF sends every node read to the buffer cache.
+// BTREE_CACHE_LRU keeps the most recently used leaves.
+// BTREE_CACHE_2Q admits leaves to a small FIFO first and only
+// promotes them to the main LRU queue when they are referenced again
+// after falling out of it, so a one-pass scan (Display, a full
+// traversal) cannot push the hot leaves out.
+enum BTreeCachePolicy {BTREE_CACHE_OFF, BTREE_CACHE_LRU, BTREE_CACHE_2Q};
+
+// Default number of root and interior nodes the node cache pins
+#define BTREE_CACHE_PINNED_NODES 256
+
+struct BTreeCacheStats {
+  SIZE_T hits;
+  SIZE_T misses;
+  SIZE_T evictions;
+  SIZE_T pinned;     // nodes currently held regardless of capacity
+  SIZE_T resident;   // unpinned nodes currently held
+  SIZE_T dirty;      // nodes modified since they were last written
+  SIZE_T writebacks; // dirty nodes written by eviction or Flush
+  SIZE_T swizzled;   // hits reached through a parent's pointer
+};
+
+// Where the node cache sends the dirty nodes it writes back
+class BTreeNodeWriter {
+ public:
+  virtual ~BTreeNodeWriter() {}
+  virtual ERROR_T WriteBack(const SIZE_T block, const BTreeNode &node) = 0;
+};
+
+// Read-modify-write step for BTreeIndex::Modify
+class BTreeValueModifier {
+ public:
+  virtual ~BTreeValueModifier() {}
+  // value holds key's current value if exists, zeros if not.  Change
+  // it in place and return true to store it (inserting the key if it
+  // was absent), or return false to leave the index as it is.  Must
+  // not use the index.
+  virtual bool Modify(const KEY_T &key, VALUE_T &value, const bool exists) = 0;
+};
+
+struct BTreeFilterStats {
+  SIZE_T bits;           // 0 if there is no filter
+  SIZE_T hashes;
+  SIZE_T keys;           // keys added since it was last built
+  SIZE_T blocks;         // blocks it is stored in
+  SIZE_T probes;         // keys checked against it
+  SIZE_T negatives;      // probes it answered without a descent
+  SIZE_T falsepositives; // probes it let through for absent keys
+  double estimatedrate;  // false positive rate implied by its fill
+  double observedrate;   // falsepositives over all absent-key probes
+};
+
+//
+// Bloom filter over the keys of an index.  A key it has never seen
+// is usually reported absent; a key it has seen is always reported
+// present.  Bits are never cleared, so after deletes it only gets
+// less selective until it is rebuilt.
+//
+class BTreeKeyFilter {
+ private:
+  std::vector<unsigned char> bits;
+  SIZE_T numbits;
+  SIZE_T hashes;
+  SIZE_T keys;
+  mutable SIZE_T probes;
+  mutable SIZE_T negatives;
+  mutable SIZE_T falsepositives;
+
+ public:
+  BTreeKeyFilter();
+
+  // Size it for expectedkeys at bitsperkey bits each, and empty it
+  void Configure(const SIZE_T expectedkeys, const SIZE_T bitsperkey);
+  // Size it exactly, as read back from the superblock
+  void Configure(const SIZE_T numbits, const SIZE_T hashes, const SIZE_T keys);
+  void Clear();
+  void Disable();
+  bool Enabled() const { return numbits!=0; }
+
+  void Add(const KEY_VIEW_T &key);
+  bool MayContain(const KEY_VIEW_T &key) const;
+  // A key MayContain let through was not in the index after all
+  void NoteFalsePositive() const { falsepositives++; }
+
+  SIZE_T NumBits() const { return numbits; }
+  SIZE_T NumHashes() const { return hashes; }
+  SIZE_T NumKeys() const { return keys; }
+  unsigned char *Bits() { return bits.empty() ? 0 : &bits[0]; }
+  SIZE_T NumBytes() const { return bits.size(); }
+
+  void GetStats(BTreeFilterStats &s) const;
+  void ResetStats();
+};
+
+
+//
+// Cache of unserialized nodes kept in front of the BufferCache.
+// The node type stored in each node is the hint for placement:
+// root and interior nodes are pinned and never evicted, since every
+// descent goes through them, while leaves compete for capacity slots
+// under the selected policy.  Pinning is budgeted: once pinlimit
+// nodes are pinned, further interior nodes compete for capacity
+// slots as leaves do.  Descents fill the budget from the root down.
+// The superblock is never stored here, BTreeIndex keeps it in memory
+// on its own.
+//
+// In write-back mode a node can be stored dirty: it is then only
+// written to the buffer cache when it is evicted or on Flush, so
+// repeated changes to a hot node cost one physical write.
+//
+class BTreeNodeCache {
+ private:
+  enum Queue {QUEUE_PINNED, QUEUE_A1IN, QUEUE_AM};
+
+ public:
+  // Callers only hold pointers to these, as descent hints
+  struct Entry {
+    BTreeNode node;
+    Queue     queue;
+    bool      dirty;
+    std::list<SIZE_T>::iterator pos;
+    SIZE_T    block;
+    // Swizzled child pointers of a pinned node, by pointer slot.
+    // Stale once epoch moves on.
+    std::vector<Entry *> children;
+    unsigned long        childepoch;
+  };
+
+ private:
+  BTreeNodeWriter *backing;   // where dirty nodes are written
+  ERROR_T          writeerror; // first failed eviction write
+
+  BTreeCachePolicy policy;
+  SIZE_T           capacity;   // max number of unpinned nodes
+  SIZE_T           pinlimit;   // max number of pinned nodes
+
+  std::map<SIZE_T, Entry> entries;
+  std::list<SIZE_T> pinned;    // no order, just membership
+  std::list<SIZE_T> a1in;      // FIFO, newest at front
+  std::list<SIZE_T> am;        // LRU, most recent at front
+  std::list<SIZE_T> a1out;     // ghosts of blocks that left a1in
+  std::map<SIZE_T, std::list<SIZE_T>::iterator> ghosts;
+
+  BTreeCacheStats stats;
+
+  // Bumped whenever a pinned node leaves the cache, which
+  // unswizzles every pointer to it at once
+  unsigned long epoch;
+  Entry        *top;        // the last root found, swizzled
+
+  std::list<SIZE_T> &QueueList(const Queue q);
+  bool Pinnable(const BTreeNode &node, const bool waspinned) const;
+  bool Admit(const SIZE_T block, const BTreeNode &node, const bool dirty);
+  void Remove(const SIZE_T block);
+  void EvictOne();
+
+ public:
+  BTreeNodeCache(BTreeNodeWriter *backing=0,
+		 const BTreeCachePolicy policy=BTREE_CACHE_2Q,
+		 const SIZE_T capacity=0,
+		 const SIZE_T pinlimit=BTREE_CACHE_PINNED_NODES);
+  BTreeNodeCache(const BTreeNodeCache &rhs);
+  BTreeNodeCache & operator=(const BTreeNodeCache &rhs);
+
+  // Changing the policy or capacity empties the cache,
+  // Flush first if it may hold dirty nodes
+  void Configure(const BTreeCachePolicy policy, const SIZE_T capacity,
+		 const SIZE_T pinlimit=BTREE_CACHE_PINNED_NODES);
+
+  // return the cached node, or 0 on a miss.  Changes made through
+  // the pointer must be followed by a Store of the same node.
+  BTreeNode *Find(const SIZE_T block);
+
+  // Find for a descent.  parent is the hint left by the previous
+  // level (0 at the root) and slot the pointer followed out of it.
+  // Pinned nodes are reached through swizzled pointers instead of
+  // the block map; parent is left at the node found when it is
+  // pinned, or 0 otherwise.
+  BTreeNode *Find(const SIZE_T block, Entry *&parent, const SIZE_T slot);
+
+  // Called with a node that was just read or written.
+  // Replaces any cached copy, and drops it if the block is no
+  // longer a tree node.  Returns true if the node is now cached;
+  // a dirty node that was not cached still has to be written.
+  bool Store(const SIZE_T block, const BTreeNode &node, const bool dirty=false);
+
+  // Drop a block, discarding it even if dirty
+  void Invalidate(const SIZE_T block);
+  void Clear();
+
+  // Write all dirty nodes in block order
+  ERROR_T Flush();
+
+  const BTreeCacheStats & GetStats() const;
+  void ResetStats();
+
+  BTreeCachePolicy GetPolicy() const;
+
+  // The blocks of all cached nodes, in ascending order
+  void GetBlocks(std::vector<SIZE_T> &blocks) const;
+};
+
+
+class BTreePostingIterator;
+
+class BTreeIndex : public BTreeNodeWriter {
  private:
   BufferCache *buffercache;
   SIZE_T       superblock_index;
   BTreeNode    superblock;
   unsigned int maxNumKeys;
+  unsigned int maxLeafKeys; // larger when leaves are compressed
+  unsigned int maxInteriorKeys; // smaller when interiors hold messages
+  SIZE_T messageoffset;     // where an interior node's messages start
+  SIZE_T messagecapacity;   // how many it holds
   bool initBlock; // remove?
+  mutable BTreeNodeCache nodecache;
+  bool writeback;        // defer node writes to the node cache
+  bool superblockdirty;  // superblock changed since last written
+  bool verifychecksums;  // check block checksums on read
+  bool interpolate;      // interpolation search in interior nodes
+  mutable SIZE_T checksumfailures;
+  mutable SIZE_T nodereads;      // nodes read from the buffer cache
+  uint32_t createflags;  // options for the next Attach(create=true)
+  uint32_t indexflags;   // options of the attached index
+  uint64_t compressedrawbytes;
+  uint64_t compressedbytes;
+  VALUE_T  scratchval;           // per-operation scratch
+  VALUE_T  scratchslot;          // a non-unique leaf slot being built
+  VALUE_T  scratchmod;           // the value Modify hands out
+  KEY_T    scratchkey;           // a key copied out of a message
+  std::vector<SIZE_T> scratchtrail;
+  BTreeKeyFilter keyfilter;
+  std::vector<SIZE_T> filterblocks; // where keyfilter is stored, in order
+  bool filterdirty;      // keyfilter changed since it was stored
+  bool warmrestart;      // record the cached blocks at Detach
+  std::vector<SIZE_T> hotsetblocks; // where they are recorded, in order
+  std::deque<SIZE_T> freeahead;  // the free list's first blocks, as
+  SIZE_T freeafter;              // ReserveNodes found them, and the rest
+
+  friend class BTreePostingIterator;
 
  protected:
 
+  // All tree node reads and writes go through these so that the
+  // node cache stays coherent with the buffer cache.
+  // WriteNode stamps b's checksum before storing it.
+  ERROR_T      ReadNode(const SIZE_T &node, BTreeNode &b) const;
+
+  // Like ReadNode, but b points at the cached node itself instead of
+  // a copy, or at scratch on a miss.  b is only good until the next
+  // node read or write; if it is changed, WriteNode(node,*b) it.
+  ERROR_T      BorrowNode(const SIZE_T &node, BTreeNode &scratch, BTreeNode *&b) const;
+
+  // BorrowNode for one level of a descent, see BTreeNodeCache::Find
+  ERROR_T      BorrowNode(const SIZE_T &node, BTreeNode &scratch, BTreeNode *&b,
+			  BTreeNodeCache::Entry *&hint, const SIZE_T slot) const;
+
+  // Read, verify and decode a node from the buffer cache
+  ERROR_T      LoadNode(const SIZE_T &node, BTreeNode &b) const;
+
+  ERROR_T      WriteNode(const SIZE_T &node, BTreeNode &b);
+
+  ERROR_T      WriteSuperblock();
+
+  ERROR_T      SerializeSuperblock();
+
+  // For front ends (BTreeIndexT) that walk the tree themselves
+  const BTreeNode & GetSuperblock() const;
+  // The key size and caller-visible value size of the index whose
+  // superblock is stored at initblock, without attaching to it
+  ERROR_T      ReadIndexSizes(const SIZE_T initblock, SIZE_T &keysize, SIZE_T &valuesize) const;
+
+  // Blocksize of a leaf in memory
+  SIZE_T       LeafBlockSize() const;
+
+  bool         LeafNeedsSplit(const BTreeNode &leaf) const;
+
+  // Message buffers (BTREE_FLAG_MESSAGE_BUFFERS).  Inserts and
+  // updates are queued in the root's buffer, and a full buffer
+  // moves the messages for its busiest child down a level at once,
+  // so leaves are written in batches.  A message in a node is newer
+  // than anything below it for the same key.
+  bool         Buffered() const;
+  // True if b holds a message for key; value is left pointing at it
+  bool         FindMessage(const BTreeNode &b, const KEY_VIEW_T &key, const char *&value) const;
+  ERROR_T      PutMessage(const int op, const KEY_T &key, const VALUE_T &value);
+  ERROR_T      FlushBuffer(const SIZE_T &node);
+  ERROR_T      RequeueMessages(const std::vector<char> &batch,
+			       const std::vector<SIZE_T> &order,
+			       const SIZE_T first);
+  ERROR_T      FindBufferedNode(const SIZE_T &node, SIZE_T &found) const;
+
+  // Non-unique indexes (BTREE_FLAG_NONUNIQUE).  A key's leaf slot
+  // holds [posting list head][smallest value].  The head is 0 while
+  // the key has a single value; after that the list of all its
+  // values, sorted by their bytes, lives in a chain of posting blocks.
+  bool         Unique() const;
+  // Size of the values callers see, without the posting list head
+  SIZE_T       PostingValueSize() const;
+  SIZE_T       PostingBlockCapacity() const;
+  // Fill scratchslot with a slot for head and value
+  VALUE_T &    PostingSlot(const SIZE_T head, const char *value);
+  // Add value to a key whose current slot is in scratchval
+  ERROR_T      PostingAdd(const KEY_T &key, const VALUE_T &value);
+  ERROR_T      PostingInsert(const SIZE_T head, const VALUE_T &value);
+
+  // Insert a key known not to be in the index straight into its leaf
+  ERROR_T      InsertInternal(const KEY_T &key, const VALUE_T &value);
+  // The same, given the trail down to its leaf, which ends with the
+  // leaf, and the leaf as DescendToLeaf borrowed it
+  ERROR_T      InsertIntoLeaf(const std::vector<SIZE_T> &ptrTrail,
+			      BTreeNode &leafNode,
+			      BTreeNode *leaf,
+			      const KEY_T &key,
+			      const VALUE_T &value);
+
   ERROR_T      AllocateNode(SIZE_T &node);
 
+  // ERROR_NOSPACE unless count blocks are free.  A leaf split checks
+  // for all the blocks it could take before it changes anything, so
+  // an insert that runs out of space leaves the tree as it was.
+  ERROR_T      ReserveNodes(const SIZE_T count);
+
   ERROR_T      DeallocateNode(const SIZE_T &node);
 
   ERROR_T      LookupOrUpdateInternal(const SIZE_T &Node,
 				      const BTreeOp op,
 				      const KEY_T &key,
-				      VALUE_T &val);
-
+				      VALUE_T &val,
+				      BTreeNodeCache::Entry *hint=0,
+				      const SIZE_T slot=0);
+
+
+  // Key filter upkeep.  The stored filter is marked stale in the
+  // superblock on disk at its first change, so an index that is not
+  // detached cleanly rebuilds it on the next Attach.  Keys are added
+  // before they go into the tree, so the mark is always there first.
+  ERROR_T      KeyFilterAdd(const KEY_VIEW_T &key);
+  ERROR_T      KeyFilterScan(const SIZE_T &node);
+  ERROR_T      KeyFilterLoad();
+  ERROR_T      KeyFilterStore();
+  ERROR_T      KeyFilterFree();
+
+  // The hot set: the node cache's blocks, recorded at Detach and read
+  // back into the cache by Attach
+  ERROR_T      HotSetLoad();
+  ERROR_T      HotSetStore();
+  ERROR_T      HotSetFree();
+
+  // True if the key filter says key is certainly not in the index;
+  // KeyFilterMissed if a key it let through turned out not to be
+  bool         KeyFilterExcludes(const KEY_VIEW_T &key) const;
+  void         KeyFilterMissed() const;
 
   ERROR_T      DisplayInternal(const SIZE_T &node,
 			       ostream &o,
-			       const BTreeDisplayType display_type=BTREE_DEPTH) const;
+			       const BTreeDisplayType display_type,
+			       const std::map<std::string, std::string> &pending) const;
 public:
   //
   // keysize and valueszie should be stored in the
@@ -81,6 +485,7 @@ public:
 	     SIZE_T valuesize,
 	     BufferCache *cache,
 	     bool unique=true);   // true if a  key maps to a single value
+                                  // (only used by Attach(initblock,true))
 
 
   BTreeIndex();
@@ -107,14 +512,34 @@ public:
   // return zero on success
   // return ERROR_NOSPACE if you run out of disk space
   // return ERROR_SIZE if the key or value are the wrong size for this index
-  // return ERROR_CONFLICT if the key already exists and it's a unique index
+  // return ERROR_CONFLICT if the key already exists and it's a unique index,
+  // or if the key already has this value and it's a non-unique index
   ERROR_T Insert(const KEY_T &key, const VALUE_T &value);
 
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
   // return ERROR_SIZE if the key or value are the wrong size for this index
+  // return ERROR_CONFLICT if it's a non-unique index and the key has
+  // more than one value
   ERROR_T Update(const KEY_T &key, const VALUE_T &value);
 
+  // Insert the key, or update it if it exists, in one descent
+  // return zero on success
+  // return ERROR_NOSPACE if you run out of disk space
+  // return ERROR_SIZE if the key or value are the wrong size for this index
+  // return ERROR_CONFLICT if it's a non-unique index and the key has
+  // more than one value
+  ERROR_T Upsert(const KEY_T &key, const VALUE_T &value);
+
+  // Hand key's value (if any) to fn and store what it leaves, in one
+  // descent and at most one leaf write
+  // return zero on success, including when fn declines
+  // return ERROR_NOSPACE if you run out of disk space
+  // return ERROR_SIZE if fn changed the value's size
+  // return ERROR_CONFLICT if it's a non-unique index and the key has
+  // more than one value
+  ERROR_T Modify(const KEY_T &key, BTreeValueModifier &fn);
+
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
   // return ERROR_SIZE if the key or value are the wrong size for this index
@@ -122,8 +547,23 @@ public:
 
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
+  // In a non-unique index value is the key's smallest value.
   ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
 
+  // Set it up to stream all of key's values, in ascending byte order
+  // (the one value, for a unique index)
+  // return zero on success
+  // return ERROR_NONEXISTENT  if the key doesn't exist
+  ERROR_T LookupAll(const KEY_T &key, BTreePostingIterator &it);
+
+  // Look up many keys at once, sharing node reads between keys
+  // that follow the same path.  values[i] and rcs[i] receive the
+  // result for keys[i] (rcs[i] as Lookup would return it).
+  // return zero on success, or the error that stopped the descent
+  ERROR_T LookupBatch(const std::vector<KEY_T> &keys,
+		      std::vector<VALUE_T> &values,
+		      std::vector<ERROR_T> &rcs);
+
   // Here you should figure out if your index makes sense
   // Is it a tree?  Is it in order?  Is it balanced?  Does each node have
   // a valid use ratio?
@@ -143,11 +583,109 @@ public:
 
   ostream & Print(ostream &os) const;
 
+  // Select the node cache replacement policy, the number of leaves
+  // it may hold, and how many root and interior nodes it keeps
+  // regardless (the first ones descents reach, so the upper levels).
+  // Interior nodes past that budget take capacity slots like leaves.
+  // Nothing is kept if the policy is BTREE_CACHE_OFF.  What the cache
+  // defers is checkpointed first.
+  // return zero on success, or the error of that checkpoint, in which
+  // case the cache is left as it was
+  ERROR_T SetNodeCache(const BTreeCachePolicy policy, const SIZE_T capacity,
+		       const SIZE_T pinned=BTREE_CACHE_PINNED_NODES);
+
+  // Hit/miss/eviction counters of the node cache
+  const BTreeCacheStats & GetCacheStats() const;
+
+  // In write-back mode modified nodes (and the superblock) stay
+  // dirty in the node cache and are written when evicted, on
+  // Checkpoint, or on Detach.  Nodes the cache will not hold (leaves
+  // with a zero capacity, or any node with BTREE_CACHE_OFF) are still
+  // written through.  Turning it off flushes.
+  ERROR_T SetWriteBack(const bool on);
+
+  // Write all dirty nodes, in block order, and the superblock
+  ERROR_T Checkpoint();
+
+  // Check the CRC32C of every block read from the buffer cache
+  // (on by default), if the index records that it has them.  A
+  // mismatch fails the read with ERROR_CHECKSUM and bumps the
+  // failure counter.
+  void SetVerifyChecksums(const bool on);
+
+  SIZE_T GetChecksumFailures() const;
+
+  // Nodes read from the buffer cache, i.e. node cache misses, since
+  // the index was made
+  SIZE_T GetNodeReads() const;
+
+  // Search interior nodes by interpolating between their first and
+  // last keys, read as numbers, instead of by bisection.  A win for
+  // integer-like keys spread near-uniformly; a bad guess costs at
+  // most about twice a binary search.  Off by default, and not stored
+  // in the index.
+  void SetInterpolationSearch(const bool on);
+
+  // Store leaves delta-encoded, so one block holds as many entries
+  // as compress into it.  Only takes effect on Attach(initblock,true),
+  // an existing index keeps the mode it was created with.
+  void SetLeafCompression(const bool on);
+
+  // Uncompressed over compressed bytes of the leaves written since
+  // Attach (1.0 if none were)
+  double GetCompressionRatio() const;
+
+  // Give interior nodes message buffers: half of each interior block
+  // holds pending inserts and updates instead of keys, and they only
+  // reach the leaves in batches when a buffer fills.  Lookups check
+  // the buffers on the way down.  Only takes effect on
+  // Attach(initblock,true).  Pairing it with a key filter lets most
+  // inserts skip their duplicate check as well.
+  void SetMessageBuffers(const bool on);
+
+  // Push every buffered message down to the leaves
+  ERROR_T FlushMessageBuffers();
+
+  // Keep a Bloom filter of the keys, stored in blocks of its own
+  // next to the superblock, so that Lookup, Update and Insert's
+  // duplicate check skip the descent for most absent keys.
+  // BuildKeyFilter sizes it for expectedkeys (or the keys already
+  // there, if more) at bitsperkey bits each, and fills it from a scan
+  // of the tree.  RebuildKeyFilter rescans at the same size, clearing
+  // the bits of deleted keys.  Needs an attached index.
+  ERROR_T BuildKeyFilter(const SIZE_T expectedkeys, const SIZE_T bitsperkey=10);
+  ERROR_T RebuildKeyFilter();
+  ERROR_T DropKeyFilter();
+
+  void GetKeyFilterStats(BTreeFilterStats &stats) const;
+
+  // Have Detach record the blocks in the node cache (all interior
+  // nodes, and whatever leaves it holds) in blocks of their own, so
+  // that the next Attach reads them back, a level at a time from the
+  // root down, before returning.  A restarted index then starts with
+  // the cache it shut down with instead of faulting it in one descent
+  // at a time.  The set is only a hint: if it cannot be read, Attach
+  // starts cold.  The node cache has to be set up before that Attach.
+  // Turning it off frees the recorded set at the next Detach.
+  void SetWarmRestart(const bool on);
+
+  // Physically write a node: encode it if it is a compressed leaf.
+  // Used for write-through and by the node cache's write-back.
+  ERROR_T WriteBack(const SIZE_T block, const BTreeNode &node);
+
   //This lookup function will find the path to the node where the passed in key would go, and return it as a stack of pointers.
-  ERROR_T CreatePtrTrail(const SIZE_T &node, const KEY_T &key, std::vector<SIZE_T> &pointerPath);
+  ERROR_T CreatePtrTrail(const SIZE_T &node, const KEY_T &key, std::vector<SIZE_T> &pointerPath,
+			 BTreeNodeCache::Entry *hint=0, const SIZE_T slot=0);
+  // The same trail, from the root, but ending with the leaf only
+  // once, and the leaf borrowed as BorrowNode does, so that changing
+  // it takes no second read
+  ERROR_T DescendToLeaf(const KEY_T &key, std::vector<SIZE_T> &ptrTrail,
+			BTreeNode &scratch, BTreeNode *&leaf) const;
   //TreeBalance takes a path of pointers and a node at the bottom of that path. It will split the node and recursively walk up the parent path
   // guaranteeing the sanity of each parent.
   ERROR_T TreeBalance(const SIZE_T &node, std::vector<SIZE_T> ptrPath);
+  // Same, for a node that is already in memory (and possibly not written)
+  ERROR_T SplitNode(const SIZE_T &node, BTreeNode &b, std::vector<SIZE_T> ptrPath);
   //Walks the tree starting at root node. For our sanity check.
   ERROR_T SanityWalk(const SIZE_T &node/*, std::set<BTreeNode> &allTreeNodes*/) const;
 
@@ -156,4 +694,104 @@ public:
 
 inline ostream & operator<<(ostream &os, const BTreeIndex &b) { return b.Print(os);}
 
+
+//
+// The values of one key, read from its posting blocks one block at
+// a time.  Any change to the index invalidates it.
+//
+class BTreePostingIterator {
+ private:
+  const BTreeIndex *index;
+  BTreeNode block;   // current posting block
+  VALUE_T   single;  // the value of a key that has only one
+  SIZE_T    next;    // block after the current one, 0 at the last
+  SIZE_T    pos;     // next value in block
+  bool      inlined; // true until single is returned, if there are no blocks
+
+  friend class BTreeIndex;
+
+ public:
+  BTreePostingIterator();
+
+  // return zero on success
+  // return ERROR_NONEXISTENT  past the last value
+  ERROR_T Next(VALUE_T &value);
+};
+
+
+enum BTreePartitioning {BTREE_PARTITION_HASH, BTREE_PARTITION_RANGE};
+
+//
+// N independent indexes, each on its own BufferCache with its own
+// superblock, root and free list, with every key living in exactly
+// one of them.  Keys are spread by a hash of their bytes or by
+// ranges.  Single-key operations go to one partition.  The batch
+// operations split the batch by partition and run the partitions on
+// parallel threads, so writers on different partitions never share
+// a node or an allocator.
+//
+// A BTreeIndex is not thread safe, so a partition must not be used
+// by two threads at once.  The batch operations ensure that; callers
+// that run single-key operations from several threads have to do the
+// same.
+//
+class BTreePartitionedIndex {
+ private:
+  std::vector<BTreeIndex *> parts;
+  BTreePartitioning scheme;
+  std::vector<KEY_T> bounds; // partition i holds keys <= bounds[i]
+  unsigned int threads;
+
+  struct Batch;
+  static void *RunBatch(void *batch);
+  ERROR_T RunParallel(Batch &batch);
+
+  BTreePartitionedIndex(const BTreePartitionedIndex &rhs);
+  BTreePartitionedIndex & operator=(const BTreePartitionedIndex &rhs);
+
+ public:
+  // One partition per cache.  Range partitioning also needs
+  // SetRangeBounds before Attach.
+  BTreePartitionedIndex(SIZE_T keysize,
+			SIZE_T valuesize,
+			const std::vector<BufferCache *> &caches,
+			const BTreePartitioning scheme=BTREE_PARTITION_HASH);
+  ~BTreePartitionedIndex();
+
+  // The last key of each partition but the last, in ascending order.
+  // The bounds are not stored in the index, so the same ones have to
+  // be set every time it is attached.
+  ERROR_T SetRangeBounds(const std::vector<KEY_T> &bounds);
+
+  // At most this many threads per batch (default: one per partition)
+  void SetThreads(const unsigned int n);
+
+  SIZE_T NumPartitions() const;
+  SIZE_T PartitionOf(const KEY_T &key) const;
+  // For per-partition settings: node cache, write-back, key filter
+  BTreeIndex & Partition(const SIZE_T i);
+
+  // Attach or create every partition, each at block 0 of its cache
+  ERROR_T Attach(const bool create=false);
+  ERROR_T Detach();
+  ERROR_T Checkpoint();
+
+  ERROR_T Insert(const KEY_T &key, const VALUE_T &value);
+  ERROR_T Update(const KEY_T &key, const VALUE_T &value);
+  ERROR_T Delete(const KEY_T &key);
+  ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
+
+  // rcs[i] is the result for keys[i].  Return an error only if the
+  // batch itself could not be run.
+  ERROR_T InsertBatch(const std::vector<KEY_T> &keys,
+		      const std::vector<VALUE_T> &values,
+		      std::vector<ERROR_T> &rcs);
+  ERROR_T UpdateBatch(const std::vector<KEY_T> &keys,
+		      const std::vector<VALUE_T> &values,
+		      std::vector<ERROR_T> &rcs);
+  ERROR_T LookupBatch(const std::vector<KEY_T> &keys,
+		      std::vector<VALUE_T> &values,
+		      std::vector<ERROR_T> &rcs);
+};
+
 #endif
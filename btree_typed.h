@@ -0,0 +1,292 @@
+#ifndef _btree_typed
+#define _btree_typed
+
+#include <string.h>
+
+#include "btree.h"
+
+//
+// Typed front end for indexes whose keys and values have a fixed,
+// compile-time size.  The on-disk format is exactly the one
+// BTreeIndex uses, so either class can attach to an index the other
+// created.
+//
+// Keys are stored in an order-preserving byte encoding (big-endian,
+// sign bit flipped for signed types), so the tree's byte-wise key
+// order is the natural order of the key type.  Searches compare the
+// encodings, exactly as BTreeIndex does, so a codec is all that
+// defines the order of a new key type.
+//
+// Key and entry widths are compile-time constants, so a search steps
+// through a node at a fixed stride with an inlined comparison of
+// fixed width, instead of BTreeNode's per-slot offset arithmetic and
+// memcmp of a runtime length.
+//
+
+// Order-preserving key encoding.  Specialize for other key types.
+template <class T> struct BTreeKeyCodec;
+
+template <class U>
+inline void BTreeEncodeBigEndian(U v, char *out)
+{
+  for (int i=sizeof(U)-1;i>=0;i--) {
+    out[i]=(char)(v&0xff);
+    v>>=8;
+  }
+}
+
+template <class U>
+inline U BTreeDecodeBigEndian(const char *in)
+{
+  U v=0;
+  for (unsigned i=0;i<sizeof(U);i++) {
+    v=(U)((v<<8)|(unsigned char)in[i]);
+  }
+  return v;
+}
+
+#define BTREE_UNSIGNED_KEY_CODEC(T)					\
+  template <> struct BTreeKeyCodec<T> {					\
+    static void Encode(const T &k, char *out) { BTreeEncodeBigEndian<T>(k,out); } \
+    static T Decode(const char *in) { return BTreeDecodeBigEndian<T>(in); } \
+  };
+
+#define BTREE_SIGNED_KEY_CODEC(T,U)					\
+  template <> struct BTreeKeyCodec<T> {					\
+    static const U signbit = (U)1<<(8*sizeof(U)-1);			\
+    static void Encode(const T &k, char *out) { BTreeEncodeBigEndian<U>((U)k^signbit,out); } \
+    static T Decode(const char *in) { return (T)(BTreeDecodeBigEndian<U>(in)^signbit); } \
+  };
+
+BTREE_UNSIGNED_KEY_CODEC(unsigned char)
+BTREE_UNSIGNED_KEY_CODEC(unsigned short)
+BTREE_UNSIGNED_KEY_CODEC(unsigned int)
+BTREE_UNSIGNED_KEY_CODEC(unsigned long)
+BTREE_UNSIGNED_KEY_CODEC(unsigned long long)
+BTREE_SIGNED_KEY_CODEC(signed char,unsigned char)
+BTREE_SIGNED_KEY_CODEC(short,unsigned short)
+BTREE_SIGNED_KEY_CODEC(int,unsigned int)
+BTREE_SIGNED_KEY_CODEC(long,unsigned long)
+BTREE_SIGNED_KEY_CODEC(long long,unsigned long long)
+
+#undef BTREE_UNSIGNED_KEY_CODEC
+#undef BTREE_SIGNED_KEY_CODEC
+
+// Byte order of two encoded keys of N bytes.  The widths of the
+// integer keys compare as one big-endian word.
+template <SIZE_T N> struct BTreeKeyBytesLess {
+  bool operator()(const char *a, const char *b) const { return memcmp(a,b,N)<0; }
+};
+
+#define BTREE_WORD_KEY_LESS(U)						\
+  template <> struct BTreeKeyBytesLess<sizeof(U)> {			\
+    bool operator()(const char *a, const char *b) const {		\
+      return BTreeDecodeBigEndian<U>(a)<BTreeDecodeBigEndian<U>(b);	\
+    }									\
+  };
+
+BTREE_WORD_KEY_LESS(uint8_t)
+BTREE_WORD_KEY_LESS(uint16_t)
+BTREE_WORD_KEY_LESS(uint32_t)
+BTREE_WORD_KEY_LESS(uint64_t)
+
+#undef BTREE_WORD_KEY_LESS
+
+// Values are never compared, so any trivially copyable type is
+// stored as its raw bytes
+template <class T> struct BTreeValueCodec {
+  static void Encode(const T &v, char *out) { memcpy(out,&v,sizeof(T)); }
+  static T Decode(const char *in) { T v; memcpy(&v,in,sizeof(T)); return v; }
+};
+
+
+//
+// Compare orders two encoded keys.  The tree is in byte order, so a
+// Compare other than the default must order encodings exactly as
+// their bytes do; it can only make the comparison cheaper, never
+// change the order.
+//
+template <class KeyT, class ValT, class Compare=BTreeKeyBytesLess<sizeof(KeyT)> >
+class BTreeIndexT : public BTreeIndex {
+ public:
+  typedef BTreeKeyCodec<KeyT>   KeyCodec;
+  typedef BTreeValueCodec<ValT> ValueCodec;
+
+  static const SIZE_T keysize = sizeof(KeyT);
+  static const SIZE_T valuesize = sizeof(ValT);
+
+  // Distance from one key to the next in an interior node, a leaf,
+  // and a leaf of a non-unique index (where the posting list head
+  // sits between key and value)
+  static const SIZE_T interiorstride = keysize+sizeof(SIZE_T);
+  static const SIZE_T leafstride = keysize+valuesize;
+  static const SIZE_T postingstride = keysize+sizeof(SIZE_T)+valuesize;
+
+  // As for BTreeIndex, unique only matters to an index made by
+  // Attach(create=true); an existing index is whatever it was made as
+  BTreeIndexT(BufferCache *cache, const bool unique=true, const Compare &c=Compare()) :
+    BTreeIndex(keysize,valuesize,cache,unique), less(c),
+    scratchkey(keysize), scratchvalue(valuesize) {}
+
+  using BTreeIndex::Insert;
+  using BTreeIndex::Update;
+  using BTreeIndex::Upsert;
+  using BTreeIndex::Modify;
+  using BTreeIndex::Delete;
+  using BTreeIndex::Lookup;
+
+  // Like BTreeIndex::Attach, but
+  // return ERROR_SIZE, without attaching, if the index was built with
+  // other key/value sizes
+  ERROR_T Attach(const SIZE_T initblock, const bool create=false) {
+    if (!create) {
+      SIZE_T ks, vs;
+      ERROR_T rc = ReadIndexSizes(initblock,ks,vs);
+      if (rc) { return rc; }
+      if (ks!=keysize || vs!=valuesize) {
+	return ERROR_SIZE;
+      }
+    }
+    return BTreeIndex::Attach(initblock,create);
+  }
+
+  // The mutators encode their arguments into scratchkey and
+  // scratchvalue, so that they allocate no more than BTreeIndex's do
+  ERROR_T Insert(const KeyT &key, const ValT &value) {
+    KeyCodec::Encode(key,scratchkey.data);
+    ValueCodec::Encode(value,scratchvalue.data);
+    return BTreeIndex::Insert(scratchkey,scratchvalue);
+  }
+
+  ERROR_T Update(const KeyT &key, const ValT &value) {
+    KeyCodec::Encode(key,scratchkey.data);
+    ValueCodec::Encode(value,scratchvalue.data);
+    return BTreeIndex::Update(scratchkey,scratchvalue);
+  }
+
+  ERROR_T Upsert(const KeyT &key, const ValT &value) {
+    KeyCodec::Encode(key,scratchkey.data);
+    ValueCodec::Encode(value,scratchvalue.data);
+    return BTreeIndex::Upsert(scratchkey,scratchvalue);
+  }
+
+  ERROR_T Delete(const KeyT &key) {
+    KeyCodec::Encode(key,scratchkey.data);
+    return BTreeIndex::Delete(scratchkey);
+  }
+
+  // return zero on success
+  // return ERROR_NONEXISTENT  if the key doesn't exist
+  // In a non-unique index value is the key's smallest value.
+  ERROR_T Lookup(const KeyT &key, ValT &value) const;
+
+ protected:
+  Compare less;
+  KEY_T   scratchkey;
+  VALUE_T scratchvalue;
+
+  // First of the n keys, Stride bytes apart from keys on, that is >=
+  // the encoded key k (n if none), the same slot a linear scan for
+  // "key<=testkey" stops at
+  template <SIZE_T Stride>
+  SIZE_T LowerBound(const char *keys, const SIZE_T n, const char *k) const {
+    SIZE_T lo=0;
+    SIZE_T hi=n;
+    while (lo<hi) {
+      SIZE_T mid=lo+(hi-lo)/2;
+      if (less(keys+mid*Stride,k)) {
+	lo=mid+1;
+      } else {
+	hi=mid;
+      }
+    }
+    return lo;
+  }
+};
+
+
+template <class KeyT, class ValT, class Compare>
+const SIZE_T BTreeIndexT<KeyT,ValT,Compare>::keysize;
+
+template <class KeyT, class ValT, class Compare>
+const SIZE_T BTreeIndexT<KeyT,ValT,Compare>::valuesize;
+
+template <class KeyT, class ValT, class Compare>
+const SIZE_T BTreeIndexT<KeyT,ValT,Compare>::interiorstride;
+
+template <class KeyT, class ValT, class Compare>
+const SIZE_T BTreeIndexT<KeyT,ValT,Compare>::leafstride;
+
+template <class KeyT, class ValT, class Compare>
+const SIZE_T BTreeIndexT<KeyT,ValT,Compare>::postingstride;
+
+
+//
+// Descends with fixed-stride binary searches over borrowed, swizzled
+// nodes and decodes the value straight out of the leaf, instead of
+// going through LookupOrUpdateInternal and a VALUE_T
+//
+template <class KeyT, class ValT, class Compare>
+ERROR_T BTreeIndexT<KeyT,ValT,Compare>::Lookup(const KeyT &key, ValT &value) const
+{
+  BTreeNode scratch;
+  BTreeNode *p;
+  BTreeNodeCache::Entry *hint = 0;
+  ERROR_T rc;
+  SIZE_T node = GetSuperblock().info.rootnode;
+  SIZE_T offset = 0;
+
+  char k[keysize];
+
+  KeyCodec::Encode(key,k);
+  if (KeyFilterExcludes(KEY_VIEW_T(k,keysize))) {
+    return ERROR_NONEXISTENT;
+  }
+
+  while (true) {
+    rc=BorrowNode(node,scratch,p,hint,offset);
+    if (rc) { return rc; }
+    const BTreeNode &b = *p;
+
+    switch (b.info.nodetype) {
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      if (b.info.numkeys==0) {
+	return ERROR_NONEXISTENT;
+      }
+      if (Buffered()) {
+	const char *val;
+	if (FindMessage(b,KEY_VIEW_T(k,keysize),val)) {
+	  // a message holds a whole leaf slot, head included
+	  value=ValueCodec::Decode(val+(Unique() ? 0 : sizeof(SIZE_T)));
+	  return ERROR_NOERROR;
+	}
+      }
+      offset=LowerBound<interiorstride>(b.ResolveKey(0),b.info.numkeys,k);
+      memcpy(&node,b.ResolvePtr(0)+offset*interiorstride,sizeof(SIZE_T));
+      break;
+    case BTREE_LEAF_NODE: {
+      const char *keys = b.ResolveKey(0);
+      const char *found;
+      if (Unique()) {
+	offset=LowerBound<leafstride>(keys,b.info.numkeys,k);
+	found=keys+offset*leafstride;
+      } else {
+	offset=LowerBound<postingstride>(keys,b.info.numkeys,k);
+	found=keys+offset*postingstride;
+      }
+      if (offset<b.info.numkeys && !less(k,found)) {
+	// past the posting list head, in a non-unique index
+	value=ValueCodec::Decode(found+keysize+(Unique() ? 0 : sizeof(SIZE_T)));
+	return ERROR_NOERROR;
+      }
+      KeyFilterMissed();
+      return ERROR_NONEXISTENT;
+    }
+    default:
+      return ERROR_INSANE;
+    }
+  }
+}
+
+#endif
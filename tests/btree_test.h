@@ -0,0 +1,107 @@
+#ifndef _btree_test
+#define _btree_test
+
+//
+// Shared setup for the index tests.  Each test_*.cc here is a program
+// of its own: it makes fresh disks, runs its cases, and exits non-zero
+// if any CHECK failed.  Build one against the index and the disk
+// system like the other tools, e.g.
+//
+//   g++ -I.. -o test_nonunique test_nonunique.cc
+//       ../btree.cc ../buffercache.cc ../disksystem.cc
+//
+// A crash is simulated by dropping an index without Detach (and
+// without running its destructor, which would checkpoint) and
+// attaching a new one to the same buffer cache, which stands in for
+// the disk.
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <string.h>
+
+#include "btree.h"
+
+static int btree_test_checks = 0;
+static int btree_test_failures = 0;
+
+#define CHECK(cond)							\
+  do {									\
+    btree_test_checks++;						\
+    if (!(cond)) {							\
+      btree_test_failures++;						\
+      fprintf(stderr,"%s:%d: CHECK(%s) failed\n",__FILE__,__LINE__,#cond); \
+    }									\
+  } while (0)
+
+#define CHECK_RC(expr,want)						\
+  do {									\
+    ERROR_T btree_test_rc = (expr);					\
+    btree_test_checks++;						\
+    if (btree_test_rc!=(want)) {					\
+      btree_test_failures++;						\
+      fprintf(stderr,"%s:%d: %s returned %d, expected %d\n",		\
+	      __FILE__,__LINE__,#expr,(int)btree_test_rc,(int)(want));	\
+    }									\
+  } while (0)
+
+// Exit status for main
+inline int TestSummary(const char *name)
+{
+  fprintf(stderr,"%s: %d checks, %d failed\n",name,btree_test_checks,btree_test_failures);
+  return btree_test_failures ? 1 : 0;
+}
+
+
+//
+// A disk of numblocks blocks of blocksize bytes with a buffer cache
+// in front of it.  Every TestDisk gets a disk file of its own.
+//
+class TestDisk {
+ public:
+  DiskSystem   disk;
+  BufferCache *cache;
+
+  TestDisk(const char *name, const SIZE_T numblocks, const SIZE_T blocksize=1024) {
+    // geometry only matters to the disk system's timing model
+    if (disk.Initialize(name,numblocks,blocksize,1,numblocks,1,0.0,0.0,0.0)
+	|| disk.Attach(name)) {
+      fprintf(stderr,"cannot make disk %s\n",name);
+      exit(2);
+    }
+    cache=new BufferCache(&disk,numblocks);
+    if (cache->Attach()) {
+      fprintf(stderr,"cannot attach buffer cache for %s\n",name);
+      exit(2);
+    }
+  }
+
+  ~TestDisk() {
+    cache->Detach();
+    delete cache;
+    disk.Detach();
+  }
+};
+
+
+// Key or value n in size bytes, big-endian and zero padded on the
+// left, so that byte order is numeric order
+inline Block TestBlock(unsigned long n, const SIZE_T size)
+{
+  Block b(size);
+  SIZE_T i;
+
+  memset(b.data,0,size);
+  for (i=size; i>0 && n; i--) {
+    b.data[i-1]=(char)(n&0xff);
+    n>>=8;
+  }
+  return b;
+}
+
+inline bool SameBlock(const Block &a, const Block &b)
+{
+  return a.length==b.length && memcmp(a.data,b.data,a.length)==0;
+}
+
+#endif
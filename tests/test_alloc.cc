@@ -0,0 +1,135 @@
+//
+// Steady-state operations make no heap allocations.  Every operator
+// new in this program is counted; an operation is measured once its
+// nodes are cached and its scratch space has grown to size.  Writes
+// are deferred, since writing a node through serializes it into a
+// Block of its own.
+//
+#include <new>
+
+#include "btree_test.h"
+#include "btree_typed.h"
+
+static long allocations = 0;
+
+void *operator new(size_t n)
+{
+  void *p;
+
+  allocations++;
+  p=malloc(n ? n : 1);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[](size_t n)
+{
+  return operator new(n);
+}
+
+void operator delete(void *p) throw()
+{
+  free(p);
+}
+
+void operator delete[](void *p) throw()
+{
+  free(p);
+}
+
+#define KEYSIZE 8
+#define VALUESIZE 8
+
+// Doubles the value's last byte
+class Twice : public BTreeValueModifier {
+ public:
+  bool Modify(const KEY_T &key, VALUE_T &value, const bool exists) {
+    value.data[value.length-1]*=2;
+    return true;
+  }
+};
+
+static void TestIndex()
+{
+  TestDisk d("test_alloc",2000);
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  KEY_T key = TestBlock(100,KEYSIZE);
+  VALUE_T value = TestBlock(1,VALUESIZE);
+  Twice twice;
+  unsigned long i;
+  long before;
+
+  CHECK_RC(index.SetNodeCache(BTREE_CACHE_LRU,1000),ERROR_NOERROR);
+  CHECK_RC(index.SetWriteBack(true),ERROR_NOERROR);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<500;i++) {
+    CHECK_RC(index.Insert(TestBlock(i*2,KEYSIZE),value),ERROR_NOERROR);
+  }
+  // warm up
+  CHECK_RC(index.Lookup(key,value),ERROR_NOERROR);
+  CHECK_RC(index.Update(key,value),ERROR_NOERROR);
+  CHECK_RC(index.Upsert(key,value),ERROR_NOERROR);
+  CHECK_RC(index.Modify(key,twice),ERROR_NOERROR);
+
+  before=allocations;
+  for (i=0;i<1000;i++) {
+    CHECK_RC(index.Lookup(key,value),ERROR_NOERROR);
+  }
+  CHECK(allocations==before);
+
+  before=allocations;
+  for (i=0;i<1000;i++) {
+    CHECK_RC(index.Update(key,value),ERROR_NOERROR);
+    CHECK_RC(index.Upsert(key,value),ERROR_NOERROR);
+    CHECK_RC(index.Modify(key,twice),ERROR_NOERROR);
+  }
+  CHECK(allocations==before);
+
+  // New keys allocate only when they split a leaf
+  KEY_T fresh(KEYSIZE);
+  for (i=0;i<400;i++) {
+    SIZE_T leaves = index.GetCacheStats().resident;
+    memcpy(fresh.data,TestBlock(i*2+1,KEYSIZE).data,KEYSIZE);
+    before=allocations;
+    CHECK_RC(index.Insert(fresh,value),ERROR_NOERROR);
+    CHECK(allocations==before || index.GetCacheStats().resident!=leaves);
+  }
+}
+
+static void TestTyped()
+{
+  TestDisk d("test_alloc_typed",2000);
+  BTreeIndexT<unsigned long, unsigned long> index(d.cache);
+  unsigned long value = 0;
+  unsigned long i;
+  long before;
+
+  CHECK_RC(index.SetNodeCache(BTREE_CACHE_LRU,1000),ERROR_NOERROR);
+  CHECK_RC(index.SetWriteBack(true),ERROR_NOERROR);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<500;i++) {
+    CHECK_RC(index.Insert(i*2,i),ERROR_NOERROR);
+  }
+  CHECK_RC(index.Update(100,7),ERROR_NOERROR);
+  CHECK_RC(index.Upsert(100,8),ERROR_NOERROR);
+
+  before=allocations;
+  for (i=0;i<1000;i++) {
+    CHECK_RC(index.Lookup(i%500*2,value),ERROR_NOERROR);
+    CHECK(i%500==50 || value==i%500);
+    CHECK_RC(index.Lookup(1001,value),ERROR_NONEXISTENT);
+    CHECK_RC(index.Update(100,i),ERROR_NOERROR);
+    CHECK_RC(index.Upsert(100,i+1),ERROR_NOERROR);
+    CHECK_RC(index.Insert(100,i),ERROR_CONFLICT);
+  }
+  CHECK(allocations==before);
+}
+
+int main(int argc, char *argv[])
+{
+  TestIndex();
+  TestTyped();
+  return TestSummary(argv[0]);
+}
@@ -0,0 +1,150 @@
+//
+// LookupBatch: the same answers as one Lookup per key, in the
+// caller's order, with each node on the shared paths read once.
+//
+#include <vector>
+
+#include "btree_test.h"
+
+#define KEYSIZE 8
+#define VALUESIZE 8
+
+static void CheckBatch(BTreeIndex &index, const std::vector<KEY_T> &keys)
+{
+  std::vector<VALUE_T> values;
+  std::vector<ERROR_T> rcs;
+  VALUE_T value(VALUESIZE);
+  SIZE_T i;
+
+  CHECK_RC(index.LookupBatch(keys,values,rcs),ERROR_NOERROR);
+  CHECK(values.size()==keys.size() && rcs.size()==keys.size());
+  for (i=0;i<keys.size() && i<rcs.size();i++) {
+    CHECK_RC(rcs[i],index.Lookup(keys[i],value));
+    if (rcs[i]==ERROR_NOERROR) {
+      CHECK(SameBlock(values[i],value));
+    }
+  }
+}
+
+// Every key from 0 to 2n, shuffled, and some of them twice; the odd
+// ones are not in the index
+static std::vector<KEY_T> Probes(const unsigned long n)
+{
+  std::vector<KEY_T> keys;
+  unsigned long i;
+
+  for (i=0;i<2*n;i++) {
+    keys.push_back(TestBlock(i*7919%(2*n),KEYSIZE));
+  }
+  for (i=0;i<n;i+=10) {
+    keys.push_back(TestBlock(i,KEYSIZE));
+  }
+  return keys;
+}
+
+static void TestAnswers(const char *name, const bool buffered, const bool filtered)
+{
+  TestDisk d(name,2000);
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  std::vector<KEY_T> none;
+  std::vector<VALUE_T> values;
+  std::vector<ERROR_T> rcs;
+  unsigned long i;
+  const unsigned long n = 3000;
+
+  index.SetMessageBuffers(buffered);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  if (filtered) {
+    CHECK_RC(index.BuildKeyFilter(n),ERROR_NOERROR);
+  }
+  for (i=0;i<n;i++) {
+    CHECK_RC(index.Insert(TestBlock(i*2*7919%(2*n),KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+  }
+  // with buffers, some of these are still queued in interior nodes
+  for (i=0;i<n;i+=4) {
+    CHECK_RC(index.Update(TestBlock(i*2,KEYSIZE),TestBlock(i+5,VALUESIZE)),ERROR_NOERROR);
+  }
+  CheckBatch(index,Probes(n));
+
+  CHECK_RC(index.LookupBatch(none,values,rcs),ERROR_NOERROR);
+  CHECK(values.empty() && rcs.empty());
+}
+
+// With no node cache, a batch reads each node it needs once, where
+// one Lookup per key reads the whole path every time
+static void TestReads()
+{
+  TestDisk d("test_batch_reads",2000);
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  std::vector<KEY_T> keys;
+  std::vector<VALUE_T> values;
+  std::vector<ERROR_T> rcs;
+  VALUE_T value(VALUESIZE);
+  SIZE_T before;
+  unsigned long i;
+  const unsigned long n = 3000;
+
+  CHECK_RC(index.SetNodeCache(BTREE_CACHE_OFF,0),ERROR_NOERROR);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<n;i++) {
+    CHECK_RC(index.Insert(TestBlock(i,KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+  }
+  for (i=0;i<n;i+=3) {
+    keys.push_back(TestBlock(i,KEYSIZE));
+  }
+
+  before=index.GetNodeReads();
+  for (i=0;i<keys.size();i++) {
+    CHECK_RC(index.Lookup(keys[i],value),ERROR_NOERROR);
+  }
+  SIZE_T single = index.GetNodeReads()-before;
+
+  before=index.GetNodeReads();
+  CHECK_RC(index.LookupBatch(keys,values,rcs),ERROR_NOERROR);
+  SIZE_T batch = index.GetNodeReads()-before;
+  CHECK(batch*4<single);
+  for (i=0;i<keys.size();i++) {
+    CHECK_RC(rcs[i],ERROR_NOERROR);
+    CHECK(SameBlock(values[i],TestBlock(i*3,VALUESIZE)));
+  }
+}
+
+// A non-unique key answers with its smallest value, at the size
+// callers insert
+static void TestNonUnique()
+{
+  TestDisk d("test_batch_nonunique",2000);
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache,false);
+  std::vector<KEY_T> keys;
+  std::vector<VALUE_T> values;
+  std::vector<ERROR_T> rcs;
+  unsigned long i;
+
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<500;i++) {
+    CHECK_RC(index.Insert(TestBlock(i,KEYSIZE),TestBlock(i+10,VALUESIZE)),ERROR_NOERROR);
+    if (i%2) {
+      CHECK_RC(index.Insert(TestBlock(i,KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+    }
+  }
+  for (i=0;i<=500;i++) {
+    keys.push_back(TestBlock(500-i,KEYSIZE));
+  }
+  CHECK_RC(index.LookupBatch(keys,values,rcs),ERROR_NOERROR);
+  CHECK_RC(rcs[0],ERROR_NONEXISTENT);
+  for (i=1;i<=500;i++) {
+    unsigned long k = 500-i;
+    CHECK_RC(rcs[i],ERROR_NOERROR);
+    CHECK(SameBlock(values[i],TestBlock(k%2 ? k : k+10,VALUESIZE)));
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  TestAnswers("test_batch",false,false);
+  TestAnswers("test_batch_buffered",true,false);
+  TestAnswers("test_batch_filtered",false,true);
+  TestReads();
+  TestNonUnique();
+  return TestSummary(argv[0]);
+}
@@ -0,0 +1,178 @@
+//
+// Message buffers: lookups see queued messages, flushing applies them,
+// and a flush that runs out of space loses none of them.
+//
+#include <map>
+#include <sstream>
+#include <string>
+
+#include "btree_test.h"
+
+#define KEYSIZE 8
+#define VALUESIZE 8
+
+typedef std::map<unsigned long, unsigned long> Contents;
+
+static void CheckContents(BTreeIndex &index, const Contents &ref)
+{
+  VALUE_T value(VALUESIZE);
+
+  for (Contents::const_iterator it=ref.begin(); it!=ref.end(); ++it) {
+    CHECK_RC(index.Lookup(TestBlock(it->first,KEYSIZE),value),ERROR_NOERROR);
+    CHECK(SameBlock(value,TestBlock(it->second,VALUESIZE)));
+  }
+}
+
+static void TestBuffered(const char *name, const bool writeback)
+{
+  TestDisk d(name,2000);
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  Contents ref;
+  VALUE_T value(VALUESIZE);
+  SIZE_T superblock;
+  unsigned long i;
+
+  index.SetMessageBuffers(true);
+  CHECK_RC(index.SetWriteBack(writeback),ERROR_NOERROR);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<5000;i++) {
+    unsigned long k = i*7919%5000;
+    CHECK_RC(index.Insert(TestBlock(k,KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+    ref[k]=i;
+  }
+  CHECK_RC(index.Insert(TestBlock(ref.begin()->first,KEYSIZE),value),ERROR_CONFLICT);
+  // updates to keys whose inserts may still be queued
+  for (i=0;i<5000;i+=3) {
+    CHECK_RC(index.Update(TestBlock(i,KEYSIZE),TestBlock(i+7,VALUESIZE)),ERROR_NOERROR);
+    ref[i]=i+7;
+  }
+  CHECK_RC(index.Update(TestBlock(5000,KEYSIZE),value),ERROR_NONEXISTENT);
+  CheckContents(index,ref);
+
+  CHECK_RC(index.FlushMessageBuffers(),ERROR_NOERROR);
+  CheckContents(index,ref);
+
+  CHECK_RC(index.Detach(superblock),ERROR_NOERROR);
+  BTreeIndex again(0,0,d.cache);
+  CHECK_RC(again.Attach(superblock,false),ERROR_NOERROR);
+  CheckContents(again,ref);
+}
+
+//
+// A disk too small for all the keys.  Inserts are acknowledged while
+// they are only queued, so the flushes that run out of blocks must
+// keep what they could not apply: every acknowledged key is still
+// found, before and after the buffers are drained.
+//
+static void TestNoSpace(const char *name, const bool writeback)
+{
+  TestDisk d(name,80);
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  Contents ref;
+  unsigned long i;
+  int failures = 0;
+  ERROR_T rc;
+
+  index.SetMessageBuffers(true);
+  CHECK_RC(index.SetWriteBack(writeback),ERROR_NOERROR);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<20000 && failures<50;i++) {
+    unsigned long k = i*7919%20000;
+    rc=index.Insert(TestBlock(k,KEYSIZE),TestBlock(i,VALUESIZE));
+    if (rc==ERROR_NOERROR) {
+      ref[k]=i;
+    } else {
+      CHECK_RC(rc,ERROR_NOSPACE);
+      failures++;
+    }
+  }
+  CHECK(failures==50);
+  CHECK(ref.size()>100);
+  CheckContents(index,ref);
+
+  rc=index.FlushMessageBuffers();
+  CHECK(rc==ERROR_NOERROR || rc==ERROR_NOSPACE);
+  CheckContents(index,ref);
+  CHECK_RC(index.Checkpoint(),ERROR_NOERROR);
+  CheckContents(index,ref);
+}
+
+// The sorted listing shows queued messages as lookups do, so it is
+// the same before and after the buffers are flushed
+static void TestDisplay()
+{
+  TestDisk d("test_buffers_display",2000);
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  std::ostringstream want;
+  std::ostringstream before;
+  std::ostringstream after;
+  std::ostringstream depth;
+  Contents ref;
+  unsigned long i;
+
+  index.SetMessageBuffers(true);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<1000;i++) {
+    unsigned long k = i*7919%1000;
+    CHECK_RC(index.Insert(TestBlock(k,KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+    ref[k]=i;
+  }
+  for (i=0;i<1000;i+=7) {
+    CHECK_RC(index.Update(TestBlock(i,KEYSIZE),TestBlock(i+3,VALUESIZE)),ERROR_NOERROR);
+    ref[i]=i+3;
+  }
+  for (Contents::const_iterator it=ref.begin(); it!=ref.end(); ++it) {
+    Block k = TestBlock(it->first,KEYSIZE);
+    Block v = TestBlock(it->second,VALUESIZE);
+    want << "(" << std::string(k.data,k.length) << "," << std::string(v.data,v.length) << ")\n";
+  }
+
+  CHECK_RC(index.Display(depth,BTREE_DEPTH),ERROR_NOERROR);
+  CHECK(depth.str().find("Messages: ")!=std::string::npos);
+  CHECK_RC(index.Display(before,BTREE_SORTED_KEYVAL),ERROR_NOERROR);
+  CHECK(before.str()==want.str());
+
+  CHECK_RC(index.FlushMessageBuffers(),ERROR_NOERROR);
+  CHECK_RC(index.Display(after,BTREE_SORTED_KEYVAL),ERROR_NOERROR);
+  CHECK(after.str()==want.str());
+}
+
+//
+// Keys so big that an interior node has room for keys but not for a
+// message buffer as well.  The index is refused before anything of
+// it is written.
+//
+static void TestTooBig()
+{
+  TestDisk d("test_buffers_toobig",20);
+  BTreeIndex index(200,VALUESIZE,d.cache);
+  Block before[2];
+  Block after[2];
+  SIZE_T n;
+
+  for (n=0;n<2;n++) {
+    CHECK_RC(d.cache->ReadBlock(n,before[n]),ERROR_NOERROR);
+  }
+  index.SetMessageBuffers(true);
+  CHECK_RC(index.Attach(0,true),ERROR_SIZE);
+  for (n=0;n<2;n++) {
+    CHECK_RC(d.cache->ReadBlock(n,after[n]),ERROR_NOERROR);
+    CHECK(SameBlock(before[n],after[n]));
+  }
+
+  // the same sizes are fine without buffers
+  BTreeIndex plain(200,VALUESIZE,d.cache);
+  CHECK_RC(plain.Attach(0,true),ERROR_NOERROR);
+}
+
+int main(int argc, char *argv[])
+{
+  TestBuffered("test_buffers",false);
+  TestBuffered("test_buffers_writeback",true);
+  TestDisplay();
+
+  TestNoSpace("test_buffers_nospace",false);
+  TestNoSpace("test_buffers_nospace_writeback",true);
+  TestTooBig();
+  return TestSummary(argv[0]);
+}
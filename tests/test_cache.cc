@@ -0,0 +1,173 @@
+//
+// Node cache: every policy gives the same answers, pinning stays
+// within its budget, and a leaf that fails to split for lack of
+// space is left in the cache as it was.
+//
+#include <vector>
+
+#include "btree_test.h"
+
+#define KEYSIZE 8
+#define VALUESIZE 8
+
+static void TestPolicy(const char *name, const BTreeCachePolicy policy, const SIZE_T capacity)
+{
+  TestDisk d(name,2000);
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  VALUE_T value(VALUESIZE);
+  SIZE_T superblock;
+  unsigned long i;
+
+  CHECK_RC(index.SetNodeCache(policy,capacity),ERROR_NOERROR);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<3000;i++) {
+    CHECK_RC(index.Insert(TestBlock(i*7%3000,KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+  }
+  for (i=0;i<3000;i+=2) {
+    CHECK_RC(index.Update(TestBlock(i*7%3000,KEYSIZE),TestBlock(i+1,VALUESIZE)),ERROR_NOERROR);
+  }
+  for (i=0;i<3000;i++) {
+    CHECK_RC(index.Lookup(TestBlock(i*7%3000,KEYSIZE),value),ERROR_NOERROR);
+    CHECK(SameBlock(value,TestBlock(i%2 ? i : i+1,VALUESIZE)));
+  }
+  CHECK_RC(index.Lookup(TestBlock(3000,KEYSIZE),value),ERROR_NONEXISTENT);
+
+  const BTreeCacheStats &stats = index.GetCacheStats();
+  if (policy==BTREE_CACHE_OFF) {
+    CHECK(stats.hits==0 && stats.resident==0 && stats.pinned==0);
+  } else {
+    CHECK(stats.hits>0);
+    CHECK(stats.resident<=capacity);
+  }
+
+  CHECK_RC(index.Detach(superblock),ERROR_NOERROR);
+  BTreeIndex again(0,0,d.cache);
+  CHECK_RC(again.SetNodeCache(policy,capacity),ERROR_NOERROR);
+  CHECK_RC(again.Attach(superblock,false),ERROR_NOERROR);
+  for (i=0;i<3000;i++) {
+    CHECK_RC(again.Lookup(TestBlock(i*7%3000,KEYSIZE),value),ERROR_NOERROR);
+  }
+}
+
+//
+// A deep tree (small blocks) with more interior nodes than the pin
+// budget.  The ones left over are cached, evicted and, in write-back
+// mode, written back as leaves are; the answers are the same.
+//
+static void TestPinBudget(const char *name, const BTreeCachePolicy policy,
+			  const SIZE_T pinned, const bool writeback)
+{
+  TestDisk d(name,4000,256);
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  VALUE_T value(VALUESIZE);
+  SIZE_T superblock;
+  unsigned long i;
+  const unsigned long n = 3000;
+
+  CHECK_RC(index.SetNodeCache(policy,16,pinned),ERROR_NOERROR);
+  CHECK_RC(index.SetWriteBack(writeback),ERROR_NOERROR);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<n;i++) {
+    CHECK_RC(index.Insert(TestBlock(i*7%n,KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+    CHECK(index.GetCacheStats().pinned<=pinned);
+  }
+  for (i=0;i<n;i+=3) {
+    CHECK_RC(index.Update(TestBlock(i*7%n,KEYSIZE),TestBlock(i+1,VALUESIZE)),ERROR_NOERROR);
+  }
+  for (i=0;i<n;i++) {
+    CHECK_RC(index.Lookup(TestBlock(i*7%n,KEYSIZE),value),ERROR_NOERROR);
+    CHECK(SameBlock(value,TestBlock(i%3 ? i : i+1,VALUESIZE)));
+  }
+  const BTreeCacheStats &stats = index.GetCacheStats();
+  CHECK(stats.pinned==pinned);
+  CHECK(stats.resident<=16);
+
+  CHECK_RC(index.Detach(superblock),ERROR_NOERROR);
+  BTreeIndex again(0,0,d.cache);
+  CHECK_RC(again.Attach(superblock,false),ERROR_NOERROR);
+  for (i=0;i<n;i++) {
+    CHECK_RC(again.Lookup(TestBlock(i*7%n,KEYSIZE),value),ERROR_NOERROR);
+    CHECK(SameBlock(value,TestBlock(i%3 ? i : i+1,VALUESIZE)));
+  }
+}
+
+//
+// Fill a small disk until inserts run out of blocks.  The key that
+// could not be placed is not found afterwards, not even through the
+// cached leaf it was on its way into, and everything before it is.
+//
+static void TestSplitNoSpace(const char *name, const bool writeback)
+{
+  TestDisk d(name,60);
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  std::vector<unsigned long> inserted;
+  VALUE_T value(VALUESIZE);
+  unsigned long i;
+  int failures = 0;
+  ERROR_T rc;
+
+  CHECK_RC(index.SetNodeCache(BTREE_CACHE_LRU,100),ERROR_NOERROR);
+  CHECK_RC(index.SetWriteBack(writeback),ERROR_NOERROR);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<10000 && failures<20;i++) {
+    unsigned long k = i*7919%10000;
+    rc=index.Insert(TestBlock(k,KEYSIZE),TestBlock(i,VALUESIZE));
+    if (rc==ERROR_NOERROR) {
+      inserted.push_back(k);
+    } else {
+      CHECK_RC(rc,ERROR_NOSPACE);
+      CHECK_RC(index.Lookup(TestBlock(k,KEYSIZE),value),ERROR_NONEXISTENT);
+      failures++;
+    }
+  }
+  CHECK(failures==20);
+  CHECK(inserted.size()>100);
+  for (i=0;i<inserted.size();i++) {
+    CHECK_RC(index.Lookup(TestBlock(inserted[i],KEYSIZE),value),ERROR_NOERROR);
+  }
+  CHECK_RC(index.Checkpoint(),ERROR_NOERROR);
+}
+
+// Assigning over an index writes out what it deferred and frees its
+// cache (run with leak checking to see the latter)
+static void TestAssign()
+{
+  TestDisk d("test_cache_assign",2000);
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  VALUE_T value(VALUESIZE);
+  SIZE_T superblock;
+  unsigned long i;
+
+  CHECK_RC(index.SetNodeCache(BTREE_CACHE_LRU,100),ERROR_NOERROR);
+  CHECK_RC(index.SetWriteBack(true),ERROR_NOERROR);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<1000;i++) {
+    CHECK_RC(index.Insert(TestBlock(i,KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+  }
+  CHECK(index.GetCacheStats().dirty>0);
+
+  index=BTreeIndex(0,0,d.cache);
+  CHECK(index.GetCacheStats().resident==0 && index.GetCacheStats().dirty==0);
+  CHECK_RC(index.Attach(0,false),ERROR_NOERROR);
+  for (i=0;i<1000;i++) {
+    CHECK_RC(index.Lookup(TestBlock(i,KEYSIZE),value),ERROR_NOERROR);
+  }
+  CHECK_RC(index.Detach(superblock),ERROR_NOERROR);
+}
+
+int main(int argc, char *argv[])
+{
+  TestPolicy("test_cache_off",BTREE_CACHE_OFF,0);
+  TestPolicy("test_cache_lru",BTREE_CACHE_LRU,16);
+  TestPolicy("test_cache_2q",BTREE_CACHE_2Q,16);
+  TestPolicy("test_cache_pinned_only",BTREE_CACHE_2Q,0);
+  TestPinBudget("test_cache_pin_lru",BTREE_CACHE_LRU,4,false);
+  TestPinBudget("test_cache_pin_2q",BTREE_CACHE_2Q,4,false);
+  TestPinBudget("test_cache_pin_writeback",BTREE_CACHE_2Q,4,true);
+  TestPinBudget("test_cache_pin_none",BTREE_CACHE_LRU,0,true);
+  TestAssign();
+
+  TestSplitNoSpace("test_cache_nospace",false);
+  TestSplitNoSpace("test_cache_nospace_writeback",true);
+  return TestSummary(argv[0]);
+}
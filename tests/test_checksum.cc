@@ -0,0 +1,221 @@
+//
+// Block checksums: a block changed behind the index's back fails its
+// read with ERROR_CHECKSUM and bumps the failure counter, instead of
+// giving wrong answers or ERROR_INSANE further down.
+//
+#include <vector>
+
+#include "btree_test.h"
+
+#define KEYSIZE 8
+#define VALUESIZE 8
+#define NUMKEYS 2000
+
+static SIZE_T Build(TestDisk &d, const bool compressed, const bool writeback)
+{
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  SIZE_T superblock;
+  unsigned long i;
+
+  index.SetLeafCompression(compressed);
+  CHECK_RC(index.SetWriteBack(writeback),ERROR_NOERROR);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<NUMKEYS;i++) {
+    CHECK_RC(index.Insert(TestBlock(i*7919%NUMKEYS,KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+  }
+  for (i=0;i<NUMKEYS;i+=3) {
+    CHECK_RC(index.Update(TestBlock(i,KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+  }
+  CHECK_RC(index.Detach(superblock),ERROR_NOERROR);
+  return superblock;
+}
+
+// Flip a byte in the middle of block n, as a torn write would
+static void Corrupt(TestDisk &d, const SIZE_T n)
+{
+  Block raw;
+
+  CHECK_RC(d.cache->ReadBlock(n,raw),ERROR_NOERROR);
+  raw.data[raw.length/2]^=0x5a;
+  CHECK_RC(d.cache->WriteBlock(n,raw),ERROR_NOERROR);
+}
+
+// The first block holding a leaf with keys in it
+static SIZE_T FindLeaf(TestDisk &d)
+{
+  BTreeNode node;
+  SIZE_T n;
+
+  for (n=1;n<d.cache->GetNumBlocks();n++) {
+    if (node.Unserialize(d.cache,n)==ERROR_NOERROR
+	&& node.info.nodetype==BTREE_LEAF_NODE && node.info.numkeys>0) {
+      return n;
+    }
+  }
+  return 0;
+}
+
+// Every block the index wrote carries a good sum, however it was
+// written
+static void TestClean(const char *name, const bool compressed, const bool writeback)
+{
+  TestDisk d(name,2000);
+  SIZE_T superblock = Build(d,compressed,writeback);
+  BTreeIndex index(0,0,d.cache);
+  VALUE_T value(VALUESIZE);
+  unsigned long i;
+
+  CHECK_RC(index.SetNodeCache(BTREE_CACHE_OFF,0),ERROR_NOERROR);
+  CHECK_RC(index.Attach(superblock,false),ERROR_NOERROR);
+  for (i=0;i<NUMKEYS;i++) {
+    CHECK_RC(index.Lookup(TestBlock(i,KEYSIZE),value),ERROR_NOERROR);
+  }
+  CHECK(index.GetChecksumFailures()==0);
+}
+
+static void TestLeaf()
+{
+  TestDisk d("test_checksum_leaf",2000);
+  SIZE_T superblock = Build(d,false,false);
+  SIZE_T leaf = FindLeaf(d);
+  VALUE_T value(VALUESIZE);
+  KEY_T bad(KEYSIZE);
+  std::vector<KEY_T> keys;
+  std::vector<VALUE_T> values;
+  std::vector<ERROR_T> rcs;
+  SIZE_T failed = 0;
+  unsigned long i;
+  ERROR_T rc;
+
+  CHECK(leaf!=0);
+  Corrupt(d,leaf);
+
+  BTreeIndex index(0,0,d.cache);
+  CHECK_RC(index.SetNodeCache(BTREE_CACHE_OFF,0),ERROR_NOERROR);
+  CHECK_RC(index.Attach(superblock,false),ERROR_NOERROR);
+  for (i=0;i<NUMKEYS;i++) {
+    rc=index.Lookup(TestBlock(i,KEYSIZE),value);
+    if (rc==ERROR_CHECKSUM) {
+      bad=TestBlock(i,KEYSIZE);
+      failed++;
+    } else {
+      CHECK_RC(rc,ERROR_NOERROR);
+    }
+    keys.push_back(TestBlock(i,KEYSIZE));
+  }
+  CHECK(failed>0 && failed<NUMKEYS);
+  CHECK(index.GetChecksumFailures()==failed);
+
+  // Writes through the bad leaf fail the same way
+  CHECK_RC(index.Update(bad,value),ERROR_CHECKSUM);
+  CHECK_RC(index.Insert(bad,value),ERROR_CHECKSUM);
+  CHECK_RC(index.LookupBatch(keys,values,rcs),ERROR_CHECKSUM);
+
+  // Unchecked, the same reads go through
+  BTreeIndex unchecked(0,0,d.cache);
+  CHECK_RC(unchecked.SetNodeCache(BTREE_CACHE_OFF,0),ERROR_NOERROR);
+  unchecked.SetVerifyChecksums(false);
+  CHECK_RC(unchecked.Attach(superblock,false),ERROR_NOERROR);
+  for (i=0;i<NUMKEYS;i++) {
+    CHECK(unchecked.Lookup(TestBlock(i,KEYSIZE),value)!=ERROR_CHECKSUM);
+  }
+  CHECK(unchecked.GetChecksumFailures()==0);
+}
+
+static void TestSuperblock()
+{
+  TestDisk d("test_checksum_superblock",2000);
+  SIZE_T superblock = Build(d,false,false);
+  BTreeIndex index(0,0,d.cache);
+
+  Corrupt(d,superblock);
+  CHECK_RC(index.Attach(superblock,false),ERROR_CHECKSUM);
+  CHECK(index.GetChecksumFailures()==1);
+}
+
+// An index from before there were checksums has no sums to check:
+// its superblock lacks the flag, and its blocks end in whatever was
+// there
+static void TestUnflagged()
+{
+  TestDisk d("test_checksum_unflagged",2000);
+  SIZE_T superblock = Build(d,false,false);
+  SIZE_T leaf = FindLeaf(d);
+  VALUE_T value(VALUESIZE);
+  BTreeNode node;
+  Block raw;
+  uint32_t flags;
+  unsigned long i;
+
+  CHECK_RC(node.Unserialize(d.cache,superblock),ERROR_NOERROR);
+  memcpy(&flags,node.data,sizeof(flags));
+  CHECK(flags & BTREE_FLAG_CHECKSUMS);
+  flags&=~BTREE_FLAG_CHECKSUMS;
+  memcpy(node.data,&flags,sizeof(flags));
+  CHECK_RC(node.Serialize(d.cache,superblock),ERROR_NOERROR);
+  CHECK_RC(d.cache->ReadBlock(leaf,raw),ERROR_NOERROR);
+  memset(raw.data+raw.length-BTREE_CHECKSUM_BYTES,0,BTREE_CHECKSUM_BYTES);
+  CHECK_RC(d.cache->WriteBlock(leaf,raw),ERROR_NOERROR);
+
+  BTreeIndex index(0,0,d.cache);
+  CHECK_RC(index.SetNodeCache(BTREE_CACHE_OFF,0),ERROR_NOERROR);
+  CHECK_RC(index.Attach(superblock,false),ERROR_NOERROR);
+  for (i=0;i<NUMKEYS;i++) {
+    CHECK_RC(index.Lookup(TestBlock(i,KEYSIZE),value),ERROR_NOERROR);
+  }
+  CHECK(index.GetChecksumFailures()==0);
+}
+
+// Only block 0 can hold a superblock, and only a superblock will do
+static void TestNotAnIndex()
+{
+  TestDisk d("test_checksum_notanindex",2000);
+  BTreeIndex index(0,0,d.cache);
+  BTreeNode node;
+
+  CHECK_RC(index.Attach(0,false),ERROR_NOTANINDEX);
+  Build(d,false,false);
+  CHECK_RC(node.Unserialize(d.cache,0),ERROR_NOERROR);
+  CHECK_RC(index.Attach(node.info.rootnode,false),ERROR_NOTANINDEX);
+  CHECK_RC(index.Attach(0,false),ERROR_NOERROR);
+  CHECK(index.GetChecksumFailures()==0);
+}
+
+// A free block that was overwritten is not handed out: the insert
+// that needs it fails, and the index is not changed
+static void TestFreeBlock()
+{
+  TestDisk d("test_checksum_free",2000);
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  VALUE_T value(VALUESIZE);
+  BTreeNode node;
+
+  CHECK_RC(index.SetNodeCache(BTREE_CACHE_OFF,0),ERROR_NOERROR);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  CHECK_RC(node.Unserialize(d.cache,0),ERROR_NOERROR);
+  SIZE_T head = node.info.freelist;
+  CHECK_RC(node.Unserialize(d.cache,head),ERROR_NOERROR);
+  CHECK(node.info.nodetype==BTREE_UNALLOCATED_BLOCK);
+  node.info.nodetype=BTREE_LEAF_NODE;
+  CHECK_RC(node.Serialize(d.cache,head),ERROR_NOERROR);
+
+  CHECK_RC(index.Insert(TestBlock(1,KEYSIZE),TestBlock(1,VALUESIZE)),ERROR_CHECKSUM);
+  CHECK(index.GetChecksumFailures()==1);
+  CHECK_RC(index.Lookup(TestBlock(1,KEYSIZE),value),ERROR_NONEXISTENT);
+  CHECK_RC(node.Unserialize(d.cache,0),ERROR_NOERROR);
+  CHECK(node.info.freelist==head);
+}
+
+int main(int argc, char *argv[])
+{
+  TestClean("test_checksum",false,false);
+  TestClean("test_checksum_writeback",false,true);
+  TestClean("test_checksum_compressed",true,false);
+  TestClean("test_checksum_compressed_writeback",true,true);
+  TestLeaf();
+  TestSuperblock();
+  TestUnflagged();
+  TestNotAnIndex();
+  TestFreeBlock();
+  return TestSummary(argv[0]);
+}
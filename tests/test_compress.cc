@@ -0,0 +1,155 @@
+//
+// Compressed leaves: the same answers in fewer blocks, for keys that
+// pack well and keys that don't, and the mode sticks to the index.
+//
+#include <map>
+
+#include "btree_test.h"
+
+#define KEYSIZE 8
+#define VALUESIZE 8
+
+typedef std::map<unsigned long, unsigned long> Contents;
+
+// Scrambled 64-bit keys, whose deltas do not pack
+static unsigned long Scramble(unsigned long x)
+{
+  x^=x>>31;
+  x*=0x7fb5d329728ea185UL;
+  x^=x>>27;
+  x*=0x81dadef4bc2dd44dUL;
+  x^=x>>33;
+  return x;
+}
+
+// Tree nodes on the disk, by reading every block
+static SIZE_T NodeBlocks(TestDisk &d)
+{
+  BTreeNode node;
+  SIZE_T n;
+  SIZE_T count = 0;
+
+  for (n=0;n<d.cache->GetNumBlocks();n++) {
+    if (node.Unserialize(d.cache,n)==ERROR_NOERROR
+	&& (node.info.nodetype==BTREE_LEAF_NODE
+	    || node.info.nodetype==BTREE_COMPRESSED_LEAF_NODE
+	    || node.info.nodetype==BTREE_INTERIOR_NODE
+	    || node.info.nodetype==BTREE_ROOT_NODE)) {
+      count++;
+    }
+  }
+  return count;
+}
+
+static void Fill(TestDisk &d, const bool compressed, const bool scrambled,
+		 const bool writeback, Contents &ref, SIZE_T &superblock)
+{
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  VALUE_T value(VALUESIZE);
+  unsigned long i;
+
+  index.SetLeafCompression(compressed);
+  CHECK_RC(index.SetNodeCache(BTREE_CACHE_LRU,8),ERROR_NOERROR);
+  CHECK_RC(index.SetWriteBack(writeback),ERROR_NOERROR);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<5000;i++) {
+    unsigned long k = scrambled ? Scramble(i) : i*7919%5000;
+    CHECK_RC(index.Insert(TestBlock(k,KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+    ref[k]=i;
+  }
+  // updates that widen the values, so leaves can stop fitting
+  for (Contents::iterator it=ref.begin(); it!=ref.end(); ++it) {
+    if (it->second%4==0) {
+      it->second=Scramble(it->second);
+      CHECK_RC(index.Update(TestBlock(it->first,KEYSIZE),TestBlock(it->second,VALUESIZE)),ERROR_NOERROR);
+    }
+  }
+  for (Contents::const_iterator it=ref.begin(); it!=ref.end(); ++it) {
+    CHECK_RC(index.Lookup(TestBlock(it->first,KEYSIZE),value),ERROR_NOERROR);
+    CHECK(SameBlock(value,TestBlock(it->second,VALUESIZE)));
+  }
+  if (compressed && !scrambled) {
+    CHECK(index.GetCompressionRatio()>2.0);
+  }
+  if (!compressed) {
+    CHECK(index.GetCompressionRatio()==1.0);
+  }
+  CHECK_RC(index.Detach(superblock),ERROR_NOERROR);
+}
+
+static void TestKeys(const char *name, const bool scrambled, const bool writeback)
+{
+  TestDisk plain("test_compress_plain",4000);
+  TestDisk d(name,4000);
+  Contents ref;
+  Contents plainref;
+  VALUE_T value(VALUESIZE);
+  SIZE_T superblock;
+
+  Fill(plain,false,scrambled,writeback,plainref,superblock);
+  Fill(d,true,scrambled,writeback,ref,superblock);
+  if (!scrambled) {
+    CHECK(NodeBlocks(d)*2<NodeBlocks(plain));
+  }
+
+  // Reattached without asking for compression, it is still compressed
+  BTreeIndex again(0,0,d.cache);
+  again.SetLeafCompression(false);
+  CHECK_RC(again.Attach(superblock,false),ERROR_NOERROR);
+  for (Contents::const_iterator it=ref.begin(); it!=ref.end(); ++it) {
+    CHECK_RC(again.Lookup(TestBlock(it->first,KEYSIZE),value),ERROR_NOERROR);
+    CHECK(SameBlock(value,TestBlock(it->second,VALUESIZE)));
+  }
+  CHECK_RC(again.Insert(TestBlock(1UL<<40,KEYSIZE),value),ERROR_NOERROR);
+  CHECK_RC(again.Checkpoint(),ERROR_NOERROR);
+  bool anycompressed = false;
+  BTreeNode node;
+  for (SIZE_T n=0;n<d.cache->GetNumBlocks();n++) {
+    if (node.Unserialize(d.cache,n)==ERROR_NOERROR
+	&& node.info.nodetype==BTREE_COMPRESSED_LEAF_NODE) {
+      anycompressed=true;
+    }
+  }
+  CHECK(anycompressed);
+}
+
+// Out of blocks: what was acknowledged is still found
+static void TestNoSpace()
+{
+  TestDisk d("test_compress_nospace",30);
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  Contents ref;
+  VALUE_T value(VALUESIZE);
+  unsigned long i;
+  int failures = 0;
+  ERROR_T rc;
+
+  index.SetLeafCompression(true);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<100000 && failures<20;i++) {
+    unsigned long k = i*7919%100000;
+    rc=index.Insert(TestBlock(k,KEYSIZE),TestBlock(i,VALUESIZE));
+    if (rc==ERROR_NOERROR) {
+      ref[k]=i;
+    } else {
+      CHECK_RC(rc,ERROR_NOSPACE);
+      CHECK_RC(index.Lookup(TestBlock(k,KEYSIZE),value),ERROR_NONEXISTENT);
+      failures++;
+    }
+  }
+  CHECK(failures==20);
+  CHECK(ref.size()>100);
+  for (Contents::const_iterator it=ref.begin(); it!=ref.end(); ++it) {
+    CHECK_RC(index.Lookup(TestBlock(it->first,KEYSIZE),value),ERROR_NOERROR);
+    CHECK(SameBlock(value,TestBlock(it->second,VALUESIZE)));
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  TestKeys("test_compress",false,false);
+  TestKeys("test_compress_writeback",false,true);
+  TestKeys("test_compress_scrambled",true,false);
+  TestNoSpace();
+  return TestSummary(argv[0]);
+}
@@ -0,0 +1,145 @@
+//
+// Key filter: negative lookups, persistence, and crash recovery.  The
+// filter may never hide a key that a lookup without it would find.
+//
+#include <vector>
+
+#include "btree_test.h"
+
+#define KEYSIZE 8
+#define VALUESIZE 8
+
+static void Fill(BTreeIndex &index, const unsigned long from, const unsigned long to)
+{
+  for (unsigned long i=from;i<to;i++) {
+    CHECK_RC(index.Insert(TestBlock(i*2,KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+  }
+}
+
+static void TestNegatives()
+{
+  TestDisk d("test_filter_negatives",2000);
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  BTreeFilterStats stats;
+  VALUE_T value(VALUESIZE);
+  SIZE_T superblock;
+  unsigned long i;
+
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  Fill(index,0,1000);
+  CHECK_RC(index.BuildKeyFilter(2000,10),ERROR_NOERROR);
+
+  // odd keys are all absent
+  for (i=0;i<1000;i++) {
+    CHECK_RC(index.Lookup(TestBlock(i*2+1,KEYSIZE),value),ERROR_NONEXISTENT);
+    CHECK_RC(index.Update(TestBlock(i*2+1,KEYSIZE),value),ERROR_NONEXISTENT);
+    CHECK_RC(index.Lookup(TestBlock(i*2,KEYSIZE),value),ERROR_NOERROR);
+  }
+  index.GetKeyFilterStats(stats);
+  CHECK(stats.bits>0 && stats.blocks>0);
+  CHECK(stats.negatives>1800);
+  CHECK(stats.observedrate<0.05);
+
+  // inserts keep it complete, and the duplicate check still works
+  Fill(index,1000,1500);
+  CHECK_RC(index.Insert(TestBlock(2,KEYSIZE),value),ERROR_CONFLICT);
+
+  CHECK_RC(index.Detach(superblock),ERROR_NOERROR);
+  BTreeIndex again(0,0,d.cache);
+  CHECK_RC(again.Attach(superblock,false),ERROR_NOERROR);
+  again.GetKeyFilterStats(stats);
+  CHECK(stats.bits>0);
+  for (i=0;i<1500;i++) {
+    CHECK_RC(again.Lookup(TestBlock(i*2,KEYSIZE),value),ERROR_NOERROR);
+  }
+  CHECK_RC(again.RebuildKeyFilter(),ERROR_NOERROR);
+  CHECK_RC(again.DropKeyFilter(),ERROR_NOERROR);
+  again.GetKeyFilterStats(stats);
+  CHECK(stats.bits==0 && stats.blocks==0);
+  for (i=0;i<1500;i++) {
+    CHECK_RC(again.Lookup(TestBlock(i*2,KEYSIZE),value),ERROR_NOERROR);
+  }
+  CHECK_RC(again.Detach(superblock),ERROR_NOERROR);
+}
+
+//
+// Keys inserted after the filter was stored, then a crash.  Whatever
+// of them reached the disk has to be found through the filter the
+// next Attach loads, just as it is found without one.
+//
+static void TestCrash(const char *name, const bool writeback)
+{
+  TestDisk d(name,2000);
+  BTreeIndex *index = new BTreeIndex(KEYSIZE,VALUESIZE,d.cache);
+  std::vector<ERROR_T> withfilter;
+  VALUE_T value(VALUESIZE);
+  unsigned long i;
+
+  // a small leaf cache, so write-back evicts dirty leaves
+  CHECK_RC(index->SetNodeCache(BTREE_CACHE_LRU,4),ERROR_NOERROR);
+  CHECK_RC(index->SetWriteBack(writeback),ERROR_NOERROR);
+  CHECK_RC(index->Attach(0,true),ERROR_NOERROR);
+  Fill(*index,0,2000);
+  CHECK_RC(index->BuildKeyFilter(4000,10),ERROR_NOERROR);
+  CHECK_RC(index->Checkpoint(),ERROR_NOERROR);
+
+  // odd keys, at most one to a leaf, so no leaf splits: the crash
+  // only loses deferred writes
+  for (i=0;i<40;i++) {
+    CHECK_RC(index->Insert(TestBlock((i*17%40)*100+1,KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+  }
+  // crash: index is dropped without Detach or its destructor
+
+  BTreeIndex after(0,0,d.cache);
+  CHECK_RC(after.Attach(0,false),ERROR_NOERROR);
+  for (i=0;i<40;i++) {
+    withfilter.push_back(after.Lookup(TestBlock((i*17%40)*100+1,KEYSIZE),value));
+  }
+  CHECK_RC(after.DropKeyFilter(),ERROR_NOERROR);
+  for (i=0;i<40;i++) {
+    // Without a checkpoint a write-back index comes back with only
+    // the leaves that were evicted, but never with a key in them
+    // that the filter hides
+    if (after.Lookup(TestBlock((i*17%40)*100+1,KEYSIZE),value)==ERROR_NOERROR) {
+      CHECK(withfilter[i]==ERROR_NOERROR);
+    }
+  }
+  if (!writeback) {
+    // written through, so every one of them is there
+    for (i=0;i<40;i++) {
+      CHECK(withfilter[i]==ERROR_NOERROR);
+    }
+  }
+}
+
+// Small blocks, so interior nodes split again and again: rebuilding
+// the filter walks every pointer of every one of them
+static void TestDeepRebuild()
+{
+  TestDisk d("test_filter_deep",3000,256);
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  BTreeFilterStats stats;
+  VALUE_T value(VALUESIZE);
+  unsigned long i;
+
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<4000;i++) {
+    CHECK_RC(index.Insert(TestBlock(i*7919%4000*2,KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+  }
+  CHECK_RC(index.BuildKeyFilter(4000,10),ERROR_NOERROR);
+  index.GetKeyFilterStats(stats);
+  CHECK(stats.keys==4000);
+  CHECK_RC(index.RebuildKeyFilter(),ERROR_NOERROR);
+  for (i=0;i<4000;i++) {
+    CHECK_RC(index.Lookup(TestBlock(i*2,KEYSIZE),value),ERROR_NOERROR);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  TestNegatives();
+  TestDeepRebuild();
+  TestCrash("test_filter_crash",false);
+  TestCrash("test_filter_crash_writeback",true);
+  return TestSummary(argv[0]);
+}
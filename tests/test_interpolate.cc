@@ -0,0 +1,127 @@
+//
+// Interpolation search: on any key distribution it routes every key
+// to the same child bisection does, so an index answers the same and
+// reads the same nodes with it on or off.  Large blocks, so interior
+// nodes are well past the size where it kicks in.
+//
+#include <set>
+#include <vector>
+
+#include "btree_test.h"
+
+#define VALUESIZE 8
+
+enum Distribution {UNIFORM, CUBIC, BANDS, SHARED_PREFIX, SHORT};
+
+static SIZE_T KeySize(const Distribution dist)
+{
+  switch (dist) {
+  case SHARED_PREFIX:
+    return 16;   // the first 8 bytes are always zero
+  case SHORT:
+    return 2;
+  default:
+    return 8;
+  }
+}
+
+static std::vector<unsigned long> Keys(const Distribution dist, const unsigned long n)
+{
+  std::set<unsigned long> keys;
+  unsigned long i;
+
+  for (i=0;keys.size()<n;i++) {
+    switch (dist) {
+    case UNIFORM:
+    case SHARED_PREFIX:
+      keys.insert(i*3);
+      break;
+    case SHORT:
+      keys.insert(i*2%65536);
+      break;
+    case CUBIC:
+      keys.insert(i*i*i);
+      break;
+    case BANDS:
+      // dense runs far apart, nothing like a line
+      keys.insert((1UL<<(i%60))+i/60);
+      break;
+    }
+  }
+  return std::vector<unsigned long>(keys.begin(),keys.end());
+}
+
+static void TestDistribution(const char *name, const Distribution dist)
+{
+  const SIZE_T keysize = KeySize(dist);
+  const unsigned long n = dist==SHORT ? 20000 : 30000;
+  std::vector<unsigned long> keys = Keys(dist,n);
+  TestDisk bd("test_interpolate_bisect",4000,4096);
+  TestDisk id(name,4000,4096);
+  BTreeIndex bisect(keysize,VALUESIZE,bd.cache);
+  BTreeIndex interp(keysize,VALUESIZE,id.cache);
+  VALUE_T bvalue(VALUESIZE);
+  VALUE_T ivalue(VALUESIZE);
+  SIZE_T breads, ireads;
+  unsigned long i;
+
+  CHECK_RC(bisect.SetNodeCache(BTREE_CACHE_OFF,0),ERROR_NOERROR);
+  CHECK_RC(interp.SetNodeCache(BTREE_CACHE_OFF,0),ERROR_NOERROR);
+  interp.SetInterpolationSearch(true);
+  CHECK_RC(bisect.Attach(0,true),ERROR_NOERROR);
+  CHECK_RC(interp.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<keys.size();i++) {
+    unsigned long k = keys[i*7919%keys.size()];
+    CHECK_RC(bisect.Insert(TestBlock(k,keysize),TestBlock(k,VALUESIZE)),ERROR_NOERROR);
+    CHECK_RC(interp.Insert(TestBlock(k,keysize),TestBlock(k,VALUESIZE)),ERROR_NOERROR);
+  }
+
+  // every key, and the one just past each, present or not
+  breads=bisect.GetNodeReads();
+  ireads=interp.GetNodeReads();
+  for (i=0;i<keys.size();i++) {
+    unsigned long k;
+    for (k=keys[i];k<=keys[i]+1;k++) {
+      ERROR_T rc = interp.Lookup(TestBlock(k,keysize),ivalue);
+      CHECK_RC(rc,bisect.Lookup(TestBlock(k,keysize),bvalue));
+      if (rc==ERROR_NOERROR) {
+	CHECK(SameBlock(ivalue,TestBlock(k,VALUESIZE)));
+      }
+    }
+  }
+  // the same descents, node for node
+  CHECK(interp.GetNodeReads()-ireads==bisect.GetNodeReads()-breads);
+}
+
+// Same answers through the upsert path, which routes with the same
+// search
+static void TestUpserts()
+{
+  TestDisk d("test_interpolate_upsert",4000,4096);
+  BTreeIndex index(8,VALUESIZE,d.cache);
+  VALUE_T value(VALUESIZE);
+  unsigned long i;
+
+  index.SetInterpolationSearch(true);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<20000;i++) {
+    unsigned long k = (1UL<<(i%50))+i/50;
+    CHECK_RC(index.Upsert(TestBlock(k,8),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+  }
+  for (i=0;i<20000;i++) {
+    unsigned long k = (1UL<<(i%50))+i/50;
+    CHECK_RC(index.Lookup(TestBlock(k,8),value),ERROR_NOERROR);
+  }
+  CHECK_RC(index.Lookup(TestBlock(3UL<<50,8),value),ERROR_NONEXISTENT);
+}
+
+int main(int argc, char *argv[])
+{
+  TestDistribution("test_interpolate_uniform",UNIFORM);
+  TestDistribution("test_interpolate_cubic",CUBIC);
+  TestDistribution("test_interpolate_bands",BANDS);
+  TestDistribution("test_interpolate_prefix",SHARED_PREFIX);
+  TestDistribution("test_interpolate_short",SHORT);
+  TestUpserts();
+  return TestSummary(argv[0]);
+}
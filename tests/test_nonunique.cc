@@ -0,0 +1,133 @@
+//
+// Non-unique indexes: posting lists, their iterator, and key/value
+// sizes other than 8/8, where the posting list head makes each leaf
+// entry bigger than the keys and values alone.
+//
+#include <map>
+#include <set>
+#include <string>
+
+#include "btree_test.h"
+
+typedef std::map<unsigned long, std::set<std::string> > Postings;
+
+static std::string Bytes(const Block &b)
+{
+  return std::string(b.data,b.length);
+}
+
+// Every key's values come back through LookupAll in byte order, and
+// Lookup returns the smallest
+static void CheckPostings(BTreeIndex &index, const Postings &ref,
+			  const SIZE_T keysize, const SIZE_T valuesize)
+{
+  for (Postings::const_iterator it=ref.begin(); it!=ref.end(); ++it) {
+    BTreePostingIterator values;
+    VALUE_T value(valuesize);
+    std::set<std::string>::const_iterator want=it->second.begin();
+    ERROR_T rc;
+
+    CHECK_RC(index.LookupAll(TestBlock(it->first,keysize),values),ERROR_NOERROR);
+    while ((rc=values.Next(value))==ERROR_NOERROR) {
+      CHECK(want!=it->second.end() && Bytes(value)==*want);
+      if (want!=it->second.end()) {
+	++want;
+      }
+    }
+    CHECK(rc==ERROR_NONEXISTENT);
+    CHECK(want==it->second.end());
+
+    CHECK_RC(index.Lookup(TestBlock(it->first,keysize),value),ERROR_NOERROR);
+    CHECK(Bytes(value)==*it->second.begin());
+  }
+}
+
+static void TestSizes(const char *name, const SIZE_T keysize, const SIZE_T valuesize,
+		      const unsigned long keys, const int inserts)
+{
+  TestDisk d(name,4000);
+  BTreeIndex index(keysize,valuesize,d.cache,false);
+  Postings ref;
+  SIZE_T superblock;
+  int i;
+
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+
+  srand(1);
+  for (i=0;i<inserts;i++) {
+    unsigned long k = rand()%keys;
+    unsigned long v = rand()%100000;
+    bool fresh = ref[k].insert(Bytes(TestBlock(v,valuesize))).second;
+    CHECK_RC(index.Insert(TestBlock(k,keysize),TestBlock(v,valuesize)),
+	     fresh ? ERROR_NOERROR : ERROR_CONFLICT);
+  }
+  CheckPostings(index,ref,keysize,valuesize);
+
+  // wrong sizes, and absent keys
+  CHECK_RC(index.Insert(TestBlock(1,keysize),TestBlock(1,valuesize+1)),ERROR_SIZE);
+  BTreePostingIterator none;
+  CHECK_RC(index.LookupAll(TestBlock(keys+1,keysize),none),ERROR_NONEXISTENT);
+
+  // Update only applies to keys with a single value
+  for (Postings::iterator it=ref.begin(); it!=ref.end(); ++it) {
+    if (it->second.size()==1) {
+      CHECK_RC(index.Update(TestBlock(it->first,keysize),TestBlock(7,valuesize)),ERROR_NOERROR);
+      it->second.clear();
+      it->second.insert(Bytes(TestBlock(7,valuesize)));
+    } else {
+      CHECK_RC(index.Update(TestBlock(it->first,keysize),TestBlock(7,valuesize)),ERROR_CONFLICT);
+    }
+  }
+  CheckPostings(index,ref,keysize,valuesize);
+
+  CHECK_RC(index.Detach(superblock),ERROR_NOERROR);
+  BTreeIndex again(0,0,d.cache);
+  CHECK_RC(again.Attach(superblock,false),ERROR_NOERROR);
+  CheckPostings(again,ref,keysize,valuesize);
+  CHECK_RC(again.Detach(superblock),ERROR_NOERROR);
+}
+
+// Many distinct keys with one value each fill the leaves, which must
+// split before the bigger entries overrun them
+static void TestManyKeys(const char *name, const SIZE_T keysize, const SIZE_T valuesize,
+			 const bool unique)
+{
+  TestDisk d(name,4000);
+  BTreeIndex index(keysize,valuesize,d.cache,unique);
+  VALUE_T value(valuesize);
+  unsigned long i;
+
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<2000;i++) {
+    CHECK_RC(index.Insert(TestBlock(i*13%2000,keysize),TestBlock(i,valuesize)),ERROR_NOERROR);
+  }
+  for (i=0;i<2000;i++) {
+    CHECK_RC(index.Lookup(TestBlock(i*13%2000,keysize),value),ERROR_NOERROR);
+    CHECK(SameBlock(value,TestBlock(i,valuesize)));
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  TestSizes("test_nonunique_8_8",8,8,50,3000);
+  TestSizes("test_nonunique_8_12",8,12,300,3000);
+  TestSizes("test_nonunique_6_20",6,20,40,5000);
+  TestSizes("test_nonunique_24_4",24,4,500,2000);
+
+  TestManyKeys("test_nonunique_many_8_12",8,12,false);
+  TestManyKeys("test_unique_many_8_12",8,12,true);
+  TestManyKeys("test_nonunique_many_4_40",4,40,false);
+  TestManyKeys("test_unique_many_8_64",8,64,true);
+
+  // entries too big for three to a node, and values too big for a
+  // posting block to hold two
+  {
+    TestDisk d("test_nonunique_toobig",100);
+    BTreeIndex big(8,400,d.cache,false);
+    CHECK_RC(big.Attach(0,true),ERROR_SIZE);
+    BTreeIndex unique(8,400,d.cache,true);
+    CHECK_RC(unique.Attach(0,true),ERROR_SIZE);
+  }
+
+  return TestSummary(argv[0]);
+}
@@ -0,0 +1,200 @@
+//
+// Partitioned index: every key lives in the one partition PartitionOf
+// names, the parallel batches give what the single-key operations
+// would, and bad bounds or a bad partition are reported.
+//
+#include <vector>
+
+#include "btree_test.h"
+
+#define KEYSIZE 8
+#define VALUESIZE 8
+#define PARTS 4
+
+// One disk per partition
+class TestDisks {
+ public:
+  std::vector<TestDisk *> disks;
+  std::vector<BufferCache *> caches;
+
+  TestDisks(const char *name) {
+    char n[256];
+    for (int i=0;i<PARTS;i++) {
+      snprintf(n,sizeof(n),"%s_%d",name,i);
+      disks.push_back(new TestDisk(n,2000));
+      caches.push_back(disks.back()->cache);
+    }
+  }
+  ~TestDisks() {
+    for (SIZE_T i=0;i<disks.size();i++) {
+      delete disks[i];
+    }
+  }
+};
+
+static std::vector<KEY_T> RangeBounds()
+{
+  std::vector<KEY_T> bounds;
+
+  for (int i=1;i<PARTS;i++) {
+    bounds.push_back(TestBlock(i*2000-1,KEYSIZE));
+  }
+  return bounds;
+}
+
+static void TestScheme(const char *name, const BTreePartitioning scheme, const unsigned int threads)
+{
+  TestDisks d(name);
+  std::vector<KEY_T> keys;
+  std::vector<VALUE_T> values;
+  std::vector<VALUE_T> out;
+  std::vector<ERROR_T> rcs;
+  VALUE_T value(VALUESIZE);
+  SIZE_T counts[PARTS] = {0};
+  unsigned long i;
+  SIZE_T p;
+  const unsigned long n = 8000;
+
+  {
+    BTreePartitionedIndex index(KEYSIZE,VALUESIZE,d.caches,scheme);
+    if (scheme==BTREE_PARTITION_RANGE) {
+      CHECK_RC(index.SetRangeBounds(RangeBounds()),ERROR_NOERROR);
+    }
+    index.SetThreads(threads);
+    CHECK_RC(index.Attach(true),ERROR_NOERROR);
+
+    // even keys, and the first one again at the end
+    for (i=0;i<n/2;i++) {
+      keys.push_back(TestBlock(i*7919%(n/2)*2,KEYSIZE));
+      values.push_back(TestBlock(i,VALUESIZE));
+    }
+    keys.push_back(keys[0]);
+    values.push_back(values[0]);
+    CHECK_RC(index.InsertBatch(keys,values,rcs),ERROR_NOERROR);
+    for (i=0;i<n/2;i++) {
+      CHECK_RC(rcs[i],ERROR_NOERROR);
+    }
+    CHECK_RC(rcs[n/2],ERROR_CONFLICT);
+    keys.pop_back();
+    values.pop_back();
+
+    // each key is in its own partition and no other
+    for (i=0;i<keys.size();i++) {
+      p=index.PartitionOf(keys[i]);
+      CHECK(p<PARTS);
+      counts[p]++;
+      CHECK_RC(index.Partition(p).Lookup(keys[i],value),ERROR_NOERROR);
+      CHECK_RC(index.Partition((p+1)%PARTS).Lookup(keys[i],value),ERROR_NONEXISTENT);
+    }
+    for (p=0;p<PARTS;p++) {
+      CHECK(counts[p]>n/2/PARTS/2 && counts[p]<n/2/PARTS*2);
+    }
+
+    // updates of every key, odd ones missing
+    keys.clear();
+    values.clear();
+    for (i=0;i<n;i++) {
+      keys.push_back(TestBlock(i,KEYSIZE));
+      values.push_back(TestBlock(i+1,VALUESIZE));
+    }
+    CHECK_RC(index.UpdateBatch(keys,values,rcs),ERROR_NOERROR);
+    for (i=0;i<n;i++) {
+      CHECK_RC(rcs[i],i%2 ? ERROR_NONEXISTENT : ERROR_NOERROR);
+    }
+    values.pop_back();
+    CHECK_RC(index.UpdateBatch(keys,values,rcs),ERROR_SIZE);
+    CHECK_RC(index.Detach(),ERROR_NOERROR);
+  }
+
+  BTreePartitionedIndex again(KEYSIZE,VALUESIZE,d.caches,scheme);
+  if (scheme==BTREE_PARTITION_RANGE) {
+    CHECK_RC(again.SetRangeBounds(RangeBounds()),ERROR_NOERROR);
+  }
+  again.SetThreads(threads);
+  CHECK_RC(again.Attach(false),ERROR_NOERROR);
+  CHECK_RC(again.LookupBatch(keys,out,rcs),ERROR_NOERROR);
+  for (i=0;i<n;i++) {
+    CHECK_RC(rcs[i],i%2 ? ERROR_NONEXISTENT : ERROR_NOERROR);
+    if (i%2==0) {
+      CHECK(SameBlock(out[i],TestBlock(i+1,VALUESIZE)));
+      CHECK_RC(again.Lookup(keys[i],value),ERROR_NOERROR);
+      CHECK(SameBlock(value,out[i]));
+    }
+  }
+  CHECK_RC(again.Detach(),ERROR_NOERROR);
+}
+
+static void TestBounds()
+{
+  TestDisks d("test_partition_bounds");
+  BTreePartitionedIndex index(KEYSIZE,VALUESIZE,d.caches,BTREE_PARTITION_RANGE);
+  std::vector<KEY_T> bounds = RangeBounds();
+
+  CHECK_RC(index.Attach(true),ERROR_SIZE);
+  bounds.pop_back();
+  CHECK_RC(index.SetRangeBounds(bounds),ERROR_SIZE);
+  bounds.push_back(TestBlock(0,KEYSIZE));
+  CHECK_RC(index.SetRangeBounds(bounds),ERROR_INSANE);
+  CHECK_RC(index.SetRangeBounds(RangeBounds()),ERROR_NOERROR);
+  CHECK_RC(index.Attach(true),ERROR_NOERROR);
+  CHECK(index.PartitionOf(TestBlock(0,KEYSIZE))==0);
+  CHECK(index.PartitionOf(TestBlock(1999,KEYSIZE))==0);
+  CHECK(index.PartitionOf(TestBlock(2000,KEYSIZE))==1);
+  CHECK(index.PartitionOf(TestBlock(1000000,KEYSIZE))==PARTS-1);
+  CHECK_RC(index.Detach(),ERROR_NOERROR);
+}
+
+//
+// One partition's disk goes bad under it: a lookup batch fails that
+// partition's keys with the error it hit, and answers the others
+//
+static void TestBadPartition()
+{
+  TestDisks d("test_partition_bad");
+  std::vector<KEY_T> keys;
+  std::vector<VALUE_T> values;
+  std::vector<ERROR_T> rcs;
+  unsigned long i;
+  SIZE_T n;
+
+  {
+    BTreePartitionedIndex index(KEYSIZE,VALUESIZE,d.caches);
+    CHECK_RC(index.Attach(true),ERROR_NOERROR);
+    for (i=0;i<2000;i++) {
+      keys.push_back(TestBlock(i,KEYSIZE));
+      values.push_back(TestBlock(i,VALUESIZE));
+    }
+    CHECK_RC(index.InsertBatch(keys,values,rcs),ERROR_NOERROR);
+    CHECK_RC(index.Detach(),ERROR_NOERROR);
+  }
+
+  // flip a byte in every node of partition 0 but its superblock
+  for (n=1;n<d.caches[0]->GetNumBlocks();n++) {
+    BTreeNode node;
+    Block raw;
+    if (node.Unserialize(d.caches[0],n)==ERROR_NOERROR
+	&& node.info.nodetype!=BTREE_UNALLOCATED_BLOCK) {
+      CHECK_RC(d.caches[0]->ReadBlock(n,raw),ERROR_NOERROR);
+      raw.data[raw.length/2]^=0x5a;
+      CHECK_RC(d.caches[0]->WriteBlock(n,raw),ERROR_NOERROR);
+    }
+  }
+
+  BTreePartitionedIndex index(KEYSIZE,VALUESIZE,d.caches);
+  CHECK_RC(index.Attach(false),ERROR_NOERROR);
+  CHECK_RC(index.LookupBatch(keys,values,rcs),ERROR_NOERROR);
+  for (i=0;i<keys.size();i++) {
+    CHECK_RC(rcs[i],index.PartitionOf(keys[i])==0 ? ERROR_CHECKSUM : ERROR_NOERROR);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  TestScheme("test_partition_hash",BTREE_PARTITION_HASH,PARTS);
+  TestScheme("test_partition_hash_2",BTREE_PARTITION_HASH,2);
+  TestScheme("test_partition_range",BTREE_PARTITION_RANGE,PARTS);
+  TestScheme("test_partition_range_1",BTREE_PARTITION_RANGE,1);
+  TestBounds();
+  TestBadPartition();
+  return TestSummary(argv[0]);
+}
@@ -0,0 +1,85 @@
+//
+// Interior splits.  The key an interior node splits on moves up to
+// the parent and stays in neither half, so every pointer slot of
+// every interior node leads to a subtree, and the keys under slot i
+// lie above key i-1 and at or below key i.
+//
+#include "btree_test.h"
+
+#define KEYSIZE 8
+#define VALUESIZE 8
+#define NUMKEYS 4000
+
+// Check the subtree at n against the bounds (lo,hi], either of which
+// may be 0 for none, and count its keys
+static void Walk(TestDisk &d, const SIZE_T n, const char *lo, const char *hi,
+		 SIZE_T &keys)
+{
+  BTreeNode node;
+  SIZE_T offset;
+  SIZE_T ptr;
+
+  CHECK(n!=0);
+  if (n==0) {
+    return;
+  }
+  CHECK_RC(node.Unserialize(d.cache,n),ERROR_NOERROR);
+  switch (node.info.nodetype) {
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    CHECK(node.info.numkeys>0);
+    for (offset=0;offset<=node.info.numkeys;offset++) {
+      CHECK_RC(node.GetPtr(offset,ptr),ERROR_NOERROR);
+      Walk(d,ptr,
+	   offset>0 ? node.ResolveKey(offset-1) : lo,
+	   offset<node.info.numkeys ? node.ResolveKey(offset) : hi,
+	   keys);
+    }
+    break;
+  case BTREE_LEAF_NODE:
+    for (offset=0;offset<node.info.numkeys;offset++) {
+      const char *k = node.ResolveKey(offset);
+      CHECK(!lo || memcmp(lo,k,KEYSIZE)<0);
+      CHECK(!hi || memcmp(k,hi,KEYSIZE)<=0);
+      keys++;
+    }
+    break;
+  default:
+    CHECK(node.info.nodetype==BTREE_LEAF_NODE);
+  }
+}
+
+// Small blocks, so that interior nodes split again and again
+static void TestInterior(const char *name, const bool ascending)
+{
+  TestDisk d(name,3000,256);
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  VALUE_T value(VALUESIZE);
+  BTreeNode superblock;
+  SIZE_T keys = 0;
+  unsigned long i;
+
+  CHECK_RC(index.SetNodeCache(BTREE_CACHE_OFF,0),ERROR_NOERROR);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<NUMKEYS;i++) {
+    unsigned long k = ascending ? i : i*7919%NUMKEYS;
+    CHECK_RC(index.Insert(TestBlock(k*2,KEYSIZE),TestBlock(k,VALUESIZE)),ERROR_NOERROR);
+  }
+
+  CHECK_RC(superblock.Unserialize(d.cache,0),ERROR_NOERROR);
+  Walk(d,superblock.info.rootnode,0,0,keys);
+  CHECK(keys==NUMKEYS);
+
+  for (i=0;i<NUMKEYS;i++) {
+    CHECK_RC(index.Lookup(TestBlock(i*2,KEYSIZE),value),ERROR_NOERROR);
+    CHECK(SameBlock(value,TestBlock(i,VALUESIZE)));
+    CHECK_RC(index.Lookup(TestBlock(i*2+1,KEYSIZE),value),ERROR_NONEXISTENT);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  TestInterior("test_split",false);
+  TestInterior("test_split_ascending",true);
+  return TestSummary(argv[0]);
+}
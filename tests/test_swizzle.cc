@@ -0,0 +1,110 @@
+//
+// Swizzling: once warm, descents reach the pinned levels through
+// pointers instead of the block map, and splits that move or free
+// those nodes never leave a pointer to a stale one.
+//
+#include "btree_test.h"
+#include "btree_typed.h"
+
+#define KEYSIZE 8
+#define VALUESIZE 8
+
+// Small blocks, so the tree is deep and its root and interior nodes
+// split again and again while it is being read
+static void TestSplits(const char *name, const bool writeback)
+{
+  TestDisk d(name,6000,256);
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  VALUE_T value(VALUESIZE);
+  unsigned long i, j;
+  const unsigned long n = 4000;
+
+  CHECK_RC(index.SetNodeCache(BTREE_CACHE_2Q,32),ERROR_NOERROR);
+  CHECK_RC(index.SetWriteBack(writeback),ERROR_NOERROR);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<n;i++) {
+    CHECK_RC(index.Insert(TestBlock(i*7919%n,KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+    // look up what is already there after every split-prone insert
+    if (i%97==0) {
+      for (j=0;j<=i;j+=7) {
+	CHECK_RC(index.Lookup(TestBlock(j*7919%n,KEYSIZE),value),ERROR_NOERROR);
+	CHECK(SameBlock(value,TestBlock(j,VALUESIZE)));
+      }
+    }
+  }
+  CHECK(index.GetCacheStats().swizzled>0);
+}
+
+// A warm lookup takes every pinned level by pointer: at least the
+// root, each time
+static void TestWarm()
+{
+  TestDisk d("test_swizzle_warm",2000);
+  BTreeIndexT<unsigned long, unsigned long> index(d.cache);
+  unsigned long value;
+  unsigned long i;
+  SIZE_T before;
+  const unsigned long n = 3000;
+
+  CHECK_RC(index.SetNodeCache(BTREE_CACHE_LRU,1000),ERROR_NOERROR);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<n;i++) {
+    CHECK_RC(index.Insert(i,i*2),ERROR_NOERROR);
+  }
+  for (i=0;i<n;i++) {
+    CHECK_RC(index.Lookup(i,value),ERROR_NOERROR);
+  }
+
+  before=index.GetCacheStats().swizzled;
+  for (i=0;i<n;i++) {
+    CHECK_RC(index.Lookup(i,value),ERROR_NOERROR);
+    CHECK(value==i*2);
+  }
+  CHECK(index.GetCacheStats().swizzled-before>=n);
+
+  // and the untyped path too
+  VALUE_T raw(sizeof(unsigned long));
+  KEY_T key(sizeof(unsigned long));
+  before=index.GetCacheStats().swizzled;
+  for (i=0;i<n;i++) {
+    BTreeKeyCodec<unsigned long>::Encode(i,key.data);
+    CHECK_RC(index.BTreeIndex::Lookup(key,raw),ERROR_NOERROR);
+  }
+  CHECK(index.GetCacheStats().swizzled-before>=n);
+
+  // Emptying the cache drops every node the pointers lead to
+  CHECK_RC(index.SetNodeCache(BTREE_CACHE_2Q,100,2),ERROR_NOERROR);
+  for (i=0;i<n;i++) {
+    CHECK_RC(index.Lookup(i,value),ERROR_NOERROR);
+    CHECK(value==i*2);
+  }
+  CHECK(index.GetCacheStats().pinned==2);
+}
+
+// No cache, no pointers
+static void TestOff()
+{
+  TestDisk d("test_swizzle_off",2000);
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  VALUE_T value(VALUESIZE);
+  unsigned long i;
+
+  CHECK_RC(index.SetNodeCache(BTREE_CACHE_OFF,0),ERROR_NOERROR);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<1000;i++) {
+    CHECK_RC(index.Insert(TestBlock(i,KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+  }
+  for (i=0;i<1000;i++) {
+    CHECK_RC(index.Lookup(TestBlock(i,KEYSIZE),value),ERROR_NOERROR);
+  }
+  CHECK(index.GetCacheStats().swizzled==0);
+}
+
+int main(int argc, char *argv[])
+{
+  TestSplits("test_swizzle",false);
+  TestSplits("test_swizzle_writeback",true);
+  TestWarm();
+  TestOff();
+  return TestSummary(argv[0]);
+}
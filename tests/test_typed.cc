@@ -0,0 +1,225 @@
+//
+// Typed front end: keys encode in their natural order, either class
+// reads what the other wrote, and sizes that don't match are refused.
+//
+#include "btree_test.h"
+#include "btree_typed.h"
+
+typedef BTreeIndexT<int, long> IntIndex;
+
+static void TestSigned(const char *name, const bool compressed, const bool interpolate)
+{
+  TestDisk d(name,2000);
+  IntIndex index(d.cache);
+  long value;
+  SIZE_T superblock;
+  int i;
+
+  index.SetLeafCompression(compressed);
+  index.SetInterpolationSearch(interpolate);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<2001;i++) {
+    int k = i*7919%2001-1000;
+    CHECK_RC(index.Insert(k,k*3L),ERROR_NOERROR);
+  }
+  CHECK_RC(index.Insert(-1000,0),ERROR_CONFLICT);
+  for (i=-1000;i<=1000;i++) {
+    CHECK_RC(index.Lookup(i,value),ERROR_NOERROR);
+    CHECK(value==i*3L);
+  }
+  CHECK_RC(index.Lookup(-1001,value),ERROR_NONEXISTENT);
+  CHECK_RC(index.Lookup(1001,value),ERROR_NONEXISTENT);
+  for (i=-1000;i<=1000;i+=5) {
+    CHECK_RC(index.Update(i,-i),ERROR_NOERROR);
+    CHECK_RC(index.Lookup(i,value),ERROR_NOERROR);
+    CHECK(value==-i);
+  }
+  CHECK_RC(index.Update(1001,0),ERROR_NONEXISTENT);
+
+  // The untyped index finds the same keys by their encoding
+  CHECK_RC(index.Detach(superblock),ERROR_NOERROR);
+  BTreeIndex again(0,0,d.cache);
+  KEY_T key(sizeof(int));
+  VALUE_T raw(sizeof(long));
+  CHECK_RC(again.Attach(superblock,false),ERROR_NOERROR);
+  for (i=-1000;i<=1000;i++) {
+    IntIndex::KeyCodec::Encode(i,key.data);
+    CHECK_RC(again.Lookup(key,raw),ERROR_NOERROR);
+    CHECK(IntIndex::ValueCodec::Decode(raw.data)==((i+1000)%5 ? i*3L : -i));
+  }
+}
+
+// Negative keys sort before positive ones as bytes too
+static void TestEncoding()
+{
+  char a[sizeof(long long)];
+  char b[sizeof(long long)];
+
+  BTreeKeyCodec<int>::Encode(-1,a);
+  BTreeKeyCodec<int>::Encode(0,b);
+  CHECK(memcmp(a,b,sizeof(int))<0);
+  BTreeKeyCodec<long long>::Encode(-5000000000LL,a);
+  BTreeKeyCodec<long long>::Encode(3,b);
+  CHECK(memcmp(a,b,sizeof(long long))<0);
+  CHECK(BTreeKeyCodec<long long>::Decode(a)==-5000000000LL);
+  BTreeKeyCodec<unsigned short>::Encode(0x1234,a);
+  CHECK(a[0]==0x12 && a[1]==0x34);
+}
+
+// Any comparison that orders encodings as bytes will do
+struct MemcmpLess {
+  bool operator()(const char *a, const char *b) const { return memcmp(a,b,sizeof(long long))<0; }
+};
+
+static void TestCompare()
+{
+  TestDisk d("test_typed_compare",2000);
+  BTreeIndexT<long long, long, MemcmpLess> index(d.cache);
+  long value;
+  int i;
+
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<1500;i++) {
+    CHECK_RC(index.Insert((i*7919%1500-700)*1000000007LL,(long)i),ERROR_NOERROR);
+  }
+  for (i=0;i<1500;i++) {
+    CHECK_RC(index.Lookup((i*7919%1500-700)*1000000007LL,value),ERROR_NOERROR);
+    CHECK(value==i);
+  }
+  CHECK_RC(index.Lookup(1,value),ERROR_NONEXISTENT);
+}
+
+static void TestSizes()
+{
+  TestDisk d("test_typed_sizes",200);
+  BTreeIndex index(sizeof(int),sizeof(long),d.cache);
+  SIZE_T superblock;
+
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  CHECK_RC(index.Detach(superblock),ERROR_NOERROR);
+
+  BTreeIndexT<int, int> narrow(d.cache);
+  CHECK_RC(narrow.Attach(superblock,false),ERROR_SIZE);
+  BTreeIndexT<long, long> wide(d.cache);
+  CHECK_RC(wide.Attach(superblock,false),ERROR_SIZE);
+  IntIndex right(d.cache);
+  CHECK_RC(right.Attach(superblock,false),ERROR_NOERROR);
+  CHECK_RC(right.Insert(1,2L),ERROR_NOERROR);
+
+  // The refused attaches left the index as it was
+  long value;
+  CHECK_RC(right.Detach(superblock),ERROR_NOERROR);
+  IntIndex again(d.cache);
+  CHECK_RC(again.Attach(superblock,false),ERROR_NOERROR);
+  CHECK_RC(again.Lookup(1,value),ERROR_NOERROR);
+  CHECK(value==2L);
+}
+
+// A non-unique index attaches by the size of its values, not of its
+// leaf slots, and a lookup finds the smallest value
+static void TestNonUnique()
+{
+  TestDisk d("test_typed_nonunique",200);
+  BTreeIndex index(sizeof(int),sizeof(long),d.cache,false);
+  KEY_T key(sizeof(int));
+  VALUE_T raw(sizeof(long));
+  SIZE_T superblock;
+  long value;
+
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  IntIndex::KeyCodec::Encode(1,key.data);
+  IntIndex::ValueCodec::Encode(9,raw.data);
+  CHECK_RC(index.Insert(key,raw),ERROR_NOERROR);
+  IntIndex::ValueCodec::Encode(5,raw.data);
+  CHECK_RC(index.Insert(key,raw),ERROR_NOERROR);
+  IntIndex::KeyCodec::Encode(2,key.data);
+  IntIndex::ValueCodec::Encode(7,raw.data);
+  CHECK_RC(index.Insert(key,raw),ERROR_NOERROR);
+  CHECK_RC(index.Detach(superblock),ERROR_NOERROR);
+
+  IntIndex typed(d.cache);
+  CHECK_RC(typed.Attach(superblock,false),ERROR_NOERROR);
+  CHECK_RC(typed.Lookup(1,value),ERROR_NOERROR);
+  CHECK(value==5);
+  CHECK_RC(typed.Lookup(2,value),ERROR_NOERROR);
+  CHECK(value==7);
+  CHECK_RC(typed.Lookup(3,value),ERROR_NONEXISTENT);
+}
+
+// A non-unique index made through the typed front end
+static void TestNonUniqueTyped()
+{
+  TestDisk d("test_typed_nonunique_typed",2000);
+  IntIndex index(d.cache,false);
+  SIZE_T superblock;
+  long value;
+  int i;
+
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  // values under 256, whose bytes sort as the numbers do
+  for (i=0;i<300;i++) {
+    CHECK_RC(index.Insert(i%100,(long)(30-i/100*10)),ERROR_NOERROR);
+  }
+  for (i=0;i<100;i++) {
+    CHECK_RC(index.Lookup(i,value),ERROR_NOERROR);
+    CHECK(value==10);
+  }
+  CHECK_RC(index.Lookup(100,value),ERROR_NONEXISTENT);
+  CHECK_RC(index.Detach(superblock),ERROR_NOERROR);
+
+  // a unique typed index attaches to it as what it was made
+  IntIndex again(d.cache);
+  CHECK_RC(again.Attach(superblock,false),ERROR_NOERROR);
+  CHECK_RC(again.Insert(7,5L),ERROR_NOERROR);
+  CHECK_RC(again.Lookup(7,value),ERROR_NOERROR);
+  CHECK(value==5);
+}
+
+// With message buffers a key's newest slot can still be queued in an
+// interior node, and the typed lookup has to skip its head there too
+static void TestNonUniqueBuffered()
+{
+  TestDisk d("test_typed_nonunique_buffered",2000);
+  BTreeIndex index(sizeof(int),sizeof(long),d.cache,false);
+  KEY_T key(sizeof(int));
+  VALUE_T raw(sizeof(long));
+  SIZE_T superblock;
+  long value;
+  int i;
+
+  index.SetMessageBuffers(true);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<1000;i++) {
+    IntIndex::KeyCodec::Encode(i,key.data);
+    IntIndex::ValueCodec::Encode(i+5000L,raw.data);
+    CHECK_RC(index.Insert(key,raw),ERROR_NOERROR);
+  }
+  CHECK_RC(index.Detach(superblock),ERROR_NOERROR);
+
+  IntIndex typed(d.cache);
+  CHECK_RC(typed.Attach(superblock,false),ERROR_NOERROR);
+  for (i=0;i<1000;i++) {
+    CHECK_RC(typed.Lookup(i,value),ERROR_NOERROR);
+    CHECK(value==i+5000L);
+  }
+  CHECK_RC(typed.Lookup(1000,value),ERROR_NONEXISTENT);
+  CHECK_RC(typed.FlushMessageBuffers(),ERROR_NOERROR);
+  for (i=0;i<1000;i++) {
+    CHECK_RC(typed.Lookup(i,value),ERROR_NOERROR);
+    CHECK(value==i+5000L);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  TestEncoding();
+  TestSigned("test_typed",false,false);
+  TestSigned("test_typed_compressed",true,false);
+  TestSigned("test_typed_interpolate",false,true);
+  TestCompare();
+  TestSizes();
+  TestNonUnique();
+  TestNonUniqueTyped();
+  TestNonUniqueBuffered();
+  return TestSummary(argv[0]);
+}
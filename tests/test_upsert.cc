@@ -0,0 +1,172 @@
+//
+// Upsert and Modify: one descent for either outcome.  With the leaves
+// uncached, an Upsert of a key that is there reads as many nodes as
+// an Update of it, and one of a new key about as many.
+//
+#include <map>
+
+#include "btree_test.h"
+
+#define KEYSIZE 8
+#define VALUESIZE 8
+
+// Adds one to the big-endian value, or starts it at 1
+class Increment : public BTreeValueModifier {
+ public:
+  bool Modify(const KEY_T &key, VALUE_T &value, const bool exists) {
+    SIZE_T i;
+    for (i=value.length; i>0; i--) {
+      if (++value.data[i-1]!=0) {
+	break;
+      }
+    }
+    return true;
+  }
+};
+
+// Leaves values alone, and declines new keys
+class OnlyExisting : public BTreeValueModifier {
+ public:
+  bool Modify(const KEY_T &key, VALUE_T &value, const bool exists) {
+    return false;
+  }
+};
+
+static void TestValues(const char *name, const bool buffered)
+{
+  TestDisk d(name,2000);
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  std::map<unsigned long, unsigned long> ref;
+  Increment inc;
+  OnlyExisting none;
+  VALUE_T value(VALUESIZE);
+  SIZE_T superblock;
+  unsigned long i;
+
+  index.SetMessageBuffers(buffered);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<6000;i++) {
+    unsigned long k = i*7919%2000;
+    if (i%2) {
+      CHECK_RC(index.Modify(TestBlock(k,KEYSIZE),inc),ERROR_NOERROR);
+      ref[k]++;
+    } else {
+      CHECK_RC(index.Upsert(TestBlock(k,KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+      ref[k]=i;
+    }
+  }
+  CHECK_RC(index.Modify(TestBlock(5000,KEYSIZE),none),ERROR_NOERROR);
+  CHECK_RC(index.Lookup(TestBlock(5000,KEYSIZE),value),ERROR_NONEXISTENT);
+  CHECK_RC(index.Upsert(TestBlock(1,KEYSIZE),TestBlock(1,VALUESIZE+1)),ERROR_SIZE);
+  CHECK_RC(index.Update(TestBlock(1,KEYSIZE),TestBlock(1,VALUESIZE+1)),ERROR_SIZE);
+  CHECK_RC(index.Insert(TestBlock(5001,KEYSIZE),TestBlock(1,VALUESIZE-1)),ERROR_SIZE);
+
+  for (i=0;i<2000;i++) {
+    CHECK_RC(index.Modify(TestBlock(i,KEYSIZE),none),ERROR_NOERROR);
+    CHECK_RC(index.Lookup(TestBlock(i,KEYSIZE),value),ERROR_NOERROR);
+    CHECK(SameBlock(value,TestBlock(ref[i],VALUESIZE)));
+  }
+
+  CHECK_RC(index.Detach(superblock),ERROR_NOERROR);
+  BTreeIndex again(0,0,d.cache);
+  CHECK_RC(again.Attach(superblock,false),ERROR_NOERROR);
+  for (i=0;i<2000;i++) {
+    CHECK_RC(again.Lookup(TestBlock(i,KEYSIZE),value),ERROR_NOERROR);
+    CHECK(SameBlock(value,TestBlock(ref[i],VALUESIZE)));
+  }
+}
+
+// A non-unique key can only be modified while it has one value
+static void TestNonUnique()
+{
+  TestDisk d("test_upsert_nonunique",2000);
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache,false);
+  VALUE_T value(VALUESIZE);
+
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  CHECK_RC(index.Upsert(TestBlock(1,KEYSIZE),TestBlock(10,VALUESIZE)),ERROR_NOERROR);
+  CHECK_RC(index.Upsert(TestBlock(1,KEYSIZE),TestBlock(11,VALUESIZE)),ERROR_NOERROR);
+  CHECK_RC(index.Lookup(TestBlock(1,KEYSIZE),value),ERROR_NOERROR);
+  CHECK(SameBlock(value,TestBlock(11,VALUESIZE)));
+  CHECK_RC(index.Insert(TestBlock(1,KEYSIZE),TestBlock(12,VALUESIZE)),ERROR_NOERROR);
+  CHECK_RC(index.Upsert(TestBlock(1,KEYSIZE),TestBlock(13,VALUESIZE)),ERROR_CONFLICT);
+}
+
+//
+// Node reads per operation with the interior nodes pinned and no
+// leaves cached, so each descent reads exactly its leaf
+//
+static void TestReads()
+{
+  TestDisk d("test_upsert_reads",4000);
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  SIZE_T before;
+  unsigned long i;
+  const unsigned long n = 2000;
+
+  CHECK_RC(index.SetNodeCache(BTREE_CACHE_2Q,0),ERROR_NOERROR);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<n;i++) {
+    CHECK_RC(index.Insert(TestBlock(i*2*7919%(2*n),KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+  }
+
+  before=index.GetNodeReads();
+  for (i=0;i<n;i++) {
+    CHECK_RC(index.Update(TestBlock(i*2,KEYSIZE),TestBlock(i+1,VALUESIZE)),ERROR_NOERROR);
+  }
+  SIZE_T updates = index.GetNodeReads()-before;
+  CHECK(updates==n);
+
+  before=index.GetNodeReads();
+  for (i=0;i<n;i++) {
+    CHECK_RC(index.Upsert(TestBlock(i*2,KEYSIZE),TestBlock(i+2,VALUESIZE)),ERROR_NOERROR);
+  }
+  CHECK(index.GetNodeReads()-before==updates);
+
+  // new keys: one read each, plus what the splits they cause take
+  before=index.GetNodeReads();
+  for (i=0;i<n;i++) {
+    CHECK_RC(index.Upsert(TestBlock(i*2+1,KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+  }
+  CHECK(index.GetNodeReads()-before<n*13/10);
+}
+
+// A write of the wrong size is refused before the cached leaf it
+// would have gone into is touched
+static void TestWrongSize()
+{
+  TestDisk d("test_upsert_size",2000);
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  VALUE_T value(VALUESIZE);
+  SIZE_T superblock;
+  unsigned long i;
+
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  CHECK_RC(index.SetNodeCache(BTREE_CACHE_LRU,100),ERROR_NOERROR);
+  for (i=0;i<10;i+=2) {
+    CHECK_RC(index.Insert(TestBlock(i,KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+  }
+  CHECK_RC(index.Insert(TestBlock(5,KEYSIZE),TestBlock(5,VALUESIZE/2)),ERROR_SIZE);
+  CHECK_RC(index.Insert(TestBlock(5,KEYSIZE/2),TestBlock(5,VALUESIZE)),ERROR_SIZE);
+  CHECK_RC(index.Upsert(TestBlock(5,KEYSIZE),TestBlock(5,VALUESIZE/2)),ERROR_SIZE);
+  CHECK_RC(index.Upsert(TestBlock(5,KEYSIZE+1),TestBlock(5,VALUESIZE)),ERROR_SIZE);
+  CHECK_RC(index.Lookup(TestBlock(5,KEYSIZE),value),ERROR_NONEXISTENT);
+  CHECK_RC(index.Insert(TestBlock(5,KEYSIZE),TestBlock(5,VALUESIZE)),ERROR_NOERROR);
+  CHECK_RC(index.Lookup(TestBlock(5,KEYSIZE),value),ERROR_NOERROR);
+  CHECK(SameBlock(value,TestBlock(5,VALUESIZE)));
+  for (i=0;i<10;i+=2) {
+    CHECK_RC(index.Lookup(TestBlock(i,KEYSIZE),value),ERROR_NOERROR);
+    CHECK(SameBlock(value,TestBlock(i,VALUESIZE)));
+  }
+  CHECK_RC(index.Detach(superblock),ERROR_NOERROR);
+}
+
+int main(int argc, char *argv[])
+{
+  TestValues("test_upsert",false);
+  TestValues("test_upsert_buffered",true);
+  TestNonUnique();
+  TestReads();
+  TestWrongSize();
+  return TestSummary(argv[0]);
+}
@@ -0,0 +1,261 @@
+//
+// Warm restart: Detach records the cached blocks, and the next Attach
+// reads them back, so the keys that were hot cost no reads.  A set
+// that went stale, or a block in it that went bad, costs reads but
+// never a wrong answer.
+//
+#include "btree_test.h"
+
+#define KEYSIZE 8
+#define VALUESIZE 8
+#define NUMKEYS 3000
+#define HOTKEYS 300
+
+// Fill an index, warm its cache on the first HOTKEYS keys, and detach
+static SIZE_T Build(TestDisk &d, const bool warm)
+{
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  VALUE_T value(VALUESIZE);
+  SIZE_T superblock;
+  unsigned long i;
+
+  CHECK_RC(index.SetNodeCache(BTREE_CACHE_LRU,100),ERROR_NOERROR);
+  index.SetWarmRestart(warm);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<NUMKEYS;i++) {
+    CHECK_RC(index.Insert(TestBlock(i*7919%NUMKEYS,KEYSIZE),TestBlock(i*7919%NUMKEYS,VALUESIZE)),ERROR_NOERROR);
+  }
+  for (i=0;i<HOTKEYS;i++) {
+    CHECK_RC(index.Lookup(TestBlock(i,KEYSIZE),value),ERROR_NOERROR);
+  }
+  CHECK_RC(index.Detach(superblock),ERROR_NOERROR);
+  return superblock;
+}
+
+// Node reads it takes to look up the hot keys, and every key after
+static SIZE_T HotReads(BTreeIndex &index)
+{
+  VALUE_T value(VALUESIZE);
+  SIZE_T before = index.GetNodeReads();
+  SIZE_T reads;
+  unsigned long i;
+
+  for (i=0;i<HOTKEYS;i++) {
+    CHECK_RC(index.Lookup(TestBlock(i,KEYSIZE),value),ERROR_NOERROR);
+  }
+  reads=index.GetNodeReads()-before;
+  for (i=0;i<NUMKEYS;i++) {
+    CHECK_RC(index.Lookup(TestBlock(i,KEYSIZE),value),ERROR_NOERROR);
+    CHECK(SameBlock(value,TestBlock(i,VALUESIZE)));
+  }
+  return reads;
+}
+
+static void TestRestart()
+{
+  TestDisk d("test_warm",2000);
+  SIZE_T superblock = Build(d,true);
+
+  BTreeIndex warm(0,0,d.cache);
+  CHECK_RC(warm.SetNodeCache(BTREE_CACHE_LRU,100),ERROR_NOERROR);
+  CHECK_RC(warm.Attach(superblock,false),ERROR_NOERROR);
+  CHECK(warm.GetNodeReads()>0);
+  CHECK(HotReads(warm)==0);
+
+  // Without a cache to fill, only the set itself is read
+  BTreeIndex off(0,0,d.cache);
+  CHECK_RC(off.SetNodeCache(BTREE_CACHE_OFF,0),ERROR_NOERROR);
+  CHECK_RC(off.Attach(superblock,false),ERROR_NOERROR);
+  CHECK(off.GetNodeReads()<=2);
+  CHECK(HotReads(off)>=HOTKEYS);
+}
+
+// Turning it off frees the recorded set at the next Detach, and a
+// later Attach starts cold
+static void TestTurnOff()
+{
+  TestDisk d("test_warm_off",2000);
+  SIZE_T superblock = Build(d,true);
+
+  BTreeIndex index(0,0,d.cache);
+  CHECK_RC(index.SetNodeCache(BTREE_CACHE_LRU,100),ERROR_NOERROR);
+  CHECK_RC(index.Attach(superblock,false),ERROR_NOERROR);
+  index.SetWarmRestart(false);
+  CHECK_RC(index.Detach(superblock),ERROR_NOERROR);
+
+  BTreeIndex cold(0,0,d.cache);
+  CHECK_RC(cold.SetNodeCache(BTREE_CACHE_LRU,100),ERROR_NOERROR);
+  CHECK_RC(cold.Attach(superblock,false),ERROR_NOERROR);
+  CHECK(cold.GetNodeReads()==0);
+  CHECK(HotReads(cold)>0);
+}
+
+//
+// The recorded blocks are rewritten after the set was stored: a
+// crash before the next Detach leaves the old set behind, pointing
+// at blocks that now hold other nodes, or nothing
+//
+static void TestStale()
+{
+  TestDisk d("test_warm_stale",4000);
+  SIZE_T superblock = Build(d,true);
+  BTreeIndex *index = new BTreeIndex(0,0,d.cache);
+  VALUE_T value(VALUESIZE);
+  unsigned long i;
+
+  CHECK_RC(index->Attach(superblock,false),ERROR_NOERROR);
+  for (i=NUMKEYS;i<3*NUMKEYS;i++) {
+    CHECK_RC(index->Insert(TestBlock(i,KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+  }
+  for (i=0;i<NUMKEYS;i+=2) {
+    CHECK_RC(index->Update(TestBlock(i,KEYSIZE),TestBlock(i+1,VALUESIZE)),ERROR_NOERROR);
+  }
+  // crash: index is dropped without Detach or its destructor
+
+  BTreeIndex after(0,0,d.cache);
+  CHECK_RC(after.SetNodeCache(BTREE_CACHE_LRU,100),ERROR_NOERROR);
+  CHECK_RC(after.Attach(superblock,false),ERROR_NOERROR);
+  for (i=0;i<3*NUMKEYS;i++) {
+    CHECK_RC(after.Lookup(TestBlock(i,KEYSIZE),value),ERROR_NOERROR);
+    CHECK(SameBlock(value,TestBlock(i<NUMKEYS && i%2==0 ? i+1 : i,VALUESIZE)));
+  }
+}
+
+// A recorded block that fails its checksum is skipped: Attach still
+// succeeds, and only the keys under it fail
+static void TestBadBlock()
+{
+  TestDisk d("test_warm_bad",2000);
+  SIZE_T superblock = Build(d,true);
+  VALUE_T value(VALUESIZE);
+  BTreeNode node;
+  Block raw;
+  SIZE_T n;
+  unsigned long i;
+  int failed = 0;
+  ERROR_T rc;
+
+  // the first leaf holds key 0, which was hot
+  for (n=1;n<d.cache->GetNumBlocks();n++) {
+    if (node.Unserialize(d.cache,n)==ERROR_NOERROR
+	&& node.info.nodetype==BTREE_LEAF_NODE && node.info.numkeys>0
+	&& memcmp(node.ResolveKey(0),TestBlock(0,KEYSIZE).data,KEYSIZE)==0) {
+      break;
+    }
+  }
+  CHECK(n<d.cache->GetNumBlocks());
+  CHECK_RC(d.cache->ReadBlock(n,raw),ERROR_NOERROR);
+  raw.data[raw.length/2]^=0x5a;
+  CHECK_RC(d.cache->WriteBlock(n,raw),ERROR_NOERROR);
+
+  BTreeIndex index(0,0,d.cache);
+  CHECK_RC(index.SetNodeCache(BTREE_CACHE_LRU,100),ERROR_NOERROR);
+  CHECK_RC(index.Attach(superblock,false),ERROR_NOERROR);
+  CHECK(index.GetChecksumFailures()==1);
+  for (i=0;i<NUMKEYS;i++) {
+    rc=index.Lookup(TestBlock(i,KEYSIZE),value);
+    if (rc==ERROR_CHECKSUM) {
+      failed++;
+    } else {
+      CHECK_RC(rc,ERROR_NOERROR);
+    }
+  }
+  CHECK(failed>0 && failed<HOTKEYS);
+}
+
+// A block of the chain holding the set itself that fails its
+// checksum: nothing is preloaded, but Attach succeeds, every key is
+// found, and the next Detach records a good set again
+static void TestBadChain()
+{
+  TestDisk d("test_warm_badchain",2000);
+  SIZE_T superblock = Build(d,true);
+  VALUE_T value(VALUESIZE);
+  BTreeNode node;
+  Block raw;
+  SIZE_T n;
+  unsigned long i;
+
+  for (n=1;n<d.cache->GetNumBlocks();n++) {
+    if (node.Unserialize(d.cache,n)==ERROR_NOERROR
+	&& node.info.nodetype==BTREE_HOTSET_BLOCK) {
+      break;
+    }
+  }
+  CHECK(n<d.cache->GetNumBlocks());
+  CHECK_RC(d.cache->ReadBlock(n,raw),ERROR_NOERROR);
+  raw.data[raw.length/2]^=0x5a;
+  CHECK_RC(d.cache->WriteBlock(n,raw),ERROR_NOERROR);
+
+  BTreeIndex index(0,0,d.cache);
+  CHECK_RC(index.SetNodeCache(BTREE_CACHE_LRU,100),ERROR_NOERROR);
+  index.SetWarmRestart(true);
+  CHECK_RC(index.Attach(superblock,false),ERROR_NOERROR);
+  CHECK(index.GetChecksumFailures()==1);
+  CHECK(index.GetCacheStats().pinned+index.GetCacheStats().resident==0);
+  for (i=0;i<HOTKEYS;i++) {
+    CHECK_RC(index.Lookup(TestBlock(i,KEYSIZE),value),ERROR_NOERROR);
+    CHECK(SameBlock(value,TestBlock(i,VALUESIZE)));
+  }
+  CHECK(index.GetNodeReads()>1);
+  CHECK_RC(index.Detach(superblock),ERROR_NOERROR);
+
+  BTreeIndex warm(0,0,d.cache);
+  CHECK_RC(warm.SetNodeCache(BTREE_CACHE_LRU,100),ERROR_NOERROR);
+  CHECK_RC(warm.Attach(superblock,false),ERROR_NOERROR);
+  CHECK(warm.GetChecksumFailures()==0);
+  CHECK(HotReads(warm)==0);
+}
+
+//
+// A pin budget of one goes to the root, whatever its block number:
+// with no room for anything else, a warm lookup reads every level
+// but the root
+//
+static void TestLevels()
+{
+  TestDisk d("test_warm_levels",4000);
+  BTreeIndex index(64,VALUESIZE,d.cache);
+  VALUE_T value(VALUESIZE);
+  SIZE_T superblock;
+  SIZE_T before;
+  SIZE_T height;
+  unsigned long i;
+
+  CHECK_RC(index.SetNodeCache(BTREE_CACHE_LRU,1000),ERROR_NOERROR);
+  index.SetWarmRestart(true);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<NUMKEYS;i++) {
+    CHECK_RC(index.Insert(TestBlock(i*7919%NUMKEYS,64),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+  }
+  CHECK_RC(index.Detach(superblock),ERROR_NOERROR);
+
+  BTreeIndex cold(0,0,d.cache);
+  CHECK_RC(cold.SetNodeCache(BTREE_CACHE_OFF,0),ERROR_NOERROR);
+  CHECK_RC(cold.Attach(superblock,false),ERROR_NOERROR);
+  before=cold.GetNodeReads();
+  CHECK_RC(cold.Lookup(TestBlock(5,64),value),ERROR_NOERROR);
+  height=cold.GetNodeReads()-before;
+  CHECK(height>=3);
+
+  BTreeIndex warm(0,0,d.cache);
+  CHECK_RC(warm.SetNodeCache(BTREE_CACHE_LRU,0,1),ERROR_NOERROR);
+  CHECK_RC(warm.Attach(superblock,false),ERROR_NOERROR);
+  CHECK(warm.GetCacheStats().pinned==1);
+  for (i=0;i<NUMKEYS;i+=101) {
+    before=warm.GetNodeReads();
+    CHECK_RC(warm.Lookup(TestBlock(i,64),value),ERROR_NOERROR);
+    CHECK(warm.GetNodeReads()-before==height-1);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  TestRestart();
+  TestTurnOff();
+  TestStale();
+  TestBadBlock();
+  TestBadChain();
+  TestLevels();
+  return TestSummary(argv[0]);
+}
@@ -0,0 +1,183 @@
+//
+// Write-back: changed nodes stay dirty in the node cache until they
+// are evicted or checkpointed, so repeated changes to a node cost one
+// write, and a crash loses exactly what was not written yet.
+//
+#include "btree_test.h"
+
+#define KEYSIZE 8
+#define VALUESIZE 8
+
+// What a fresh index attached to the disk finds for key, as if the
+// writer had crashed: only blocks already written are seen
+static ERROR_T OnDisk(BufferCache *cache, const unsigned long key, VALUE_T &value)
+{
+  BTreeIndex after(0,0,cache);
+  ERROR_T rc;
+
+  CHECK_RC(after.SetNodeCache(BTREE_CACHE_OFF,0),ERROR_NOERROR);
+  rc=after.Attach(0,false);
+  if (rc) { return rc; }
+  return after.Lookup(TestBlock(key,KEYSIZE),value);
+}
+
+static void TestCoalesce()
+{
+  TestDisk d("test_writeback",2000);
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  VALUE_T value(VALUESIZE);
+  SIZE_T superblock;
+  SIZE_T before;
+  unsigned long i;
+
+  CHECK_RC(index.SetNodeCache(BTREE_CACHE_LRU,1000),ERROR_NOERROR);
+  CHECK_RC(index.SetWriteBack(true),ERROR_NOERROR);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<500;i++) {
+    CHECK_RC(index.Insert(TestBlock(i,KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+  }
+  CHECK(index.GetCacheStats().dirty>0);
+  CHECK_RC(index.Checkpoint(),ERROR_NOERROR);
+  CHECK(index.GetCacheStats().dirty==0);
+
+  // a hot leaf: a thousand changes, no writes until the checkpoint
+  before=index.GetCacheStats().writebacks;
+  for (i=0;i<1000;i++) {
+    CHECK_RC(index.Update(TestBlock(7,KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+  }
+  CHECK(index.GetCacheStats().writebacks==before);
+  CHECK(index.GetCacheStats().dirty==1);
+  CHECK_RC(OnDisk(d.cache,7,value),ERROR_NOERROR);
+  CHECK(SameBlock(value,TestBlock(7,VALUESIZE)));
+
+  CHECK_RC(index.Checkpoint(),ERROR_NOERROR);
+  CHECK(index.GetCacheStats().writebacks==before+1);
+  CHECK_RC(OnDisk(d.cache,7,value),ERROR_NOERROR);
+  CHECK(SameBlock(value,TestBlock(999,VALUESIZE)));
+
+  CHECK_RC(index.Detach(superblock),ERROR_NOERROR);
+}
+
+// A small cache: dirty leaves are written as they are evicted, and
+// nothing is lost by the time the index is detached
+static void TestEviction(const BTreeCachePolicy policy)
+{
+  TestDisk d("test_writeback_evict",2000);
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  VALUE_T value(VALUESIZE);
+  SIZE_T superblock;
+  unsigned long i;
+
+  CHECK_RC(index.SetNodeCache(policy,8),ERROR_NOERROR);
+  CHECK_RC(index.SetWriteBack(true),ERROR_NOERROR);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<3000;i++) {
+    CHECK_RC(index.Insert(TestBlock(i*7919%3000,KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+  }
+  CHECK(index.GetCacheStats().writebacks>0);
+  CHECK(index.GetCacheStats().resident<=8);
+  CHECK_RC(index.Detach(superblock),ERROR_NOERROR);
+
+  BTreeIndex again(0,0,d.cache);
+  CHECK_RC(again.Attach(superblock,false),ERROR_NOERROR);
+  for (i=0;i<3000;i++) {
+    CHECK_RC(again.Lookup(TestBlock(i*7919%3000,KEYSIZE),value),ERROR_NOERROR);
+    CHECK(SameBlock(value,TestBlock(i,VALUESIZE)));
+  }
+}
+
+// Turning write-back off writes everything out, and from then on
+// nothing is deferred
+static void TestTurnOff()
+{
+  TestDisk d("test_writeback_off",2000);
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  VALUE_T value(VALUESIZE);
+  unsigned long i;
+
+  CHECK_RC(index.SetNodeCache(BTREE_CACHE_LRU,1000),ERROR_NOERROR);
+  CHECK_RC(index.SetWriteBack(true),ERROR_NOERROR);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<1000;i++) {
+    CHECK_RC(index.Insert(TestBlock(i,KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+  }
+  CHECK_RC(index.SetWriteBack(false),ERROR_NOERROR);
+  CHECK(index.GetCacheStats().dirty==0);
+  for (i=0;i<1000;i+=50) {
+    CHECK_RC(OnDisk(d.cache,i,value),ERROR_NOERROR);
+    CHECK(SameBlock(value,TestBlock(i,VALUESIZE)));
+  }
+
+  for (i=1000;i<1100;i++) {
+    CHECK_RC(index.Insert(TestBlock(i,KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+    CHECK(index.GetCacheStats().dirty==0);
+  }
+  CHECK_RC(OnDisk(d.cache,1099,value),ERROR_NOERROR);
+}
+
+// Reconfiguring the node cache empties it, so what it deferred is
+// checkpointed first
+static void TestReconfigure()
+{
+  TestDisk d("test_writeback_reconfigure",2000);
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  VALUE_T value(VALUESIZE);
+  unsigned long i;
+
+  CHECK_RC(index.SetNodeCache(BTREE_CACHE_LRU,1000),ERROR_NOERROR);
+  CHECK_RC(index.SetWriteBack(true),ERROR_NOERROR);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<1000;i++) {
+    CHECK_RC(index.Insert(TestBlock(i,KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+  }
+  CHECK(index.GetCacheStats().dirty>0);
+  CHECK_RC(index.SetNodeCache(BTREE_CACHE_2Q,10),ERROR_NOERROR);
+  CHECK(index.GetCacheStats().dirty==0);
+  for (i=0;i<1000;i+=50) {
+    CHECK_RC(OnDisk(d.cache,i,value),ERROR_NOERROR);
+    CHECK(SameBlock(value,TestBlock(i,VALUESIZE)));
+  }
+}
+
+// Attaching again without a Detach writes out what the previous
+// attach deferred, its superblock included, before dropping it
+static void TestReattach()
+{
+  TestDisk d("test_writeback_reattach",2000);
+  BTreeIndex index(KEYSIZE,VALUESIZE,d.cache);
+  VALUE_T value(VALUESIZE);
+  unsigned long i;
+
+  CHECK_RC(index.SetNodeCache(BTREE_CACHE_LRU,1000),ERROR_NOERROR);
+  CHECK_RC(index.SetWriteBack(true),ERROR_NOERROR);
+  CHECK_RC(index.Attach(0,true),ERROR_NOERROR);
+  for (i=0;i<1000;i++) {
+    CHECK_RC(index.Insert(TestBlock(i,KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+  }
+  CHECK(index.GetCacheStats().dirty>0);
+  CHECK_RC(index.Attach(0,false),ERROR_NOERROR);
+  CHECK(index.GetCacheStats().dirty==0);
+  for (i=0;i<1000;i++) {
+    CHECK_RC(index.Lookup(TestBlock(i,KEYSIZE),value),ERROR_NOERROR);
+    CHECK(SameBlock(value,TestBlock(i,VALUESIZE)));
+  }
+  // and the blocks the inserts took are not handed out twice
+  for (i=1000;i<1500;i++) {
+    CHECK_RC(index.Insert(TestBlock(i,KEYSIZE),TestBlock(i,VALUESIZE)),ERROR_NOERROR);
+  }
+  for (i=0;i<1500;i+=7) {
+    CHECK_RC(index.Lookup(TestBlock(i,KEYSIZE),value),ERROR_NOERROR);
+    CHECK(SameBlock(value,TestBlock(i,VALUESIZE)));
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  TestCoalesce();
+  TestEviction(BTREE_CACHE_LRU);
+  TestEviction(BTREE_CACHE_2Q);
+  TestTurnOff();
+  TestReconfigure();
+  TestReattach();
+  return TestSummary(argv[0]);
+}